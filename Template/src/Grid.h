@@ -4,40 +4,75 @@
 
 #ifndef RAYTRACER_VOXEL_H
 #define RAYTRACER_VOXEL_H
+#include <array>
+#include <atomic>
 #include <vector>
 
 #include "aabb.h"
+#include "boxoverlap.h"
 #include "configuration.hpp"
+#include "leafprimitives.h"
 #include "primitive.h"
+#include "threadpool.h"
+#include "trianglemesh.h"
 #include "world.h"
 
 
-class Voxel {
+// Remembers which primitives a ray has tested already, so a primitive that spans many voxels is intersected once per ray (mailboxing).
+// It is a small direct-mapped table on the stack instead of a tag per primitive, so any number of threads can trace through one grid;
+// two primitives that share a slot only cost a repeated test.
+class Mailbox
+{
     public:
-        vector<int> objects;
+        Mailbox() { std::fill(std::begin(ids), std::end(ids), UINT32_MAX); }
+
+        /// <summary>
+        /// Checks if a primitive was tested already, and marks it as tested.
+        /// </summary>
+        bool seen(uint32_t id)
+        {
+            uint32_t& slot = ids[id & (size - 1)];
+            if (slot == id)
+                return true;
+            slot = id;
+            return false;
+        }
+
+    private:
+        static constexpr int size = 64;
+        uint32_t ids[size];
 };
 
+// The primitives of all voxels are stored in compressed sparse row form: the primitive indices of voxel i are
+// cellPrimitives[cellOffsets[i]] up to cellPrimitives[cellOffsets[i + 1]]. Empty voxels take only their offset.
 class Grid : public Primitive
 {
     public:
-        vector<Voxel> voxels;
-        vector<shared_ptr<Primitive>> primitives;
+        vector<uint32_t> cellOffsets;
+        vector<uint32_t> cellPrimitives;
+        LeafPrimitives primitives;
+
+        // Optional: the Chebyshev distance of every voxel to the nearest filled voxel, in voxels (0 for a filled voxel, at most 255)
+        vector<uint8_t> cellDistance;
 
         Grid() = default;
 
-        explicit Grid(const World& world)
+        /// <summary>
+        /// Builds the grid. Every primitive goes into the voxels its bounding box touches; with conf::grid_exact_overlap, triangles only
+        /// go into the voxels they really intersect. With a thread pool, the primitives are put into the voxels in parallel.
+        /// </summary>
+        /// <param name="world">= The primitives.</param>
+        /// <param name="pool">= Optional thread pool for the build; the grid is the same as a serial build.</param>
+        explicit Grid(const World& world, ThreadPool* pool = nullptr)
         {
-            primitives = world.objects;
+            primitives.build(world.objects);
 
             worldMin = {world.hitBox().x.min, world.hitBox().y.min, world.hitBox().z.min};
             worldMax = {world.hitBox().x.max, world.hitBox().y.max, world.hitBox().z.max};
 
             auto worldDimensions = worldMax - worldMin;
 
-            boxesAlongX = conf::voxels_on_x;
-            auto voxel_size = worldDimensions.x() / boxesAlongX;
-            boxesAlongY = ceil(worldDimensions.y() / voxel_size);
-            boxesAlongZ = ceil(worldDimensions.z() / voxel_size);
+            chooseResolution(worldDimensions);
 			std::cout << boxesAlongX << " boxes along X." << std::endl;
 			std::cout << boxesAlongY << " boxes along Y." << std::endl;
 			std::cout << boxesAlongZ << " boxes along Z." << std::endl;
@@ -48,28 +83,114 @@ class Grid : public Primitive
                 worldDimensions.z() / boxesAlongZ
             };
 
+            // An axis without extent has a single voxel; any size works for it, as long as it is not zero
+            for (int a = 0; a < 3; a++)
+                if (cellDimensions[a] <= 0)
+                    cellDimensions[a] = 1;
+
             std::cout << "Cell dimensions.x: " << cellDimensions.x() << std::endl;
             std::cout << "Cell dimensions.y: " << cellDimensions.y() << std::endl;
             std::cout << "Cell dimensions.z: " << cellDimensions.z() << std::endl;
 
 			std::cout << boxesAlongX * boxesAlongY * boxesAlongZ << " voxels to be created." << std::endl;
-            voxels.resize(boxesAlongX * boxesAlongY * boxesAlongZ);
+            size_t numVoxels = size_t(boxesAlongX) * boxesAlongY * boxesAlongZ;
+
+            // Triangles are tested against the voxels with their corners
+            vector<std::array<Point3, 3>> corners(primitives.size());
+            vector<bool> isTriangle(primitives.size(), false);
+            for (size_t i = 0; i < primitives.size(); i++)
+                isTriangle[i] = triangle_corners(*primitives[i], corners[i]);
+
+            // The primitives are split into blocks, which are the jobs of the build
+            const size_t blockSize = 1024;
+            size_t numBlocks = (primitives.size() + blockSize - 1) / blockSize;
+            auto forEachBlock = [&](auto job)
+            {
+                if (pool)
+                    pool->run(numBlocks, [&](size_t block, unsigned int) { job(block); });
+                else
+                    for (size_t block = 0; block < numBlocks; block++)
+                        job(block);
+            };
 
-            for (int i = 0; i < world.objects.size(); i++)
-                insertPrimitiveIndex(i, world.objects[i]->hitBox());
+            // First pass: find the voxels of every primitive and count the primitives of every voxel with atomic counters.
+            // Each block keeps its (primitive, voxel) pairs, so the overlap tests are not repeated in the second pass
+            vector<std::atomic<uint32_t>> counts(numVoxels);
+            vector<vector<std::pair<uint32_t, uint32_t>>> blockRefs(numBlocks);
+            vector<size_t> blockBoxRefs(numBlocks, 0);
+            bool exact = conf::grid_exact_overlap;
 
+            forEachBlock([&](size_t block)
+            {
+                auto& refs = blockRefs[block];
+                for (size_t i = block * blockSize; i < std::min(primitives.size(), (block + 1) * blockSize); i++)
+                {
+                    size_t first = refs.size();
+                    forEachVoxel(primitives[i]->hitBox(), [&](int cell, int x, int y, int z)
+                    {
+                        blockBoxRefs[block]++;
+                        if (!exact || !isTriangle[i] || triangle_box_overlap(corners[i].data(), voxelCenter(x, y, z), cellDimensions / 2))
+                            refs.push_back({ uint32_t(i), uint32_t(cell) });
+                    });
+
+                    // A degenerate triangle may fail every test; it keeps its bounding box voxels so it is never lost
+                    if (refs.size() == first)
+                        forEachVoxel(primitives[i]->hitBox(), [&](int cell, int, int, int) { refs.push_back({ uint32_t(i), uint32_t(cell) }); });
+
+                    for (size_t r = first; r < refs.size(); r++)
+                        counts[refs[r].second].fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+
+            // Turn the counts into offsets with a prefix sum
+            cellOffsets.assign(numVoxels + 1, 0);
+            for (size_t i = 0; i < numVoxels; i++)
+                cellOffsets[i + 1] = cellOffsets[i] + counts[i].load(std::memory_order_relaxed);
+
+            // Second pass: write the primitive indices, filling every voxel from its offset
             vector<bool> exists;
             exists.resize(primitives.size(), false);
 
-            /*for (int z = 0; z < boxesAlongZ; z++)
-                for (int y = 0; y < boxesAlongY; y++)
-                    for (int x = 0; x < boxesAlongX; x++) {
-                        std::cout << "Voxel " << Vec3(x, y, z) << " has primitives: ";
-                        for (auto object: voxels[index3(x, y, z)].objects) {
-                            std::cout << object << " ";
-                        }
-                        std::cout << std::endl;
-                    }*/
+            cellPrimitives.resize(cellOffsets[numVoxels]);
+            for (size_t i = 0; i < numVoxels; i++)
+                counts[i].store(cellOffsets[i], std::memory_order_relaxed);
+
+            forEachBlock([&](size_t block)
+            {
+                for (auto [prim, cell] : blockRefs[block])
+                    cellPrimitives[counts[cell].fetch_add(1, std::memory_order_relaxed)] = prim;
+                vector<std::pair<uint32_t, uint32_t>>().swap(blockRefs[block]);
+            });
+
+            // The threads fill a voxel in any order; sorting every voxel makes the grid the same as a serial build
+            size_t voxelBlocks = (numVoxels + blockSize * 16 - 1) / (blockSize * 16);
+            auto sortVoxels = [&](size_t block)
+            {
+                for (size_t i = block * blockSize * 16; i < std::min(numVoxels, (block + 1) * blockSize * 16); i++)
+                    std::sort(cellPrimitives.begin() + cellOffsets[i], cellPrimitives.begin() + cellOffsets[i + 1]);
+            };
+            if (pool)
+                pool->run(voxelBlocks, [&](size_t block, unsigned int) { sortVoxels(block); });
+            else
+                for (size_t block = 0; block < voxelBlocks; block++)
+                    sortVoxels(block);
+
+            for (uint32_t prim : cellPrimitives)
+                exists[prim] = true;
+
+            size_t boxRefs = 0;
+            for (size_t refs : blockBoxRefs)
+                boxRefs += refs;
+            std::cout << "References per primitive: " << double(boxRefs) / primitives.size() << " by bounding box";
+            if (exact)
+                std::cout << ", " << double(cellPrimitives.size()) / primitives.size() << " after the exact triangle test";
+            std::cout << std::endl;
+
+            std::cout << cellPrimitives.size() << " primitive references, " << memoryBytes() / 1024 << " KiB of voxel data" << std::endl;
+            printFill();
+
+            if (conf::grid_distance_field)
+                buildDistanceField();
 
             bool acc = true;
             for (bool exist: exists) {
@@ -78,60 +199,87 @@ class Grid : public Primitive
 
             if (acc) std::cout << "All primitives exist in at least one voxel" << std::endl;
             else std::cout << "Not all primitives exist in at least one voxel" << std::endl;
+        }
 
-            /*
-            int boxes_along_x = conf::boxes_along_x;
-            int boxes_along_y = boxes_along_x * (int) ceil(world.hitBox().y.size() / world.hitBox().x.size());
-            int boxes_along_z = boxes_along_x * (int) ceil(world.hitBox().z.size() / world.hitBox().x.size());
-
-            voxels.reserve(boxes_along_x * boxes_along_y * boxes_along_z);
-
-            double sizeX = world.hitBox().x.size() / boxes_along_x;
-            double sizeY = world.hitBox().y.size() / boxes_along_y;
-            double sizeZ = world.hitBox().z.size() / boxes_along_z;
+        aabb hitBox() const override { return aabb(worldMin, worldMax); }
 
-            for (int x = 0; x < boxes_along_x - 1; x++)
-                for (int y = 0; y < boxes_along_y - 1; y++)
-                    for (int z = 0; z < boxes_along_z - 1; z++)
-                    {
-                        auto interX = Interval(world.hitBox().x.min + x * sizeX, world.hitBox().x.max + (x + 1) * sizeX);
-                        auto interY = Interval(world.hitBox().y.min + y * sizeY, world.hitBox().y.max + (y + 1) * sizeY);
-                        auto interZ = Interval(world.hitBox().z.min + z * sizeZ, world.hitBox().z.max + (z + 1) * sizeZ);
-                        voxels.push_back(Voxel(aabb(interX, interY, interZ)));
-                    }
+        /// <summary>
+        /// Gets the memory used by the voxel offsets and primitive references, in bytes.
+        /// </summary>
+        size_t memoryBytes() const { return (cellOffsets.size() + cellPrimitives.size()) * sizeof(uint32_t) + cellDistance.size(); }
 
-            for (auto vox: voxels)
+        /// <summary>
+        /// Computes the distance field used to skip empty space: the Chebyshev (chessboard) distance of every voxel to the nearest
+        /// filled voxel. An empty voxel at distance d is the center of a cube of 2d - 1 voxels on a side that are all empty.
+        /// The distances come from a two-pass chamfer transform with unit weights over the 26 neighbours of a voxel, which is exact
+        /// for the Chebyshev distance: a forward pass takes the neighbours before a voxel in memory order, a backward pass the ones after it.
+        /// </summary>
+        void buildDistanceField()
+        {
+            size_t numVoxels = cellOffsets.size() - 1;
+            cellDistance.assign(numVoxels, 255);
+            for (size_t i = 0; i < numVoxels; i++)
+                if (cellOffsets[i + 1] > cellOffsets[i])
+                    cellDistance[i] = 0;
+
+            // The 13 neighbours that come before a voxel in memory order
+            std::array<std::array<int, 3>, 13> before;
+            int n = 0;
+            for (int dz = -1; dz <= 0; dz++)
+                for (int dy = -1; dy <= 1; dy++)
+                    for (int dx = -1; dx <= 1; dx++)
+                        if (dz < 0 || dy < 0 || (dy == 0 && dx < 0))
+                            before[n++] = { dx, dy, dz };
+
+            auto relax = [&](int x, int y, int z, int sign)
             {
-                std::cout << "X: " << vox.bbox.x.min << " - " << vox.bbox.x.max << std::endl;
-                std::cout << "Y: " << vox.bbox.y.min << " - " << vox.bbox.y.max << std::endl;
-                std::cout << "Z: " << vox.bbox.z.min << " - " << vox.bbox.z.max << std::endl;
-                std::cout << std::endl;
-            }
-            */
+                uint8_t& d = cellDistance[index3(x, y, z)];
+                for (const auto& o : before)
+                {
+                    int nx = x + sign * o[0], ny = y + sign * o[1], nz = z + sign * o[2];
+                    if (nx < 0 || nx >= boxesAlongX || ny < 0 || ny >= boxesAlongY || nz < 0 || nz >= boxesAlongZ)
+                        continue;
+                    d = uint8_t(std::min<int>(d, cellDistance[index3(nx, ny, nz)] + 1));
+                }
+            };
 
+            for (int z = 0; z < boxesAlongZ; z++)
+                for (int y = 0; y < boxesAlongY; y++)
+                    for (int x = 0; x < boxesAlongX; x++)
+                        relax(x, y, z, 1);
+
+            for (int z = boxesAlongZ - 1; z >= 0; z--)
+                for (int y = boxesAlongY - 1; y >= 0; y--)
+                    for (int x = boxesAlongX - 1; x >= 0; x--)
+                        relax(x, y, z, -1);
+
+            size_t skippable = 0;
+            for (uint8_t d : cellDistance)
+                skippable += d > 1;
+            std::cout << "Distance field: " << 100.0 * skippable / numVoxels << "% of the voxels can skip empty space" << std::endl;
         }
 
-        aabb hitBox() const override {return aabb();}
-
         bool hit(const Ray &r, Interval ray_t, Hit_record &rec) const override
         {
             double entry_t = ray_t.min;
             double exit_t = ray_t.max;
-            Interval temp = {entry_t, exit_t};
 
-            // ray never hits grid
-            if (!aabb(worldMin, worldMax).hit(r, temp))
+            // clip the ray to the grid, so the walk starts in the voxel where the ray enters
+            for (int a = 0; a < 3; a++)
             {
-                //std::cout << "Grid miss" << std::endl;
-                return false;
-            }
-
+                double t0 = (worldMin[a] - r.origin()[a]) / r.direction()[a];
+                double t1 = (worldMax[a] - r.origin()[a]) / r.direction()[a];
+                if (t0 > t1) std::swap(t0, t1);
 
-            entry_t = max(ray_t.min, entry_t);
-            exit_t = max(ray_t.max, exit_t);
+                // a ray in the plane of a flat grid gives NaN, which does not clip
+                if (t0 > entry_t) entry_t = t0;
+                if (t1 < exit_t) exit_t = t1;
+            }
 
+            // ray never hits grid
             if (entry_t > exit_t)
             {
+                //std::cout << "Grid miss" << std::endl;
                 return false;
             }
 
@@ -154,11 +302,11 @@ class Grid : public Primitive
             double maxT_x = nextBoundaryT(entryVoxel.x(), r.origin().x(), r.direction().x(), worldMin.x(), cellDimensions.x(), stepX);
             double maxT_y = nextBoundaryT(entryVoxel.y(), r.origin().y(), r.direction().y(), worldMin.y(), cellDimensions.y(), stepY);
             double maxT_z = nextBoundaryT(entryVoxel.z(), r.origin().z(), r.direction().z(), worldMin.z(), cellDimensions.z(), stepZ);
-            Vec3 maxV = {maxT_x, maxT_y, maxT_z};
 
             goTo(maxT_x, deltaX, entry_t);
             goTo(maxT_y, deltaY, entry_t);
             goTo(maxT_z, deltaZ, entry_t);
+            Vec3 maxV = {maxT_x, maxT_y, maxT_z};
 
             return traverse(r, entryVoxel, stepV, maxV, deltaV, exit_t, rec, ray_t);
         }
@@ -196,37 +344,78 @@ class Grid : public Primitive
 
             int traversal_steps = 0;
 
+            Hit_record temp_rec;
+            bool hit_anything = false;
+            auto closest = ray_t.max;
+            Mailbox mailbox;
+
+            // the primitives of a voxel that were not tested yet are collected in batches for the packed triangle test
+            const LeafPrimitives::RayData packedRay = LeafPrimitives::ray_data(r);
+            uint32_t batch[LeafPrimitives::batch_width];
+            uint32_t batchSize = 0;
+            auto testBatch = [&]()
+            {
+                if (primitives.hit_indices(batch, batchSize, packedRay, r, ray_t.min, closest, temp_rec))
+                {
+                    hit_anything = true;
+                    rec = temp_rec;
+                }
+                batchSize = 0;
+            };
+
 
             // while loop from Amanatides and Woo paper with hit detection from ray tracing in one weekend
             while (true)
             {
-                Voxel voxel = voxels[index3(xi, yi, zi)];
-
-                Hit_record temp_rec;
-                bool hit_anything = false;
-                auto closest = ray_t.max;
+                int cell = index3(xi, yi, zi);
                 traversal_steps++;
 
 
-                for (const auto& object : voxel.objects)
+                for (uint32_t i = cellOffsets[cell]; i < cellOffsets[cell + 1]; i++)
                 {
-                    if (primitives[object]->hit(r, Interval(ray_t.min, closest), temp_rec))
-                    {
-                        hit_anything = true;
-                        closest = temp_rec.t;
-                        rec = temp_rec;
-                    }
+                    // a primitive in several voxels is tested once; a hit further along the ray is already in closest
+                    uint32_t object = cellPrimitives[i];
+                    if (mailbox.seen(object))
+                        continue;
+
+                    batch[batchSize++] = object;
+                    if (batchSize == LeafPrimitives::batch_width)
+                        testBatch();
                 }
+                if (batchSize > 0)
+                    testBatch();
 
-                if (hit_anything)
-                {
-                    rec.traversal_steps = traversal_steps;
-                    return true;
-                }
+                // only a hit inside this voxel is certainly the closest: a primitive in a later voxel may still be in front of a hit beyond it
+                double voxelExit = std::min({maxX, maxY, maxZ});
+                if (hit_anything && closest <= voxelExit)
+                    break;
 
+                if (voxelExit > exit)
+                    break;
 
+                // in an empty voxel at distance d the ray jumps to where it leaves the cube of empty voxels around it, skip = d - 1
+                // voxels past this one along every axis, instead of stepping through that cube one voxel at a time
+                int skip = cellDistance.empty() ? 0 : cellDistance[cell] - 1;
+                if (skip > 0)
+                {
+                    double skipT = std::min({maxX + skip * deltaX, maxY + skip * deltaY, maxZ + skip * deltaZ});
+                    if (skipT > exit || (hit_anything && closest <= skipT))
+                        break;
 
-                if (maxX < maxY)
+                    // cross every voxel boundary before skipT along each axis
+                    auto jump = [&](int& index, double& maxT, double delta, double step)
+                    {
+                        if (maxT > skipT)
+                            return;
+                        int crossed = std::min(skip + 1, int((skipT - maxT) / delta) + 1);
+                        index += crossed * int(step);
+                        maxT += crossed * delta;
+                    };
+                    jump(xi, maxX, deltaX, stepV.x());
+                    jump(yi, maxY, deltaY, stepV.y());
+                    jump(zi, maxZ, deltaZ, stepV.z());
+                }
+                else if (maxX < maxY)
                 {
                     if (maxX < maxZ)
                     {
@@ -257,73 +446,12 @@ class Grid : public Primitive
                     zi < 0 || zi >= boxesAlongZ)
                 {
 
-                    return false;
+                    break;
                 }
             }
 
-
-            /*bool hitAnything = false;
-            double closest = exit;
-            Hit_record temp;
-
-            clamp(voxindex);
-			auto i = index3(voxindex.x(), voxindex.y(), voxindex.z());
-            Voxel v = voxels[i];
-
-            //std::cout << "voxel owns " << v.objects.size() << " objects" << std::endl;
-            for (int index : v.objects)
-            {
-                std::cout << "Checking prim: " << index << std::endl;
-                shared_ptr<Primitive> prim = primitives[index];
-                if (prim->hit(r, Interval(ray_t.min, closest), temp))
-                {
-
-                    hitAnything = true;
-                    closest = temp.t;
-                    rec = temp;
-                }
-            }
-
-            double next = min({maxV.x(), maxV.y(), maxV.z()});
-            if (hitAnything && closest <= next)
-                return true;
-
-            //expand voxel if ray did not hot anything (before next voxel)
-            if (maxV.x() < maxV.y())
-            {
-                if (maxV.x() < maxV.z())
-                {
-                    return traverse(
-                        r,
-                        {voxindex.x() + stepV.x(), voxindex.y(), voxindex.z()},
-                        stepV,
-                        {maxV.x() + deltaV.x(), maxV.z(), maxV.z()},
-                        deltaV, exit, rec, ray_t);
-                }
-                return traverse(
-                    r,
-                    {voxindex.x(), voxindex.y(), voxindex.z() + stepV.z()},
-                    stepV,
-                    {maxV.x(), maxV.z(), maxV.z() + deltaV.z()},
-                    deltaV, exit, rec, ray_t);
-            }
-
-            if (maxV.y() < maxV.z())
-            {
-                return traverse(
-                    r,
-                    {voxindex.x(), voxindex.y() + stepV.y(), voxindex.z()},
-                    stepV,
-                    {maxV.x(), maxV.y() + deltaV.y(), maxV.z()},
-                    deltaV, exit, rec, ray_t);
-            }
-
-            return traverse(
-                r,
-                {voxindex.x(), voxindex.y(), voxindex.z() + deltaV.z()},
-                stepV,
-                {maxV.x(), maxV.y(), maxV.z() + deltaV.z()},
-                deltaV, exit, rec, ray_t);*/
+            trace_stats().traversal_steps += traversal_steps;
+            return hit_anything;
         }
 
         void goTo(double& maxT, double delta, double entry_t) const
@@ -362,8 +490,9 @@ class Grid : public Primitive
 		}
 
 
-        // calculates location of primitive in the grid same way it calculates voxel position
-        void insertPrimitiveIndex(int index, const aabb& box)
+        // calculates location of primitive in the grid same way it calculates voxel position, and calls f(index, x, y, z) for every voxel it touches
+        template<typename F>
+        void forEachVoxel(const aabb& box, F f) const
         {
             auto min = getVoxelIndex({box.x.min, box.y.min, box.z.min});
             auto max = getVoxelIndex({box.x.max, box.y.max, box.z.max});
@@ -375,14 +504,95 @@ class Grid : public Primitive
             for (int x = min.x(); x <= max.x(); x++)
                 for (int y = min.y(); y <= max.y(); y++)
                     for (int z = min.z(); z <= max.z(); z++)
-                    {
-                        auto i = index3(x,y,z);
-						Voxel& v = voxels[i];
-                        v.objects.push_back(index);
-                    }
+                        f(index3(x, y, z), x, y, z);
 
         }
 
+        /// <summary>
+        /// Chooses the number of voxels along every axis. With conf::voxels_on_x set, x gets that many voxels and the other axes get
+        /// cubes of the same size; otherwise the resolution follows from the number of primitives (see resolutionFor).
+        /// </summary>
+        void chooseResolution(const Vec3& dimensions)
+        {
+            std::array<int, 3> res;
+            if (conf::voxels_on_x > 0)
+                res = resolutionForSize(dimensions, dimensions.x() / conf::voxels_on_x, conf::grid_max_voxels);
+            else
+                res = resolutionFor(dimensions, conf::grid_density * primitives.size(), conf::grid_max_voxels);
+
+            boxesAlongX = res[0];
+            boxesAlongY = res[1];
+            boxesAlongZ = res[2];
+        }
+
+    public:
+        /// <summary>
+        /// Gets the resolution of a grid with about the given number of cubic voxels: a side of (cells / volume)^(1/3) voxels
+        /// per unit, which for cells = density * N primitives is the classic heuristic of Cleary and Wyvill, and Woo.
+        /// Axes without extent do not count, so a flat box gets square cells in its plane.
+        /// </summary>
+        /// <param name="dimensions">= The size of the box that the grid covers.</param>
+        /// <param name="cells">= The number of voxels to aim for.</param>
+        /// <param name="maxVoxels">= Upper bound on the total number of voxels.</param>
+        static std::array<int, 3> resolutionFor(const Vec3& dimensions, double cells, size_t maxVoxels)
+        {
+            double volume = 1;
+            int axes = 0;
+            double largest = std::max({ dimensions.x(), dimensions.y(), dimensions.z() });
+            for (int a = 0; a < 3; a++)
+            {
+                if (dimensions[a] > 1e-9 * largest)
+                {
+                    volume *= dimensions[a];
+                    axes++;
+                }
+            }
+
+            double voxelSize = axes > 0 ? std::pow(volume / std::max(1.0, cells), 1.0 / axes) : 1;
+            return resolutionForSize(dimensions, voxelSize, maxVoxels);
+        }
+
+        /// <summary>
+        /// Gets the resolution of a grid of cubic voxels of (at least) the given size, with at most maxVoxels voxels.
+        /// </summary>
+        static std::array<int, 3> resolutionForSize(const Vec3& dimensions, double voxelSize, size_t maxVoxels)
+        {
+            std::array<int, 3> res;
+            while (true)
+            {
+                for (int a = 0; a < 3; a++)
+                    res[a] = std::max(1, int(std::min(1e9, std::ceil(dimensions[a] / voxelSize))));
+
+                if (size_t(res[0]) * res[1] * res[2] <= maxVoxels)
+                    return res;
+                voxelSize *= 1.1;
+            }
+        }
+
+    private:
+        /// <summary>
+        /// Logs how the primitives are spread over the voxels.
+        /// </summary>
+        void printFill() const
+        {
+            size_t numVoxels = cellOffsets.size() - 1;
+            size_t filled = 0, most = 0;
+            for (size_t i = 0; i < numVoxels; i++)
+            {
+                size_t count = cellOffsets[i + 1] - cellOffsets[i];
+                filled += count > 0;
+                most = std::max(most, count);
+            }
+
+            std::cout << filled << " of " << numVoxels << " voxels filled (" << 100.0 * filled / numVoxels << "%), "
+                      << (filled > 0 ? double(cellPrimitives.size()) / filled : 0) << " primitives per filled voxel, at most " << most << std::endl;
+        }
+
+        Point3 voxelCenter(int x, int y, int z) const
+        {
+            return worldMin + Vec3((x + 0.5) * cellDimensions.x(), (y + 0.5) * cellDimensions.y(), (z + 0.5) * cellDimensions.z());
+        }
+
         int index3(int x, int y, int z) const
         {
             return x + boxesAlongX * (y + boxesAlongY * z);
@@ -68,7 +68,8 @@ class aabb {
                 if (intersect1 < ray_t.max) ray_t.max = intersect1;
             }
 
-            if (ray_t.max <= ray_t.min)
+            // Flat boxes (for example around an axis-aligned triangle) have min == max and must still be hit
+            if (ray_t.max < ray_t.min)
                 return false;
 
             return true;
@@ -0,0 +1,918 @@
+// Microbenchmarks for the hot parts of the ray tracer.
+// Usage: RayTracerBench [name ...]   (no names runs all benchmarks)
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "configuration.hpp"
+
+#include "common.h"
+#include "bvhnode.h"
+#include "dynamicbvh.h"
+#include "camera.h"
+#include "flatbvh.h"
+#include "Grid.h"
+#include "instance.h"
+#include "kdtree.h"
+#include "lbvh.h"
+#include "sahbvh.h"
+#include "scenes.h"
+#include "transform.h"
+#include "triangle.h"
+#include "trianglemesh.h"
+#include "twolevelgrid.h"
+#include "widebvh.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+// Results are accumulated here, so the compiler cannot optimize the benchmarked work away
+volatile double bench_sink = 0;
+
+/// <summary>
+/// Runs a function and returns the elapsed wall clock time in seconds.
+/// </summary>
+/// <param name="f">= The work to time.</param>
+/// <returns></returns>
+inline double time_seconds(const std::function<void()>& f)
+{
+    auto start = bench_clock::now();
+    f();
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/// <summary>
+/// Runs a function on a number of threads at the same time and returns the elapsed time in seconds.
+/// </summary>
+/// <param name="num_threads">= The number of threads.</param>
+/// <param name="f">= Function that is called as f(thread_index) on every thread.</param>
+/// <returns></returns>
+inline double time_seconds_parallel(unsigned int num_threads, const std::function<void(unsigned int)>& f)
+{
+    return time_seconds([&]()
+    {
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < num_threads; t++)
+            threads.emplace_back(f, t);
+        for (auto& thread : threads)
+            thread.join();
+    });
+}
+
+inline void report(const std::string& name, double seconds, double count, const std::string& unit)
+{
+    std::cout << "  " << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << seconds * 1e9 / count << " ns/" << unit << "\n";
+}
+
+// The random number path from before rng.h: std::rand has a single global (locked) state
+inline double legacy_random_double()
+{
+    return std::rand() / (RAND_MAX + 1.0);
+}
+
+inline Vec3 legacy_random_unit_vector()
+{
+    while (true)
+    {
+        auto p = Vec3(2 * legacy_random_double() - 1, 2 * legacy_random_double() - 1, 2 * legacy_random_double() - 1);
+        auto lensq = p.length_sq();
+
+        if (1e-160 < lensq && lensq <= 1)
+            return p / sqrt(lensq);
+    }
+}
+
+void bench_rng()
+{
+    const int n = 20000000;
+    std::cout << "Random number generation (" << n << " numbers per run)\n";
+
+    double legacy = time_seconds([&]() { double acc = 0; for (int i = 0; i < n; i++) acc += legacy_random_double(); bench_sink = acc; });
+    report("std::rand", legacy, n, "number");
+
+    random_begin_sample(0, 0, 0);
+    double current = time_seconds([&]() { double acc = 0; for (int i = 0; i < n; i++) acc += random_double(); bench_sink = acc; });
+    report("random_double (thread-local Rng)", current, n, "number");
+
+    Xoshiro256pp xoshiro(1);
+    double x = time_seconds([&]() { uint64_t acc = 0; for (int i = 0; i < n; i++) acc += xoshiro.next(); bench_sink = double(acc); });
+    report("Xoshiro256pp::next", x, n, "number");
+
+    Pcg32 pcg(1);
+    double p = time_seconds([&]() { uint64_t acc = 0; for (int i = 0; i < n; i++) acc += pcg.next(); bench_sink = double(acc); });
+    report("Pcg32::next", p, n, "number");
+
+    double reseed = time_seconds([&]() { double acc = 0; for (int i = 0; i < n / 8; i++) { random_begin_sample(0, i, 0); acc += random_double(); } bench_sink = acc; });
+    report("random_begin_sample + random_double", reseed, n / 8, "sample");
+
+    const int m = n / 4;
+    double legacy_vec = time_seconds([&]() { double acc = 0; for (int i = 0; i < m; i++) acc += legacy_random_unit_vector().x(); bench_sink = acc; });
+    report("random_unit_vector (std::rand)", legacy_vec, m, "vector");
+
+    double current_vec = time_seconds([&]() { double acc = 0; for (int i = 0; i < m; i++) acc += random_unit_vector().x(); bench_sink = acc; });
+    report("random_unit_vector (Rng)", current_vec, m, "vector");
+
+    unsigned int threads = std::max(2u, std::thread::hardware_concurrency());
+    std::cout << "  -- " << threads << " threads, " << n << " numbers in total --\n";
+
+    double legacy_mt = time_seconds_parallel(threads, [&](unsigned int)
+    {
+        double acc = 0;
+        for (int i = 0; i < n / int(threads); i++) acc += legacy_random_double();
+        bench_sink = acc;
+    });
+    report("std::rand", legacy_mt, n, "number");
+
+    double current_mt = time_seconds_parallel(threads, [&](unsigned int t)
+    {
+        random_begin_sample(0, t, 0);
+        double acc = 0;
+        for (int i = 0; i < n / int(threads); i++) acc += random_double();
+        bench_sink = acc;
+    });
+    report("random_double (thread-local Rng)", current_mt, n, "number");
+
+    std::cout << "  Speedup over std::rand: " << std::setprecision(1) << legacy / current << "x (1 thread), "
+              << legacy_mt / current_mt << "x (" << threads << " threads)\n\n";
+}
+
+// Scenes the acceleration structure benchmarks run on: the bunny and the UU logo
+const std::vector<std::pair<int, std::string>> bench_scenes = { { 1, "bunny" }, { 6, "UU" } };
+
+/// <summary>
+/// Generates rays from the camera position of a scene towards random points inside the bounds of the scene.
+/// </summary>
+std::vector<Ray> bench_rays(const Camera& cam, const aabb& box, int n)
+{
+    random_begin_sample(1234, 0, 0);
+
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for (int i = 0; i < n; i++)
+    {
+        Point3 target(random_double(box.x.min, box.x.max), random_double(box.y.min, box.y.max), random_double(box.z.min, box.z.max));
+        rays.emplace_back(cam.cam_pos, target - cam.cam_pos);
+    }
+    return rays;
+}
+
+struct TraceResult
+{
+    double seconds = 0;
+    int hits = 0;
+    double t_sum = 0;
+    uint64_t traversal_steps = 0;
+    uint64_t intersection_tests = 0;
+};
+
+/// <summary>
+/// Finds the closest hit of every ray with an acceleration structure.
+/// </summary>
+TraceResult trace_rays(const Primitive& accel, const std::vector<Ray>& rays)
+{
+    TraceResult result;
+    TraceStats before = trace_stats();
+    result.seconds = time_seconds([&]()
+    {
+        for (const Ray& r : rays)
+        {
+            Hit_record rec;
+            if (accel.hit(r, Interval(0.001, infinity), rec))
+            {
+                result.hits++;
+                result.t_sum += rec.t;
+            }
+        }
+    });
+    result.traversal_steps = trace_stats().traversal_steps - before.traversal_steps;
+    result.intersection_tests = trace_stats().intersection_tests - before.intersection_tests;
+    return result;
+}
+
+void report_trace(const std::string& name, const TraceResult& result, size_t num_rays, const TraceResult* baseline = nullptr)
+{
+    std::cout << "  " << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << num_rays / result.seconds * 1e-6 << " Mrays/s"
+              << std::setw(9) << std::setprecision(1) << double(result.traversal_steps) / num_rays << " steps/ray"
+              << std::setw(8) << double(result.intersection_tests) / num_rays << " tests/ray";
+    if (baseline)
+        std::cout << std::setprecision(2) << "   " << baseline->seconds / result.seconds << "x";
+    std::cout << "\n";
+}
+
+size_t count_bvh_nodes(const Primitive& prim)
+{
+    auto node = dynamic_cast<const bvh_node*>(&prim);
+    if (!node)
+        return 0;
+
+    size_t count = 1 + count_bvh_nodes(*node->left_child());
+    if (node->right_child() != node->left_child())
+        count += count_bvh_nodes(*node->right_child());
+    return count;
+}
+
+void bench_bvh()
+{
+    const int num_rays = 500000;
+
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "BVH layouts, scene " << name << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+
+        shared_ptr<bvh_node> tree;
+        double build = time_seconds([&]() { tree = make_shared<bvh_node>(world); });
+        FlatBVH flat;
+        double flatten = time_seconds([&]() { flat = FlatBVH(*tree); });
+
+        size_t tree_nodes = count_bvh_nodes(*tree);
+        std::cout << "  pointer tree: " << tree_nodes << " nodes, ~" << tree_nodes * (sizeof(bvh_node) + 16) / 1024 << " KiB, built in " << std::setprecision(3) << build << " s\n";
+        std::cout << "  flat:         " << flat.nodes.size() << " nodes, " << flat.node_bytes() / 1024 << " KiB, flattened in " << flatten << " s\n";
+
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+        TraceResult pointer = trace_rays(*tree, rays);
+        TraceResult flat_result = trace_rays(flat, rays);
+        report_trace("bvh_node", pointer, rays.size());
+        report_trace("FlatBVH", flat_result, rays.size(), &pointer);
+
+        if (pointer.hits != flat_result.hits || std::abs(pointer.t_sum - flat_result.t_sum) > 1e-6 * pointer.t_sum)
+            std::cout << "  WARNING: layouts disagree (" << pointer.hits << " vs " << flat_result.hits << " hits)\n";
+        std::cout << "\n";
+    }
+}
+
+void bench_sah()
+{
+    const int num_rays = 500000;
+    const std::vector<std::pair<int, std::string>> scenes = { { 1, "bunny" }, { 5, "stackcolor" }, { 6, "UU" } };
+
+    for (const auto& [scene, name] : scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "BVH builders, scene " << name << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+
+        SAHSettings settings = Camera::sah_settings();
+        FlatBVH median, sah;
+        double median_build = time_seconds([&]() { median = FlatBVH(bvh_node(world)); });
+        double sah_build = time_seconds([&]() { sah = SAHBuilder(settings).build(world.objects); });
+
+        std::cout << std::setprecision(3) << "  Median split build: " << median_build << " s, binned SAH build: " << sah_build << " s\n  ";
+        median.stats(settings.traversal_cost, settings.intersection_cost).print("Median split");
+        std::cout << "  ";
+        sah.stats(settings.traversal_cost, settings.intersection_cost).print("Binned SAH");
+
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+        TraceResult median_result = trace_rays(median, rays);
+        TraceResult sah_result = trace_rays(sah, rays);
+        report_trace("median split", median_result, rays.size());
+        report_trace("binned SAH", sah_result, rays.size(), &median_result);
+
+        if (median_result.hits != sah_result.hits)
+            std::cout << "  WARNING: builders disagree (" << median_result.hits << " vs " << sah_result.hits << " hits)\n";
+        std::cout << "\n";
+    }
+}
+
+bool same_tree(const FlatBVH& a, const FlatBVH& b)
+{
+    return a.nodes.size() == b.nodes.size() && a.primitives.objects() == b.primitives.objects()
+        && std::memcmp(a.nodes.data(), b.nodes.data(), a.node_bytes()) == 0;
+}
+
+void bench_build()
+{
+    unsigned int max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        size_t n = world.objects.size();
+        std::cout << "Binned SAH build throughput, scene " << name << " (" << n << " primitives, best of 3 runs)\n";
+
+        SAHSettings settings = Camera::sah_settings();
+        FlatBVH serial;
+        double serial_time = INFINITY;
+        for (int run = 0; run < 3; run++)
+            serial_time = std::min(serial_time, time_seconds([&]() { serial = SAHBuilder(settings).build(world.objects); }));
+
+        std::cout << "  " << std::left << std::setw(12) << "serial" << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(8) << n / serial_time * 1e-6 << " Mprims/s\n";
+
+        for (unsigned int threads = 2; threads <= max_threads; threads *= 2)
+        {
+            ThreadPool pool(threads);
+            FlatBVH parallel;
+            double parallel_time = INFINITY;
+            for (int run = 0; run < 3; run++)
+                parallel_time = std::min(parallel_time, time_seconds([&]() { parallel = SAHBuilder(settings).build(world.objects, &pool); }));
+
+            std::cout << "  " << std::left << std::setw(12) << (std::to_string(threads) + " threads") << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(8) << n / parallel_time * 1e-6 << " Mprims/s   " << serial_time / parallel_time << "x"
+                      << (same_tree(serial, parallel) ? "   identical tree" : "   WARNING: tree differs from the serial build") << "\n";
+        }
+        std::cout << "\n";
+    }
+}
+
+void bench_lbvh()
+{
+    const int num_rays = 500000;
+    const std::vector<std::pair<int, std::string>> scenes = { { 1, "bunny" }, { 5, "stackcolor" }, { 6, "UU" } };
+
+    for (const auto& [scene, name] : scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "Build + trace, scene " << name << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+
+        SAHSettings sah_settings = Camera::sah_settings();
+        LBVHSettings plain = Camera::lbvh_settings();
+        plain.rotation_passes = 0;
+        LBVHSettings rotated = Camera::lbvh_settings();
+        rotated.rotation_passes = std::max(1, rotated.rotation_passes);
+
+        std::vector<std::pair<std::string, std::function<FlatBVH()>>> builders = {
+            { "median split", [&]() { return FlatBVH(bvh_node(world)); } },
+            { "binned SAH", [&]() { return SAHBuilder(sah_settings).build(world.objects); } },
+            { "LBVH", [&]() { return LBVHBuilder(plain).build(world.objects); } },
+            { "LBVH + " + std::to_string(rotated.rotation_passes) + " rotation pass(es)", [&]() { return LBVHBuilder(rotated).build(world.objects); } },
+        };
+
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+        int reference_hits = -1;
+
+        for (const auto& [builder, build] : builders)
+        {
+            FlatBVH bvh;
+            double build_time = time_seconds([&]() { bvh = build(); });
+            TraceResult result = trace_rays(bvh, rays);
+            BVHStats stats = bvh.stats(sah_settings.traversal_cost, sah_settings.intersection_cost);
+
+            std::cout << "  " << std::left << std::setw(30) << builder << std::right << std::fixed << std::setprecision(3)
+                      << " build " << std::setw(6) << build_time << " s (" << std::setprecision(2) << std::setw(5) << world.objects.size() / build_time * 1e-6 << " Mprims/s)"
+                      << "  SAH cost " << std::setw(6) << std::setprecision(1) << stats.sah_cost
+                      << "  trace " << std::setw(5) << std::setprecision(2) << num_rays / result.seconds * 1e-6 << " Mrays/s"
+                      << "  total " << std::setprecision(3) << build_time + result.seconds << " s\n";
+
+            if (reference_hits < 0)
+                reference_hits = result.hits;
+            else if (result.hits != reference_hits)
+                std::cout << "  WARNING: " << builder << " disagrees (" << result.hits << " vs " << reference_hits << " hits)\n";
+        }
+        std::cout << "\n";
+    }
+}
+
+void bench_wide()
+{
+    const int num_rays = 500000;
+    const std::vector<std::pair<int, std::string>> scenes = { { 1, "bunny" }, { 5, "stackcolor" }, { 6, "UU" } };
+
+    for (const auto& [scene, name] : scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "Wide BVHs, scene " << name << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+
+        FlatBVH binary = SAHBuilder(Camera::sah_settings()).build(world.objects);
+        WideBVH<4> bvh4;
+        WideBVH<8> bvh8;
+        double collapse4 = time_seconds([&]() { bvh4 = WideBVH<4>(binary); });
+        double collapse8 = time_seconds([&]() { bvh8 = WideBVH<8>(binary); });
+
+        std::cout << std::fixed << std::setprecision(3)
+                  << "  binary: " << binary.nodes.size() << " nodes, " << binary.node_bytes() / 1024 << " KiB\n"
+                  << "  BVH4:   " << bvh4.nodes.size() << " nodes, " << bvh4.node_bytes() / 1024 << " KiB, " << std::setprecision(2) << bvh4.average_children()
+                  << " children per node, " << WideBVH<4>::simd_name() << ", collapsed in " << std::setprecision(3) << collapse4 << " s\n"
+                  << "  BVH8:   " << bvh8.nodes.size() << " nodes, " << bvh8.node_bytes() / 1024 << " KiB, " << std::setprecision(2) << bvh8.average_children()
+                  << " children per node, " << WideBVH<8>::simd_name() << ", collapsed in " << std::setprecision(3) << collapse8 << " s\n";
+
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+        TraceResult binary_result = trace_rays(binary, rays);
+        TraceResult result4 = trace_rays(bvh4, rays);
+        TraceResult result8 = trace_rays(bvh8, rays);
+        report_trace("binary FlatBVH", binary_result, rays.size());
+        report_trace("BVH4", result4, rays.size(), &binary_result);
+        report_trace("BVH8", result8, rays.size(), &binary_result);
+
+        for (const TraceResult* result : { &result4, &result8 })
+        {
+            if (result->hits != binary_result.hits || std::abs(result->t_sum - binary_result.t_sum) > 1e-6 * binary_result.t_sum)
+                std::cout << "  WARNING: wide BVH disagrees with the binary BVH (" << result->hits << " vs " << binary_result.hits << " hits)\n";
+        }
+        std::cout << "\n";
+    }
+}
+
+void bench_refit()
+{
+    const int num_rays = 200000;
+    const int num_frames = 10;
+
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+
+        // The meshes of the scene, and the rest pose of their vertices
+        std::vector<TriangleMesh*> meshes;
+        std::vector<std::vector<Point3>> rest;
+        size_t num_triangles = 0;
+        for (const auto& object : world.objects)
+        {
+            auto face = dynamic_cast<const MeshTriangle*>(object.get());
+            if (!face || std::find(meshes.begin(), meshes.end(), &face->triangle_mesh()) != meshes.end())
+                continue;
+
+            TriangleMesh* mesh = &face->triangle_mesh();
+            meshes.push_back(mesh);
+            rest.emplace_back();
+            for (uint32_t v = 0; v < mesh->num_vertices(); v++)
+                rest.back().push_back(mesh->position(v));
+            num_triangles += mesh->num_faces();
+        }
+        if (meshes.empty())
+            continue;
+
+        std::cout << "Deforming " << name << " (" << num_triangles << " triangles, " << num_frames << " frames, " << num_rays << " rays per frame, rebuild threshold "
+                  << std::fixed << std::setprecision(2) << conf::bvh_rebuild_threshold << ")\n";
+        std::cout << "  frame   refit     rebuild   speedup   cost refit/rebuild   trace refit/rebuild\n";
+
+        SAHSettings settings = Camera::sah_settings();
+        DynamicBVH dynamic(world.objects, settings, conf::bvh_rebuild_threshold);
+        aabb box = world.hitBox();
+        double extent = box.x.size();
+        double total_update = 0, total_rebuild = 0;
+
+        for (int frame = 1; frame <= num_frames; frame++)
+        {
+            // A growing sideways wave along the height of the mesh
+            double amplitude = 0.15 * extent * frame / num_frames;
+            for (size_t m = 0; m < meshes.size(); m++)
+            {
+                for (uint32_t v = 0; v < rest[m].size(); v++)
+                    meshes[m]->set_position(v, rest[m][v] + Vec3(amplitude * std::sin(8 * (rest[m][v].y() - box.y.min) / box.y.size() + frame), 0, 0));
+                meshes[m]->update();
+            }
+
+            bool rebuilt = false;
+            double update = time_seconds([&]() { rebuilt = dynamic.update(); });
+            FlatBVH fresh;
+            double rebuild = time_seconds([&]() { fresh = SAHBuilder(settings).build(world.objects); });
+            total_update += update;
+            total_rebuild += rebuild;
+
+            auto rays = bench_rays(cam, dynamic.hitBox(), num_rays);
+            TraceResult refit_result = trace_rays(dynamic, rays);
+            TraceResult rebuild_result = trace_rays(fresh, rays);
+
+            std::cout << "  " << std::setw(5) << frame << std::fixed << std::setprecision(4)
+                      << std::setw(9) << update << " s" << std::setw(9) << rebuild << " s"
+                      << std::setprecision(1) << std::setw(9) << rebuild / update << "x"
+                      << std::setprecision(2) << std::setw(20) << dynamic.cost() / fresh.sah_cost(settings.traversal_cost, settings.intersection_cost)
+                      << std::setw(22) << rebuild_result.seconds / refit_result.seconds
+                      << (rebuilt ? "   (rebuilt)" : "") << "\n";
+
+            if (refit_result.hits != rebuild_result.hits || std::abs(refit_result.t_sum - rebuild_result.t_sum) > 1e-6 * rebuild_result.t_sum)
+                std::cout << "  WARNING: refitted BVH disagrees (" << refit_result.hits << " vs " << rebuild_result.hits << " hits)\n";
+        }
+
+        std::cout << "  Total: " << std::setprecision(3) << total_update << " s refit/rebuild vs " << total_rebuild << " s always rebuilding, "
+                  << dynamic.rebuilds() - 1 << " rebuilds\n\n";
+
+        for (size_t m = 0; m < meshes.size(); m++)
+        {
+            for (uint32_t v = 0; v < rest[m].size(); v++)
+                meshes[m]->set_position(v, rest[m][v]);
+            meshes[m]->update();
+        }
+    }
+}
+
+void bench_instancing()
+{
+    const int num_rays = 200000;
+
+    Camera cam;
+    World mesh;
+    load_scene(1, cam, mesh);
+    if (mesh.objects.empty())
+        return;
+
+    SAHSettings settings = Camera::sah_settings();
+    size_t mesh_bytes = static_cast<const MeshTriangle&>(*mesh.objects[0]).triangle_mesh().memory_bytes();
+    aabb box = mesh.hitBox();
+    double spacing = 1.5 * std::max(box.x.size(), box.z.size());
+
+    for (int rows : { 4, 8 })
+    {
+        int copies = rows * rows;
+        std::vector<Transform> placements;
+        for (int i = 0; i < rows; i++)
+            for (int j = 0; j < rows; j++)
+                placements.push_back(Transform::translate(Vec3(i * spacing, 0, -j * spacing)) * Transform::rotate(Vec3(0, 1, 0), 37.0 * (i * rows + j)));
+
+        std::cout << "Instancing, " << copies << " copies of the bunny (" << copies * mesh.objects.size() << " triangles, " << num_rays << " rays)\n";
+
+        // Two levels: one bottom-level BVH, instances of it, and a top-level BVH over the instances
+        FlatBVH tlas;
+        shared_ptr<FlatBVH> blas;
+        World instances;
+        double two_level_build = time_seconds([&]()
+        {
+            blas = make_shared<FlatBVH>(SAHBuilder(settings).build(mesh.objects));
+            for (const Transform& t : placements)
+                instances.add(make_shared<Instance>(blas, t));
+            tlas = SAHBuilder(settings).build(instances.objects);
+        });
+        size_t two_level_bytes = mesh_bytes + mesh.objects.size() * sizeof(shared_ptr<Primitive>) + blas->node_bytes()
+                               + copies * (sizeof(Instance) + 16 + sizeof(shared_ptr<Primitive>)) + tlas.node_bytes();
+
+        // One level: every copy baked into its own triangles
+        World baked;
+        for (const Transform& t : placements)
+        {
+            for (const auto& object : mesh.objects)
+            {
+                std::array<Point3, 3> corners;
+                triangle_corners(*object, corners);
+                Point3 a = t.point(corners[0]), b = t.point(corners[1]), c = t.point(corners[2]);
+                baked.add(Triangle::from_corners(a, b, c, nullptr));
+            }
+        }
+        FlatBVH flat;
+        double flat_build = time_seconds([&]() { flat = SAHBuilder(settings).build(baked.objects); });
+        size_t flat_bytes = baked.objects.size() * (sizeof(Triangle) + 16 + sizeof(shared_ptr<Primitive>)) + flat.node_bytes();
+
+        std::cout << std::fixed << std::setprecision(3)
+                  << "  baked copies:  build " << flat_build << " s, ~" << flat_bytes / (1024 * 1024) << " MiB\n"
+                  << "  TLAS + BLAS:   build " << two_level_build << " s, ~" << two_level_bytes / (1024 * 1024) << " MiB\n";
+
+        auto rays = bench_rays(cam, flat.hitBox(), num_rays);
+        TraceResult flat_result = trace_rays(flat, rays);
+        TraceResult instanced_result = trace_rays(tlas, rays);
+        report_trace("baked copies", flat_result, rays.size());
+        report_trace("TLAS + BLAS", instanced_result, rays.size(), &flat_result);
+
+        // The transformed vertices are rounded differently, so a few grazing rays may go either way
+        if (std::abs(flat_result.hits - instanced_result.hits) > num_rays / 1000)
+            std::cout << "  WARNING: instanced scene disagrees (" << instanced_result.hits << " vs " << flat_result.hits << " hits)\n";
+        std::cout << "\n";
+    }
+}
+
+void bench_accel()
+{
+    const int num_rays = 500000;
+    ThreadPool pool;
+
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "Acceleration structures, scene " << name << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+
+        // All of them are primitives, so the renderer (and this benchmark) traces rays through them in the same way
+        std::vector<std::pair<std::string, std::function<shared_ptr<Primitive>()>>> structures = {
+            { "binned SAH BVH", [&]() { return make_shared<FlatBVH>(SAHBuilder(Camera::sah_settings()).build(world.objects)); } },
+            { "SAH kd-tree", [&]()
+                {
+                    auto tree = make_shared<KdTree>();
+                    tree->traversalCost = conf::kd_traversal_cost;
+                    tree->intersectionCost = conf::kd_intersection_cost;
+                    tree->emptyBonus = conf::kd_empty_bonus;
+                    tree->buildTree(world.objects);
+                    return tree;
+                } },
+            { "grid", [&]() { return make_shared<Grid>(world, &pool); } },
+            { "grid + skipping", [&]()
+                {
+                    auto grid = make_shared<Grid>(world, &pool);
+                    grid->buildDistanceField();
+                    return grid;
+                } },
+            { "two-level grid", [&]()
+                {
+                    auto grid = make_shared<TwoLevelGrid>(world.objects);
+                    grid->print_stats("  two-level grid");
+                    return grid;
+                } },
+        };
+
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+        TraceResult baseline;
+
+        for (size_t i = 0; i < structures.size(); i++)
+        {
+            shared_ptr<Primitive> accel;
+            double build_time = time_seconds([&]() { accel = structures[i].second(); });
+            TraceResult result = trace_rays(*accel, rays);
+
+            std::cout << "  " << std::left << std::setw(16) << structures[i].first << std::right << std::fixed << std::setprecision(3) << " build " << build_time << " s\n";
+            report_trace(structures[i].first, result, rays.size(), i > 0 ? &baseline : nullptr);
+
+            if (i == 0)
+                baseline = result;
+            else if (std::abs(result.hits - baseline.hits) > num_rays / 1000)
+                std::cout << "  WARNING: " << structures[i].first << " disagrees (" << result.hits << " vs " << baseline.hits << " hits)\n";
+        }
+        std::cout << "\n";
+    }
+}
+
+void bench_mesh()
+{
+    const int num_rays = 500000;
+
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        // The same triangles as separate Triangle objects
+        World separate;
+        for (const auto& object : world.objects)
+        {
+            std::array<Point3, 3> corners;
+            triangle_corners(*object, corners);
+            separate.add(Triangle::from_corners(corners[0], corners[1], corners[2], nullptr));
+        }
+
+        size_t n = world.objects.size();
+        size_t mesh_bytes = static_cast<const MeshTriangle&>(*world.objects[0]).triangle_mesh().memory_bytes() + n * sizeof(shared_ptr<Primitive>);
+        size_t separate_bytes = n * (sizeof(Triangle) + 16 + sizeof(shared_ptr<Primitive>));
+
+        std::cout << "Triangle storage, scene " << name << " (" << n << " triangles, " << num_rays << " rays)\n" << std::fixed << std::setprecision(1)
+                  << "  Triangle objects   " << std::setw(8) << double(separate_bytes) / n << " bytes/triangle, " << separate_bytes / 1024 << " KiB\n"
+                  << "  TriangleMesh       " << std::setw(8) << double(mesh_bytes) / n << " bytes/triangle, " << mesh_bytes / 1024 << " KiB"
+                  << std::setprecision(2) << " (" << double(separate_bytes) / mesh_bytes << "x smaller)\n";
+
+        SAHSettings settings = Camera::sah_settings();
+        FlatBVH separate_bvh = SAHBuilder(settings).build(separate.objects);
+        FlatBVH mesh_bvh = SAHBuilder(settings).build(world.objects);
+
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+        TraceResult separate_result = trace_rays(separate_bvh, rays);
+        TraceResult mesh_result = trace_rays(mesh_bvh, rays);
+        report_trace("Triangle objects", separate_result, rays.size());
+        report_trace("TriangleMesh", mesh_result, rays.size(), &separate_result);
+
+        if (separate_result.hits != mesh_result.hits)
+            std::cout << "  WARNING: the mesh disagrees (" << mesh_result.hits << " vs " << separate_result.hits << " hits)\n";
+        std::cout << "\n";
+    }
+}
+
+void bench_packed()
+{
+    const int num_rays = 500000;
+
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "Packed triangle tests (" << PackedTriangles::simd_name() << ", " << PackedTriangles::width << " wide), scene " << name
+                  << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+
+        // The batched filter against its scalar reference, and against the double precision test it has to be conservative for.
+        // Every ray aims at a point in or just outside one of the triangles, so many rays graze an edge
+        PackedTriangles packed(world.objects);
+        const int n = PackedTriangles::width;
+        Xoshiro256pp rng(7);
+        auto uniform = [&]() { return (rng.next() >> 11) * (1.0 / 9007199254740992.0); };
+        size_t mismatches = 0, missed = 0, candidates = 0, hits = 0;
+        for (size_t i = 0; i < 200000; i++)
+        {
+            uint32_t first = uint32_t(rng.next() % (world.objects.size() - n));
+            std::array<Point3, 3> corners;
+            if (!triangle_corners(*world.objects[first + rng.next() % n], corners))
+                continue;
+
+            double a = 1.02 * uniform() - 0.01, b = (1.02 - a) * uniform() - 0.01;
+            Point3 target = corners[0] + a * (corners[1] - corners[0]) + b * (corners[2] - corners[0]);
+            Ray r(cam.cam_pos, target - cam.cam_pos);
+
+            auto ray = PackedTriangles::ray_data(r);
+            uint32_t mask = packed.candidates(ray, first, n, 0.001f, INFINITY);
+            mismatches += mask != packed.candidates_scalar(ray, first, n, 0.001f, INFINITY);
+            for (int lane = 0; lane < n; lane++)
+            {
+                Hit_record rec;
+                bool hit = world.objects[first + lane]->hit(r, Interval(0.001, infinity), rec);
+                hits += hit;
+                candidates += mask >> lane & 1;
+                missed += hit && !(mask >> lane & 1);
+            }
+        }
+        std::cout << "  filter: " << mismatches << " SIMD/scalar mismatches, " << missed << " missed hits, "
+                  << candidates << " candidates for " << hits << " hits\n";
+
+        // The acceleration structures with and without the batched test give the same hits
+        std::vector<std::pair<std::string, std::function<shared_ptr<Primitive>()>>> structures = {
+            { "binned SAH BVH", [&]() { return make_shared<FlatBVH>(SAHBuilder(Camera::sah_settings()).build(world.objects)); } },
+            { "SAH kd-tree", [&]() { auto tree = make_shared<KdTree>(); tree->buildTree(world.objects); return tree; } },
+            { "grid", [&]() { return make_shared<Grid>(world); } },
+        };
+        for (const auto& [structure, build] : structures)
+        {
+            conf::packed_triangles = false;
+            auto scalar = build();
+            conf::packed_triangles = true;
+            auto batched = build();
+
+            TraceResult scalar_result = trace_rays(*scalar, rays);
+            TraceResult batched_result = trace_rays(*batched, rays);
+            report_trace(structure + " one by one", scalar_result, rays.size());
+            report_trace(structure + " packed", batched_result, rays.size(), &scalar_result);
+            if (scalar_result.hits != batched_result.hits || scalar_result.t_sum != batched_result.t_sum)
+                std::cout << "  WARNING: packed " << structure << " disagrees (" << batched_result.hits << " vs " << scalar_result.hits << " hits)\n";
+        }
+        std::cout << "\n";
+    }
+}
+
+/// <summary>
+/// Builds a closed mesh: a sphere of latitude and longitude bands with a randomly perturbed radius, so the vertices do not lie on
+/// round coordinates. Every ray from inside it has to leave through some face.
+/// </summary>
+shared_ptr<TriangleMesh> closed_mesh(int bands, int segments, Xoshiro256pp& rng)
+{
+    auto mesh = make_shared<TriangleMesh>();
+    uint32_t material = mesh->add_material(nullptr);
+    auto radius = [&]() { return 1.0 + 0.2 * ((rng.next() >> 11) * (1.0 / 9007199254740992.0)); };
+
+    uint32_t north = mesh->add_vertex(Point3(0, radius(), 0));
+    for (int i = 1; i < bands; i++)
+    {
+        double theta = pi * i / bands;
+        for (int j = 0; j < segments; j++)
+        {
+            double phi = 2 * pi * j / segments;
+            mesh->add_vertex(radius() * Point3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)));
+        }
+    }
+    uint32_t south = mesh->add_vertex(Point3(0, -radius(), 0));
+
+    auto ring = [&](int i, int j) { return uint32_t(1 + (i - 1) * segments + (j % segments)); };
+    for (int j = 0; j < segments; j++)
+    {
+        mesh->add_face(north, ring(1, j + 1), ring(1, j), material);
+        mesh->add_face(south, ring(bands - 1, j), ring(bands - 1, j + 1), material);
+        for (int i = 1; i < bands - 1; i++)
+        {
+            mesh->add_face(ring(i, j), ring(i, j + 1), ring(i + 1, j), material);
+            mesh->add_face(ring(i, j + 1), ring(i + 1, j + 1), ring(i + 1, j), material);
+        }
+    }
+    mesh->update();
+    return mesh;
+}
+
+void bench_watertight()
+{
+    // Crack test: rays from inside a closed mesh, aimed at its vertices and at points on its edges. Each is tested against every
+    // face, so only the triangle test decides; a ray that hits no face slipped through a crack
+    {
+        Xoshiro256pp rng(11);
+        auto uniform = [&]() { return (rng.next() >> 11) * (1.0 / 9007199254740992.0); };
+        auto mesh = closed_mesh(24, 40, rng);
+        World world;
+        TriangleMesh::add_faces(mesh, world);
+
+        World separate;
+        for (uint32_t f = 0; f < mesh->num_faces(); f++)
+            separate.add(Triangle::from_corners(mesh->vertex(f, 0), mesh->vertex(f, 1), mesh->vertex(f, 2), nullptr));
+
+        const int num_rays = 40000;
+        std::vector<Ray> rays;
+        for (int i = 0; i < num_rays; i++)
+        {
+            Point3 origin(0.5 * uniform() - 0.25, 0.5 * uniform() - 0.25, 0.5 * uniform() - 0.25);
+            uint32_t face = uint32_t(rng.next() % mesh->num_faces());
+            int corner = int(rng.next() % 3);
+            Point3 a = mesh->vertex(face, corner), b = mesh->vertex(face, (corner + 1) % 3);
+            Point3 target = i % 4 == 0 ? a : a + uniform() * (b - a);
+            rays.emplace_back(origin, target - origin);
+        }
+
+        std::cout << "Cracks in a closed mesh (" << mesh->num_faces() << " faces, " << num_rays << " rays at vertices and edges)\n";
+        for (const auto& [objects, name] : { std::make_pair(&world.objects, "TriangleMesh"), std::make_pair(&separate.objects, "Triangle objects") })
+        {
+            for (bool watertight : { false, true })
+            {
+                conf::watertight_triangles = watertight;
+                size_t misses = 0;
+                for (const Ray& r : rays)
+                {
+                    bool hit = false;
+                    for (const auto& object : *objects)
+                    {
+                        Hit_record rec;
+                        hit |= object->hit(r, Interval(0.001, infinity), rec);
+                    }
+                    misses += !hit;
+                }
+                std::cout << "  " << std::left << std::setw(18) << name << std::setw(16) << (watertight ? "watertight" : "previous test")
+                          << std::right << std::setw(6) << misses << " rays through cracks\n";
+            }
+        }
+        conf::watertight_triangles = true;
+        std::cout << "\n";
+    }
+
+    // The cost of the watertight test in the BVH
+    const int num_rays = 500000;
+    for (const auto& [scene, name] : bench_scenes)
+    {
+        Camera cam;
+        World world;
+        load_scene(scene, cam, world);
+        if (world.objects.empty())
+            continue;
+
+        std::cout << "Watertight triangle test, scene " << name << " (" << world.objects.size() << " primitives, " << num_rays << " rays)\n";
+        FlatBVH bvh = SAHBuilder(Camera::sah_settings()).build(world.objects);
+        auto rays = bench_rays(cam, world.hitBox(), num_rays);
+
+        conf::watertight_triangles = false;
+        TraceResult previous = trace_rays(bvh, rays);
+        conf::watertight_triangles = true;
+        TraceResult watertight = trace_rays(bvh, rays);
+        report_trace("previous test", previous, rays.size());
+        report_trace("watertight", watertight, rays.size(), &previous);
+        std::cout << "  " << watertight.hits << " hits against " << previous.hits << " with the previous test\n\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::pair<std::string, std::function<void()>>> benchmarks = {
+        { "rng", bench_rng },
+        { "bvh", bench_bvh },
+        { "sah", bench_sah },
+        { "build", bench_build },
+        { "lbvh", bench_lbvh },
+        { "wide", bench_wide },
+        { "refit", bench_refit },
+        { "instancing", bench_instancing },
+        { "accel", bench_accel },
+        { "mesh", bench_mesh },
+        { "packed", bench_packed },
+        { "watertight", bench_watertight },
+    };
+
+    for (const auto& [name, run] : benchmarks)
+    {
+        bool selected = argc <= 1;
+        for (int i = 1; i < argc; i++)
+            selected |= name == argv[i];
+
+        if (selected)
+            run();
+    }
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifndef BOXOVERLAP_H
+#define BOXOVERLAP_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "vec3.h"
+
+/// <summary>
+/// Tests if a triangle overlaps an axis-aligned box, with the separating axis theorem (Akenine-Moeller, "Fast 3D triangle-box
+/// overlap testing"). The triangle and the box are disjoint exactly when one of 13 axes separates them: the 3 box normals, the
+/// triangle normal, and the 9 cross products of a triangle edge with a box edge.
+/// The box is grown by a tiny margin, so a triangle that only touches the box (or that rounding puts on the wrong side) counts as overlapping.
+/// </summary>
+/// <param name="v">= The corners of the triangle.</param>
+/// <param name="center">= The center of the box.</param>
+/// <param name="half">= Half the size of the box along every axis.</param>
+inline bool triangle_box_overlap(const Point3 v[3], const Point3& center, const Vec3& half)
+{
+    double h[3];
+    for (int a = 0; a < 3; a++)
+        h[a] = half[a] * (1 + 1e-9) + 1e-12;
+
+    // Move the box to the origin
+    const Vec3 p0 = v[0] - center, p1 = v[1] - center, p2 = v[2] - center;
+    const Vec3 edges[3] = { p1 - p0, p2 - p1, p0 - p2 };
+
+    // The box normals: the bounds of the triangle against the box
+    for (int a = 0; a < 3; a++)
+    {
+        if (std::min({ p0[a], p1[a], p2[a] }) > h[a] || std::max({ p0[a], p1[a], p2[a] }) < -h[a])
+            return false;
+    }
+
+    // The 9 edge cross products: for the axis e x unit(a), two of the corners project to the same point
+    for (const Vec3& e : edges)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            int b = (a + 1) % 3, c = (a + 2) % 3;
+
+            // Axis (0, e.z, -e.y) for a = x, and its rotations for y and z
+            Vec3 axis;
+            axis[b] = e[c];
+            axis[c] = -e[b];
+            axis[a] = 0;
+
+            double d0 = dot(p0, axis), d1 = dot(p1, axis), d2 = dot(p2, axis);
+            double radius = h[b] * std::abs(axis[b]) + h[c] * std::abs(axis[c]);
+            if (std::min({ d0, d1, d2 }) > radius || std::max({ d0, d1, d2 }) < -radius)
+                return false;
+        }
+    }
+
+    // The triangle normal: the plane of the triangle against the box
+    Vec3 normal = cross(edges[0], edges[1]);
+    double distance = dot(normal, p0);
+    double radius = h[0] * std::abs(normal[0]) + h[1] * std::abs(normal[1]) + h[2] * std::abs(normal[2]);
+    return std::abs(distance) <= radius;
+}
+
+#endif
@@ -54,7 +54,7 @@ public:
 
     bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
     {
-        rec.traversal_steps++;
+        trace_stats().traversal_steps++;
 
         if (!bbox.hit(r, ray_t))
             return false;
@@ -67,28 +67,31 @@ public:
 
     aabb hitBox() const override { return bbox; }
 
+    const shared_ptr<Primitive>& left_child() const { return left; }
+    const shared_ptr<Primitive>& right_child() const { return right; }
+
 private:
     shared_ptr<Primitive> left;
     shared_ptr<Primitive> right;
     aabb bbox;
 
     static bool box_compare(
-        const shared_ptr<Primitive> a, const shared_ptr<Primitive> b, int axis_index
+        const shared_ptr<Primitive>& a, const shared_ptr<Primitive>& b, int axis_index
     ) {
         auto a_axis_interval = a->hitBox().axis_interval(axis_index);
         auto b_axis_interval = b->hitBox().axis_interval(axis_index);
         return a_axis_interval.min < b_axis_interval.min;
     }
 
-    static bool box_x_compare(const shared_ptr<Primitive> a, const shared_ptr<Primitive> b) {
+    static bool box_x_compare(const shared_ptr<Primitive>& a, const shared_ptr<Primitive>& b) {
         return box_compare(a, b, 0);
     }
 
-    static bool box_y_compare(const shared_ptr<Primitive> a, const shared_ptr<Primitive> b) {
+    static bool box_y_compare(const shared_ptr<Primitive>& a, const shared_ptr<Primitive>& b) {
         return box_compare(a, b, 1);
     }
 
-    static bool box_z_compare(const shared_ptr<Primitive> a, const shared_ptr<Primitive> b) {
+    static bool box_z_compare(const shared_ptr<Primitive>& a, const shared_ptr<Primitive>& b) {
         return box_compare(a, b, 2);
     }
 };
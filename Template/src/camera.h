@@ -3,27 +3,44 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <atomic>
 #include <iomanip>
 #include <chrono>
+#include <mutex>
 
+#include "framebuffer.h"
 #include "interval.h"
 #include "kdtree.h"
 #include "material.h"
 #include "primitive.h"
+#include "flatbvh.h"
 #include "Grid.h"
+#include "lbvh.h"
+#include "sahbvh.h"
+#include "threadpool.h"
+#include "twolevelgrid.h"
+#include "widebvh.h"
 #include "world.h"
 
 /// <summary>
-/// Function that writes the progress to the console. The progress is defined as the number of columns of the window that have been rendered so far.
+/// Function that writes the progress to the console. The progress is defined as the number of tiles of the window that have been rendered so far.
 /// </summary>
-/// <param name="x">= the current column</param>
-inline void progress(int x)
-{   
-    auto width = conf::width;
-    auto progress_percentage = (double(x) / width) * 100.0;
-    std::cout << "Rendering: " << std::fixed << std::setprecision(1) << progress_percentage << "%   (" << x << "/" << conf::width << " columns rendered) \n";
+/// <param name="done">= the number of rendered tiles</param>
+/// <param name="total">= the total number of tiles</param>
+inline void progress(int done, int total)
+{
+    auto progress_percentage = (double(done) / total) * 100.0;
+    std::cout << "Rendering: " << std::fixed << std::setprecision(1) << progress_percentage << "%   (" << done << "/" << total << " tiles rendered) \n";
 }
 
+// Statistics of a single render thread
+struct RenderStats
+{
+    int num_rays_shot = 0;
+    vector<float> traversal_steps;
+    vector<float> intersection_tests;
+};
+
 class Camera
 {
 
@@ -37,7 +54,13 @@ class Camera
             NONE,
             BVH,
             KDtree,
-            GRID
+            GRID,
+            BVH_FLAT,
+            BVH_SAH,
+            LBVH,
+            BVH4,
+            BVH8,
+            GRID2
         };
 
         enum AntiAliasing {
@@ -45,182 +68,111 @@ class Camera
             ADAPTIVE
         };
 
-        sf::VertexArray render(World& world, bool rendered, AccelStruct axl, AntiAliasing aa, vector<float>& traversal_steps, vector<float>& intersection_tests)
+        Framebuffer render(World& world, bool rendered, AccelStruct axl, AntiAliasing aa, vector<float>& traversal_steps, vector<float>& intersection_tests)
         {
             initialize();
 
-            // Array of pixels
-            auto arr = sf::VertexArray(sf::PrimitiveType::Points, conf::window_size.x * conf::window_size.y);
+            // Linear colors of the pixels
+            Framebuffer image(conf::width, conf::height);
 
-            KdTree tree = KdTree();
-            KdNode* root = tree.buildTree({});
-            Grid grid = Grid();
-            if (axl == KDtree) root = tree.buildTree(world.objects);
+            if (axl == KDtree)
+            {
+                auto tree = make_shared<KdTree>();
+                tree->traversalCost = conf::kd_traversal_cost;
+                tree->intersectionCost = conf::kd_intersection_cost;
+                tree->emptyBonus = conf::kd_empty_bonus;
+
+                auto build_start = std::chrono::steady_clock::now();
+                tree->buildTree(world.objects);
+                double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+
+                std::cout << "Built kd-tree in " << build_time << " seconds\n";
+                tree->stats().print("SAH kd-tree");
+                world = World(tree);
+            }
             if (axl == BVH) world = World(make_shared<bvh_node>(world));
-            if (axl == GRID) grid = Grid(world);
+
+            ThreadPool pool(conf::num_threads);
+
+            if (axl == BVH_FLAT || axl == BVH_SAH || axl == LBVH || axl == BVH4 || axl == BVH8)
+            {
+                size_t num_primitives = world.objects.size();
+                auto build_start = std::chrono::steady_clock::now();
+                shared_ptr<FlatBVH> bvh;
+                if (axl == BVH_SAH || axl == BVH4 || axl == BVH8) bvh = make_shared<FlatBVH>(SAHBuilder(sah_settings()).build(world.objects, conf::bvh_parallel_build ? &pool : nullptr));
+                else if (axl == LBVH) bvh = make_shared<FlatBVH>(LBVHBuilder(lbvh_settings()).build(world.objects));
+                else bvh = make_shared<FlatBVH>(bvh_node(world));
+                double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+
+                const char* name = axl == BVH_SAH || axl == BVH4 || axl == BVH8 ? "Binned SAH BVH" : axl == LBVH ? "Linear BVH" : "Median split BVH";
+                std::cout << "Built BVH in " << build_time << " seconds (" << num_primitives / build_time * 1e-6 << " M primitives/second)\n";
+                bvh->stats(conf::bvh_traversal_cost, conf::bvh_intersection_cost).print(name);
+                world = World(bvh);
+
+                // The wide BVHs are collapsed from the binary SAH tree
+                auto collapse = [&](auto wide)
+                {
+                    std::cout << "Collapsed into " << wide->nodes.size() << " nodes (" << wide->node_bytes() / 1024 << " KiB, "
+                              << wide->average_children() << " children per node, " << wide->simd_name() << " child tests)\n";
+                    world = World(wide);
+                };
+                if (axl == BVH4) collapse(make_shared<WideBVH<4>>(*bvh));
+                if (axl == BVH8) collapse(make_shared<WideBVH<8>>(*bvh));
+            }
+            if (axl == GRID) world = World(make_shared<Grid>(world, &pool));
+            if (axl == GRID2)
+            {
+                auto grid = make_shared<TwoLevelGrid>(world.objects);
+                grid->print_stats("Two-level grid");
+                world = World(grid);
+            }
+
+            // Every acceleration structure is a primitive, so all sampling strategies trace rays through the same path
             this->world = world;
 
-            auto start = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-            std::cout << "Started render at: " << std::ctime(&start) << "\n";
+            // The screen is split into tiles, which are the jobs for the worker threads
+            int tile_size = conf::tile_size;
+            int tiles_x = (conf::width + tile_size - 1) / tile_size;
+            int tiles_y = (conf::height + tile_size - 1) / tile_size;
+            int num_tiles = tiles_x * tiles_y;
 
-            int num_rays_shot = 0;
+            // Every worker thread keeps its own statistics, so the threads never write to shared counters
+            vector<RenderStats> stats(pool.size());
+            std::atomic<int> tiles_done = 0;
+            std::mutex progress_mutex;
 
-            // Draw function
-            for (int x = 0; x < conf::window_size.x; x++)
+            auto start = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+            std::cout << "Started render at: " << std::ctime(&start);
+            std::cout << "Rendering " << num_tiles << " tiles on " << pool.size() << " threads\n\n";
+
+            pool.run(num_tiles, [&](size_t tile, unsigned int worker)
             {
-                // Don't output the progress (again) if the screen is rendered already.
-                if (!rendered)
-                    progress(x);
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                int x1 = std::min<int>(x0 + tile_size, conf::width);
+                int y1 = std::min<int>(y0 + tile_size, conf::height);
 
-                for (int y = 0; y < conf::window_size.y; y++)
+                for (int y = y0; y < y1; y++)
                 {
-                    // Calculate current pixel in vertex array and set its position in the VertexArray
-                    auto currentPixel = y * conf::width + x;
-                    arr[currentPixel].position = sf::Vector2f(x, y);
-
-                    Vec3 color(0, 0, 0); // Starting color is always black; if we hit nothing this is the result
-                    
-                    // Anti-aliasing
-                    if (aa == FIXED)
-                    {
-                        for (int sample = 0; sample < conf::samples_per_pixel; sample++)
-                        {
-                            num_rays_shot++;
-                            Ray r = get_ray(x, y);
-                            if (axl == KDtree)
-                            {
-                                Hit_record rec;
-                                World subset = tree.traverseTree(r, root, rec);
-                                color += kdTraverse(r, conf::max_depth, subset, tree, root, traversal_steps, intersection_tests, rec); // Track the ray a certain amount of times
-                                //intersection_tests.push_back(rec.intersection_tests);
-                                //traversal_steps.push_back(rec.traversal_steps);
-                            }
-                            else if (axl == GRID)
-                            {
-                                color += gridTraverse(r, conf::max_depth, grid, traversal_steps, intersection_tests);
-                            }
-                            else
-                            {
-                                color += noAccelTraverse(r, conf::max_depth, world, traversal_steps, intersection_tests);
-                            }
-                        }
-
-                        // Set color of current pixel on the screen and apply gamma correction
-                        color *= pixel_samples_scale;
-                        color = to_gamma(color);
-                        arr[currentPixel].color = convert_to_color(color);
-                    }
-                    else if (aa == ADAPTIVE)
-                    {
-                        int num_samples = 0;
-
-                        vector<Vec3> colors;
-                        for (int sample = 0; sample < conf::first_samples; sample++)
-                        {
-                            num_rays_shot++;
-                            Ray r = get_ray(x, y);
-
-                            if (axl == NONE || axl == BVH)
-                                colors.push_back(noAccelTraverse(r, conf::max_depth, world, traversal_steps, intersection_tests));
-                            else if (axl == GRID)
-                                colors.push_back(gridTraverse(r, conf::max_depth, grid, traversal_steps, intersection_tests));
-                            else if (axl == KDtree)
-                            {
-                                std::cout << "KDtree not implemented for adaptive sampling. Please try another structure!\n";
-                                break;
-                            }
-                        }
-
-                        Vec3 mean = Vec3(0, 0, 0);
-                        Vec3 M2 = Vec3(0, 0, 0);
-                        for (Vec3 sample : colors)
-                        {
-                            num_samples++;
-                            Vec3 delta = sample - mean;
-                            mean += delta / num_samples;
-                            Vec3 delta2 = sample - mean;
-                            M2 += delta * delta2;
-                        }
-
-                        Vec3 variance = M2 / (num_samples - 1);
-
-                        // Calculate error
-                        float error_sq =
-                            0.2126 * 0.2126 * variance.x() +
-                            0.7152 * 0.7152 * variance.y() +
-                            0.0722 * 0.0722 * variance.z();
-
-                        float error = sqrt(error_sq / num_samples);
-
-                        bool satisfies = error <= conf::threshold;
-
-                        if (satisfies)
-                        {
-                            for (Vec3 sample : colors)
-                                color += sample;
-
-                            // Set color of current pixel on the screen and apply gamma correction
-                            color *= (1.0 / num_samples);
-                            color = to_gamma(color);
-                            arr[currentPixel].color = convert_to_color(color);
-                        }
-                        else
-                        {
-                            while (!satisfies && num_samples <= conf::num_samples)
-                            {
-                                int new_num_samples = 0;
-                                for (int samples_new = 0; samples_new < conf::second_samples; samples_new++)
-                                {
-                                    num_rays_shot++;
-                                    Ray r = get_ray(x, y);
-
-                                    if (axl == NONE || axl == BVH)
-                                        colors.push_back(noAccelTraverse(r, conf::max_depth, world, traversal_steps, intersection_tests));
-                                    else if (axl == GRID)
-                                        colors.push_back(gridTraverse(r, conf::max_depth, grid, traversal_steps, intersection_tests));
-                                    else if (axl == KDtree)
-                                    {
-                                        std::cout << "KDtree not implemented for adaptive sampling. Please try another structure!\n";
-                                        break;
-                                    }
-
-                                    num_samples++;
-                                }
-
-                                Vec3 mean = Vec3(0, 0, 0);
-                                Vec3 M2 = Vec3(0, 0, 0);
-                                for (Vec3 sample : colors)
-                                {
-                                    new_num_samples++;
-                                    Vec3 delta = sample - mean;
-                                    mean += delta / num_samples;
-                                    Vec3 delta2 = sample - mean;
-                                    M2 += delta * delta2;
-                                }
-
-                                Vec3 variance = M2 / (num_samples - 1);
-
-                                // Calculate error
-                                float error_sq =
-                                    0.2126 * 0.2126 * variance.x() +
-                                    0.7152 * 0.7152 * variance.y() +
-                                    0.0722 * 0.0722 * variance.z();
-
-                                float error = sqrt(error_sq / num_samples);
-
-                                satisfies = error <= conf::threshold;
-                            }
-
-                            for (Vec3 sample : colors)
-                                color += sample;
-
-                            // Set color of current pixel on the screen and apply gamma correction
-                            color *= (1.0 / num_samples);
-                            color = to_gamma(color);
-                            arr[currentPixel].color = convert_to_color(color);
-                        }
-                    }
+                    for (int x = x0; x < x1; x++)
+                        image.set(x, y, render_pixel(x, y, aa, stats[worker]));
                 }
+
+                // Don't output the progress (again) if the screen is rendered already.
+                int done = ++tiles_done;
+                if (!rendered && (done * 100 / num_tiles) != ((done - 1) * 100 / num_tiles))
+                {
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    progress(done, num_tiles);
+                }
+            });
+
+            int num_rays_shot = 0;
+            for (const RenderStats& s : stats)
+            {
+                num_rays_shot += s.num_rays_shot;
+                traversal_steps.insert(traversal_steps.end(), s.traversal_steps.begin(), s.traversal_steps.end());
+                intersection_tests.insert(intersection_tests.end(), s.intersection_tests.begin(), s.intersection_tests.end());
             }
 
             auto end = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
@@ -231,7 +183,31 @@ class Camera
 
             std::cout << "Total number of rays shot through the scene: " << num_rays_shot << "\n";
 
-            return arr;
+            return image;
+        }
+
+        /// <summary>
+        /// Gets the settings of the binned SAH builder from the configuration.
+        /// </summary>
+        static SAHSettings sah_settings()
+        {
+            SAHSettings settings;
+            settings.bins = conf::bvh_bins;
+            settings.max_leaf_size = conf::bvh_max_leaf_size;
+            settings.traversal_cost = conf::bvh_traversal_cost;
+            settings.intersection_cost = conf::bvh_intersection_cost;
+            return settings;
+        }
+
+        /// <summary>
+        /// Gets the settings of the linear BVH builder from the configuration.
+        /// </summary>
+        static LBVHSettings lbvh_settings()
+        {
+            LBVHSettings settings;
+            settings.max_leaf_size = conf::bvh_max_leaf_size;
+            settings.rotation_passes = conf::lbvh_rotation_passes;
+            return settings;
         }
 
     private:
@@ -279,148 +255,148 @@ class Camera
         }
 
         /// <summary>
-        /// Gets a 3D vector containing the RGB values of the color.
-        /// This is a recursive function that traces the ray up to a certain amount of bounces.
+        /// Gets the color of a single pixel, by shooting the rays of the chosen anti-aliasing method through it.
         /// </summary>
-        /// <param name="r">= The ray that is being traced.</param>
-        /// <param name="depth">= The current depth.</param>
-        /// <param name="world">= The world of primitives.</param>
-        /// <returns>A 3D vector containing the RGB values of the resulting color.</returns>
-        Vec3 kdTraverse(const Ray& r, int depth, const World subset, KdTree tree, KdNode* root, vector<float>& traversal_steps, vector<float>& intersection_tests, Hit_record record) const
+        /// <param name="x">= x-coordinate of the pixel</param>
+        /// <param name="y">= y-coordinate of the pixel</param>
+        /// <param name="stats">= The statistics of the thread that renders the pixel.</param>
+        /// <returns>The average (linear) color of the samples.</returns>
+        Vec3 render_pixel(int x, int y, AntiAliasing aa, RenderStats& stats) const
         {
-            if (depth <= 0)
-                return Vec3(0, 0, 0);
+            // The random numbers of a sample only depend on the seed, the pixel and the sample, not on the thread that renders it
+            uint64_t pixel = uint64_t(y) * conf::width + x;
 
-            Hit_record rec;
-            if (subset.hit(r, Interval(0.001, infinity), rec))
-            {
-                Ray scat;
-                Vec3 att;
+            vector<float>& traversal_steps = stats.traversal_steps;
+            vector<float>& intersection_tests = stats.intersection_tests;
 
-                //intersection_tests.push_back(record.intersection_tests);
-                //traversal_steps.push_back(record.traversal_steps);
+            Vec3 color(0, 0, 0); // Starting color is always black; if we hit nothing this is the result
 
-                if (rec.mat->scatter(r, rec, att, scat))
+            // Anti-aliasing
+            if (aa == FIXED)
+            {
+                for (int sample = 0; sample < conf::samples_per_pixel; sample++)
                 {
-                    Hit_record r;
-                    auto prims = tree.traverseTree(scat, root, r);
-                    intersection_tests.push_back(r.intersection_tests);
-                    traversal_steps.push_back(r.traversal_steps);
-                    return att * kdTraverse(scat, depth - 1, prims, tree, root, traversal_steps, intersection_tests, record);
+                    stats.num_rays_shot++;
+                    random_begin_sample(conf::seed, pixel, sample);
+                    Ray r = get_ray(x, y);
+                    color += trace(r, conf::max_depth, traversal_steps, intersection_tests);
                 }
 
+                return color * pixel_samples_scale;
+            }
+
+            int num_samples = 0;
 
-                return Vec3(0, 0, 0);
+            vector<Vec3> colors;
+            for (int sample = 0; sample < conf::first_samples; sample++)
+            {
+                stats.num_rays_shot++;
+                random_begin_sample(conf::seed, pixel, colors.size());
+                Ray r = get_ray(x, y);
+                colors.push_back(trace(r, conf::max_depth, traversal_steps, intersection_tests));
             }
 
-            Vec3 unit_dir = unit_vector(r.direction());
-            auto a = 0.5 * (unit_dir.y() + 1.0);
-            return (1.0 - a) * Vec3(1.0, 1.0, 1.0) + a * Vec3(0.5, 0.7, 1.0);
-        }
+            Vec3 mean = Vec3(0, 0, 0);
+            Vec3 M2 = Vec3(0, 0, 0);
+            for (Vec3 sample : colors)
+            {
+                num_samples++;
+                Vec3 delta = sample - mean;
+                mean += delta / num_samples;
+                Vec3 delta2 = sample - mean;
+                M2 += delta * delta2;
+            }
 
-        /// <summary>
-        /// Gets a 3D vector containing the RGB values of the color.
-        /// This is a recursive function that traces the ray up to a certain amount of bounces.
-        /// </summary>
-        /// <param name="r">= The ray that is being traced.</param>
-        /// <param name="depth">= The current depth.</param>
-        /// <param name="world">= The world of primitives.</param>
-        /// <returns>A 3D vector containing the RGB values of the resulting color.</returns>
-        Vec3 noAccelTraverse(const Ray& r, int depth, const World& world, vector<float>& traversal_steps, vector<float>& intersection_tests) const
-        {
-            if (depth <= 0)
-                return Vec3(0, 0, 0);
+            Vec3 variance = M2 / (num_samples - 1);
 
-            Hit_record rec;
-            if (world.hit(r, Interval(0.001, infinity), rec))
+            // Calculate error
+            float error_sq =
+                0.2126 * 0.2126 * variance.x() +
+                0.7152 * 0.7152 * variance.y() +
+                0.0722 * 0.0722 * variance.z();
+
+            float error = sqrt(error_sq / num_samples);
+
+            bool satisfies = error <= conf::threshold;
+
+            while (!satisfies && num_samples <= conf::num_samples)
             {
-                Ray scat;
-                Vec3 att;
+                int new_num_samples = 0;
+                for (int samples_new = 0; samples_new < conf::second_samples; samples_new++)
+                {
+                    stats.num_rays_shot++;
+                    random_begin_sample(conf::seed, pixel, colors.size());
+                    Ray r = get_ray(x, y);
+                    colors.push_back(trace(r, conf::max_depth, traversal_steps, intersection_tests));
 
-                intersection_tests.push_back(rec.intersection_tests);
-                traversal_steps.push_back(rec.traversal_steps);
+                    num_samples++;
+                }
 
-                if (rec.mat->scatter(r, rec, att, scat))
-                    return att * noAccelTraverse(scat, depth - 1, world, traversal_steps, intersection_tests);
+                Vec3 mean = Vec3(0, 0, 0);
+                Vec3 M2 = Vec3(0, 0, 0);
+                for (Vec3 sample : colors)
+                {
+                    new_num_samples++;
+                    Vec3 delta = sample - mean;
+                    mean += delta / num_samples;
+                    Vec3 delta2 = sample - mean;
+                    M2 += delta * delta2;
+                }
 
-                return Vec3(0, 0, 0);
+                Vec3 variance = M2 / (num_samples - 1);
+
+                // Calculate error
+                float error_sq =
+                    0.2126 * 0.2126 * variance.x() +
+                    0.7152 * 0.7152 * variance.y() +
+                    0.0722 * 0.0722 * variance.z();
+
+                float error = sqrt(error_sq / num_samples);
+
+                satisfies = error <= conf::threshold;
             }
 
-            Vec3 unit_dir = unit_vector(r.direction());
-            auto a = 0.5 * (unit_dir.y() + 1.0);
-            return (1.0 - a) * Vec3(1.0, 1.0, 1.0) + a * Vec3(0.5, 0.7, 1.0);
+            for (Vec3 sample : colors)
+                color += sample;
+
+            return color * (1.0 / num_samples);
         }
 
         /// <summary>
         /// Gets a 3D vector containing the RGB values of the color.
-        /// This is a recursive function that traces the ray up to a certain amount of bounces.
+        /// This is a recursive function that traces the ray up to a certain amount of bounces, through whichever acceleration structure the world holds.
         /// </summary>
         /// <param name="r">= The ray that is being traced.</param>
         /// <param name="depth">= The current depth.</param>
-        /// <param name="world">= The world of primitives.</param>
         /// <returns>A 3D vector containing the RGB values of the resulting color.</returns>
-        Vec3 gridTraverse(const Ray& r, int depth, const Grid& grid, vector<float>& traversal_steps, vector<float>& intersection_tests) const
+        Vec3 trace(const Ray& r, int depth, vector<float>& traversal_steps, vector<float>& intersection_tests) const
         {
             if (depth <= 0)
                 return Vec3(0, 0, 0);
 
             Hit_record rec;
-            if (grid.hit(r, Interval(0.001, infinity), rec))
+            TraceStats& counters = trace_stats();
+            TraceStats before = counters;
+            if (world.hit(r, Interval(0.001, infinity), rec))
             {
-                //std::cout << "Hit found" << std::endl;
                 Ray scat;
                 Vec3 att;
 
-                intersection_tests.push_back(rec.intersection_tests);
-                traversal_steps.push_back(rec.traversal_steps);
+                intersection_tests.push_back(counters.intersection_tests - before.intersection_tests);
+                traversal_steps.push_back(counters.traversal_steps - before.traversal_steps);
 
-                if (rec.mat->scatter(r, rec, att, scat))
-                    return att * gridTraverse(scat, depth - 1, grid, traversal_steps, intersection_tests);
+                random_begin_bounce(conf::max_depth - depth + 1);
+                if (MaterialTable::get(rec.material)->scatter(r, rec.surface(r), att, scat))
+                    return att * trace(scat, depth - 1, traversal_steps, intersection_tests);
 
                 return Vec3(0, 0, 0);
             }
 
-
             Vec3 unit_dir = unit_vector(r.direction());
             auto a = 0.5 * (unit_dir.y() + 1.0);
             return (1.0 - a) * Vec3(1.0, 1.0, 1.0) + a * Vec3(0.5, 0.7, 1.0);
         }
 
-
-        /// <summary>
-        /// Applies gamma correction to one of the values within a RGB vector.
-        /// </summary>
-        /// <param name="comp">= The RGB component.</param>
-        /// <returns></returns>
-        Vec3 to_gamma(Vec3 v)
-        {
-            double x, y, z;
-            if (v.x() > 0)
-                x = std::sqrt(v.x());
-            else x = 0;
-
-            if (v.y() > 0)
-                y = std::sqrt(v.y());
-            else y = 0;
-
-            if (v.z() > 0)
-                z = std::sqrt(v.z());
-            else z = 0;
-
-            return Vec3(x, y, z);
-        }
-
-        /// <summary>
-        /// Converts a Vec3 color to a Color color.
-        /// </summary>
-        /// <param name="color">= A color of the type Vec3</param>
-        /// <returns>A color of the type Color</returns>
-        sf::Color convert_to_color(const Vec3 color)
-        {
-            static const Interval intensity(0.000, 0.999);
-            return sf::Color(256 * intensity.clamp(color.x()), 256 * intensity.clamp(color.y()), 256 * intensity.clamp(color.z()));
-        }
-
         /// <summary>
         /// Gets a ray, based on the viewport and the camera position.
         /// </summary>
@@ -0,0 +1,233 @@
+// Headless front end of the ray tracer: renders a scene into a float framebuffer and writes it to an image file.
+// Does not need a display or SFML, so renders can be scripted and timed on batch machines.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "configuration.hpp"
+
+#include "aabb.h"
+#include "bvhnode.h"
+#include "common.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "kdtree.h"
+#include "material.h"
+#include "primitive.h"
+#include "scenes.h"
+#include "world.h"
+
+void print_usage()
+{
+    std::cout << "Usage: RayTracerCLI [options]\n"
+        << "  --scene <n>          Test scene: 1: Bunny1, 2: Bunny2, 3: Bunny3, 4: Stack, 5: Colored stack, 6: UU,\n"
+        << "                       7: Bunny field (1024 instances of the bunny) (default 1)\n"
+        << "  --obj <file>         Render an .obj file instead of a test scene\n"
+        << "  --camera <x,y,z>     Camera position (for --obj)\n"
+        << "  --look <x,y,z>       Point the camera looks at (for --obj)\n"
+        << "  --accel <name>       none, bvh, bvh-flat, bvh-sah, lbvh, bvh4, bvh8, kd, grid or grid2 (default bvh)\n"
+        << "  --aa <name>          fixed or adaptive (default fixed)\n"
+        << "  --spp <n>            Samples per pixel (default " << conf::samples_per_pixel << ")\n"
+        << "  --depth <n>          Maximum number of bounces (default " << conf::max_depth << ")\n"
+        << "  --width <n>          Image width (default " << conf::width << ")\n"
+        << "  --height <n>         Image height (default: width / aspect ratio)\n"
+        << "  --bins <n>           Bins per axis of the SAH builder (default " << conf::bvh_bins << ")\n"
+        << "  --leaf-size <n>      Maximum leaf size of the SAH and linear builders (default " << conf::bvh_max_leaf_size << ")\n"
+        << "  --rotations <n>      Tree rotation passes of the linear builder (default " << conf::lbvh_rotation_passes << ")\n"
+        << "  --scalar-triangles   Test the triangles in the leaves one by one instead of in SIMD batches\n"
+        << "  --no-watertight      Intersect triangles with the previous tests, which can miss rays through shared edges\n"
+        << "  --serial-build       Build the SAH BVH on one thread (gives the same tree)\n"
+        << "  --grid-density <x>   Voxels per primitive of the grid (default " << conf::grid_density << ")\n"
+        << "  --grid-res <n>       Voxels along x of the grid, instead of choosing from the density\n"
+        << "  --grid-skip          Skip empty space in the grid with a distance field\n"
+        << "  --grid-bbox          Put triangles in every grid voxel their bounding box touches (no exact overlap test)\n"
+        << "  --threads <n>        Number of render threads, 0 = all hardware threads (default 0)\n"
+        << "  --seed <n>           Seed of the random numbers (default 0)\n"
+        << "  --output <file>      Output image, .ppm, .pfm or .png (default render.ppm)\n"
+        << "  --quiet              Do not print the render progress\n";
+}
+
+bool parse_vec3(const std::string& s, Vec3& v)
+{
+    double x, y, z;
+    if (std::sscanf(s.c_str(), "%lf,%lf,%lf", &x, &y, &z) != 3)
+        return false;
+
+    v = Vec3(x, y, z);
+    return true;
+}
+
+/// <summary>
+/// Parses an integer that makes up the whole string ("640", not "640x" or "6.4") and is at least min.
+/// Throws like std::stoll on text that does not start with a number.
+/// </summary>
+template <typename T>
+bool parse_int(const std::string& s, long long min, T& n)
+{
+    size_t end;
+    long long value = std::stoll(s, &end);
+    if (end != s.size() || value < min || (unsigned long long)value > (unsigned long long)std::numeric_limits<T>::max())
+        return false;
+
+    n = T(value);
+    return true;
+}
+
+/// <summary>
+/// Parses a finite number that makes up the whole string. Negative numbers are rejected, and so is 0 unless zero_allowed.
+/// Throws like std::stod on text that does not start with a number.
+/// </summary>
+bool parse_real(const std::string& s, bool zero_allowed, double& x)
+{
+    size_t end;
+    double value = std::stod(s, &end);
+    if (end != s.size() || !std::isfinite(value) || value < 0 || (value == 0 && !zero_allowed))
+        return false;
+
+    x = value;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int test = 1;
+    std::string obj_file;
+    std::string accel = "bvh";
+    std::string aa = "fixed";
+    std::string output = "render.ppm";
+    bool quiet = false;
+    bool height_set = false;
+
+    Camera cam;
+    cam.v_up = Vec3(0, 1, 0);
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        std::string value = has_value ? argv[i + 1] : "";
+
+        if (arg == "--help" || arg == "-h") { print_usage(); return 0; }
+        if (arg == "--quiet") { quiet = true; continue; }
+        if (arg == "--serial-build") { conf::bvh_parallel_build = false; continue; }
+        if (arg == "--scalar-triangles") { conf::packed_triangles = false; continue; }
+        if (arg == "--no-watertight") { conf::watertight_triangles = false; continue; }
+        if (arg == "--grid-bbox") { conf::grid_exact_overlap = false; continue; }
+        if (arg == "--grid-skip") { conf::grid_distance_field = true; continue; }
+
+        if (!has_value)
+        {
+            std::cout << "Missing value for " << arg << "\n";
+            print_usage();
+            return 1;
+        }
+        i++;
+
+        bool ok = true;
+        try
+        {
+            if (arg == "--scene") ok = parse_int(value, 1, test);
+            else if (arg == "--obj") obj_file = value;
+            else if (arg == "--camera") ok = parse_vec3(value, cam.cam_pos);
+            else if (arg == "--look") ok = parse_vec3(value, cam.cam_dir);
+            else if (arg == "--accel") accel = value;
+            else if (arg == "--aa") aa = value;
+            else if (arg == "--spp") ok = parse_int(value, 1, conf::samples_per_pixel);
+            else if (arg == "--depth") ok = parse_int(value, 0, conf::max_depth);
+            else if (arg == "--width") ok = parse_int(value, 1, conf::width);
+            else if (arg == "--height") { ok = parse_int(value, 1, conf::height); height_set = true; }
+            else if (arg == "--bins") ok = parse_int(value, 1, conf::bvh_bins);
+            else if (arg == "--leaf-size") ok = parse_int(value, 1, conf::bvh_max_leaf_size);
+            else if (arg == "--rotations") ok = parse_int(value, 0, conf::lbvh_rotation_passes);
+            else if (arg == "--grid-density") ok = parse_real(value, false, conf::grid_density);
+            else if (arg == "--grid-res") ok = parse_real(value, true, conf::voxels_on_x);
+            else if (arg == "--threads") ok = parse_int(value, 0, conf::num_threads);
+            else if (arg == "--seed") ok = parse_int(value, 0, conf::seed);
+            else if (arg == "--output") output = value;
+            else ok = false;
+        }
+        catch (const std::logic_error&)
+        {
+            // std::invalid_argument (not a number) or std::out_of_range
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            std::cout << "Invalid argument: " << arg << " " << value << "\n";
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (!height_set)
+        conf::height = int(conf::width / conf::aspect_ratio);
+
+    Camera::AccelStruct struc;
+    if (accel == "none") struc = Camera::NONE;
+    else if (accel == "bvh") struc = Camera::BVH;
+    else if (accel == "kd") struc = Camera::KDtree;
+    else if (accel == "grid") struc = Camera::GRID;
+    else if (accel == "grid2") struc = Camera::GRID2;
+    else if (accel == "bvh-flat") struc = Camera::BVH_FLAT;
+    else if (accel == "bvh-sah") struc = Camera::BVH_SAH;
+    else if (accel == "lbvh") struc = Camera::LBVH;
+    else if (accel == "bvh4") struc = Camera::BVH4;
+    else if (accel == "bvh8") struc = Camera::BVH8;
+    else
+    {
+        std::cout << "Unknown acceleration structure: " << accel << "\n";
+        return 1;
+    }
+
+    Camera::AntiAliasing aa_method;
+    if (aa == "fixed") aa_method = Camera::FIXED;
+    else if (aa == "adaptive") aa_method = Camera::ADAPTIVE;
+    else
+    {
+        std::cout << "Unknown anti-aliasing method: " << aa << "\n";
+        return 1;
+    }
+
+    auto load_start = std::chrono::steady_clock::now();
+
+    World world;
+    if (!obj_file.empty())
+    {
+        Parser parser;
+        add_mesh(parser.parse(obj_file, Point3(0, 0, 0)), world);
+    }
+    else
+        load_scene(test, cam, world);
+
+    auto load_end = std::chrono::steady_clock::now();
+    std::cout << "Number of primitives: " << world.objects.size() << std::endl;
+
+    if (world.objects.empty())
+    {
+        std::cout << "The scene is empty, nothing to render.\n";
+        return 1;
+    }
+
+    vector<float> traversal_steps;
+    vector<float> intersection_tests;
+    Framebuffer image = cam.render(world, quiet, struc, aa_method, traversal_steps, intersection_tests);
+
+    auto render_end = std::chrono::steady_clock::now();
+
+    if (!image.write(output))
+    {
+        std::cout << "Could not write " << output << "\n";
+        return 1;
+    }
+
+    std::cout << "Wrote " << image.width << "x" << image.height << " image to " << output << "\n";
+    std::cout << "Load time: " << std::chrono::duration<double>(load_end - load_start).count() << " seconds\n";
+    std::cout << "Build + render time: " << std::chrono::duration<double>(render_end - load_end).count() << " seconds\n";
+
+    return 0;
+}
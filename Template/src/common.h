@@ -9,6 +9,9 @@
 #include <limits>
 #include <memory>
 #include <numeric>
+#include <vector>
+
+#include "rng.h"
 
 // C++ Std Usings
 
@@ -27,9 +30,10 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
+// All random numbers come from the per-thread generator in rng.h
 inline double random_double()
 {
-    return std::rand() / (RAND_MAX + 1.0);
+    return random_canonical();
 }
 
 inline double random_double(double min, double max)
@@ -51,6 +55,6 @@ inline float average(std::vector<float> v)
 
 #include "interval.h"
 #include "ray.h"
-#include "Vec3.h"
+#include "vec3.h"
 
 #endif
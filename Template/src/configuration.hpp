@@ -1,16 +1,16 @@
 #pragma once
 
+#include <cstdint>
+
 namespace conf
 {
 	// Window configuration
 	auto aspect_ratio = 16.0 / 9.0;
 	unsigned int width = 720;
 	unsigned int height = int(width / aspect_ratio);
-	sf::Vector2u const window_size = {width, height};
-	sf::Vector2f const window_size_f = static_cast<sf::Vector2f>(window_size);
 	uint32_t const max_framerate = 144;
 	float const dt = 1.0f / static_cast<float>(max_framerate);
-	double voxels_on_x = 50;
+	double voxels_on_x = 0; // Grid resolution along x; 0 = choose the resolution from the number of primitives (grid_density)
 
 	// RT config
 	int samples_per_pixel = 100;
@@ -18,6 +18,35 @@ namespace conf
 	double vfov = 80;
 	double defocus_angle = 1;
 	double focus_dist = 10;
+	bool packed_triangles = true; // Filter the triangles of BVH, kd-tree and grid leaves with a SIMD test of several at once (same result)
+	bool watertight_triangles = true; // Intersect triangles with the watertight test, so rays do not slip through shared edges and vertices
+
+	// BVH build config (binned SAH builder)
+	int bvh_bins = 16;
+	int bvh_max_leaf_size = 4;
+	double bvh_traversal_cost = 1.0;
+	double bvh_intersection_cost = 1.0;
+	bool bvh_parallel_build = true; // Build large subtrees on the render threads; gives the same tree as a serial build
+	int lbvh_rotation_passes = 1; // Tree rotation passes after a linear (Morton code) BVH build
+	double bvh_rebuild_threshold = 1.5; // A refitted BVH is rebuilt once its SAH cost grows past this factor of the cost after the build
+
+	// Grid build config
+	bool grid_exact_overlap = true; // Only put triangles in the grid voxels they intersect, not in every voxel their bounding box touches
+	bool grid_distance_field = false; // Store the distance of every empty grid voxel to the nearest filled one, so rays skip empty space
+	double grid_density = 4; // Voxels per primitive of an automatically sized grid (the cube of the factor per side: 4 gives about 1.59 * N^(1/3) voxels per side)
+	size_t grid_max_voxels = size_t(1) << 24; // Upper bound on the number of voxels, to bound the memory of the grid
+	double grid2_top_density = 0.125; // Top-level cells per primitive of the two-level grid
+	int grid2_subgrid_threshold = 8; // Top-level cells with more primitives than this get a sub-grid
+
+	// Kd-tree build config (SAH builder)
+	double kd_traversal_cost = 1.0;
+	double kd_intersection_cost = 1.5;
+	double kd_empty_bonus = 0.2; // Part of the cost that is saved by a split that cuts off empty space
+
+	// Parallel render config
+	unsigned int num_threads = 0; // 0 = one thread per hardware thread
+	int tile_size = 16; // Width and height of a render tile in pixels
+	uint64_t seed = 0; // A fixed seed gives the same image for any number of threads
 
 	// Adaptive sampling config
 	int first_samples = 20;
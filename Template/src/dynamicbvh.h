@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef DYNAMICBVH_H
+#define DYNAMICBVH_H
+
+#include <vector>
+
+#include "flatbvh.h"
+#include "primitive.h"
+#include "sahbvh.h"
+#include "threadpool.h"
+
+/// <summary>
+/// A BVH over primitives that move from frame to frame while the topology stays the same (for example a deforming mesh).
+/// After the primitives moved, update() refits the node bounds in one linear pass. Refitting keeps the tree structure, so the
+/// tree gets worse as the primitives drift away from where they were when it was built; once its SAH cost has grown past
+/// a threshold relative to the cost right after the last build, the tree is rebuilt from scratch instead.
+/// </summary>
+class DynamicBVH : public Primitive
+{
+    public:
+        /// <summary>
+        /// Builds the BVH.
+        /// </summary>
+        /// <param name="objects">= The primitives; they are shared, so moving them (for example with Triangle::set_vertices) is seen by update().</param>
+        /// <param name="settings">= The settings of the SAH builder, also used for the cost metric.</param>
+        /// <param name="rebuild_threshold">= Rebuild when the SAH cost is more than this factor above the cost after the last build.</param>
+        /// <param name="pool">= Optional thread pool for the (re)builds.</param>
+        DynamicBVH(std::vector<shared_ptr<Primitive>> objects, SAHSettings settings = SAHSettings(), double rebuild_threshold = 1.5, ThreadPool* pool = nullptr)
+            : objects(std::move(objects)), settings(settings), rebuild_threshold(rebuild_threshold), pool(pool)
+        {
+            rebuild();
+        }
+
+        /// <summary>
+        /// Updates the BVH after the primitives moved: refits it, or rebuilds it if refitting made it too slow.
+        /// </summary>
+        /// <returns>true if the BVH was rebuilt.</returns>
+        bool update()
+        {
+            bvh.refit();
+            refit_count++;
+
+            if (cost() > rebuild_threshold * built_cost)
+            {
+                rebuild();
+                return true;
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Builds the BVH from scratch.
+        /// </summary>
+        void rebuild()
+        {
+            bvh = SAHBuilder(settings).build(objects, pool);
+            built_cost = cost();
+            rebuild_count++;
+        }
+
+        /// <summary>
+        /// Gets the SAH cost of the current tree.
+        /// </summary>
+        double cost() const { return bvh.sah_cost(settings.traversal_cost, settings.intersection_cost); }
+
+        /// <summary>
+        /// Gets the SAH cost of the tree right after the last build.
+        /// </summary>
+        double cost_after_build() const { return built_cost; }
+
+        int refits() const { return refit_count; }
+        int rebuilds() const { return rebuild_count; }
+        const FlatBVH& tree() const { return bvh; }
+
+        aabb hitBox() const override { return bvh.hitBox(); }
+
+        bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
+        {
+            return bvh.hit(r, ray_t, rec);
+        }
+
+    private:
+        std::vector<shared_ptr<Primitive>> objects;
+        SAHSettings settings;
+        double rebuild_threshold;
+        ThreadPool* pool;
+
+        FlatBVH bvh;
+        double built_cost = 0;
+        int refit_count = 0;
+        int rebuild_count = 0;
+};
+
+#endif
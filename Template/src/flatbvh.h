@@ -0,0 +1,367 @@
+#pragma once
+
+#ifndef FLATBVH_H
+#define FLATBVH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "aabb.h"
+#include "bvhnode.h"
+#include "leafprimitives.h"
+#include "primitive.h"
+
+/// <summary>
+/// Rounds a double down to the nearest float, so a float box is never smaller than the double box.
+/// </summary>
+inline float round_down_float(double x)
+{
+    float f = float(x);
+    return double(f) > x ? std::nextafter(f, -INFINITY) : f;
+}
+
+/// <summary>
+/// Rounds a double up to the nearest float, so a float box is never smaller than the double box.
+/// </summary>
+inline float round_up_float(double x)
+{
+    float f = float(x);
+    return double(f) < x ? std::nextafter(f, INFINITY) : f;
+}
+
+// A node of the flattened BVH. Exactly 32 bytes, so two nodes share a cache line.
+// The first child of an interior node is always the next node in the array; only the second child needs an offset.
+struct FlatBVHNode
+{
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;    // Interior node: index of the second child. Leaf: index of the first primitive.
+    uint16_t count;     // Number of primitives in a leaf; 0 for interior nodes.
+    uint8_t axis;       // Split axis of an interior node, used to visit the nearer child first.
+    uint8_t pad;
+
+    bool is_leaf() const { return count > 0; }
+
+    /// <summary>
+    /// Sets the bounds of the node, rounded outwards to floats.
+    /// </summary>
+    void set_bounds(const double min[3], const double max[3])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            bounds_min[a] = round_down_float(min[a]);
+            bounds_max[a] = round_up_float(max[a]);
+        }
+    }
+
+    void set_bounds(const aabb& box)
+    {
+        const double min[3] = { box.x.min, box.y.min, box.z.min };
+        const double max[3] = { box.x.max, box.y.max, box.z.max };
+        set_bounds(min, max);
+    }
+
+    aabb box() const
+    {
+        return aabb(
+            Interval(bounds_min[0], bounds_max[0]),
+            Interval(bounds_min[1], bounds_max[1]),
+            Interval(bounds_min[2], bounds_max[2]));
+    }
+
+    double surface_area() const
+    {
+        double dx = bounds_max[0] - bounds_min[0];
+        double dy = bounds_max[1] - bounds_min[1];
+        double dz = bounds_max[2] - bounds_min[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+static_assert(sizeof(FlatBVHNode) == 32, "FlatBVHNode should be 32 bytes");
+
+// Quality statistics of a BVH, used to compare builders
+struct BVHStats
+{
+    double sah_cost = 0;
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    int max_depth = 0;
+    std::vector<size_t> leaf_sizes; // leaf_sizes[n] = number of leaves with n primitives
+
+    void print(const std::string& name) const
+    {
+        std::cout << name << ": SAH cost " << sah_cost << ", " << node_count << " nodes, " << leaf_count << " leaves, depth " << max_depth << "\n";
+        std::cout << "  Leaf sizes:";
+        for (size_t n = 1; n < leaf_sizes.size(); n++)
+            if (leaf_sizes[n] > 0)
+                std::cout << " " << n << ": " << leaf_sizes[n];
+        std::cout << "\n";
+    }
+};
+
+// A BVH stored as one contiguous array of nodes in depth-first order, with the primitives reordered so every leaf
+// refers to a contiguous range of them. Traversal uses an explicit stack instead of virtual calls per node.
+class FlatBVH : public Primitive
+{
+    public:
+        std::vector<FlatBVHNode> nodes;
+        LeafPrimitives primitives;
+
+        // Size of the traversal stack, which holds at most one node per level. The builders keep every leaf within this many levels of the root.
+        static constexpr int max_depth = 64;
+
+        FlatBVH() {}
+
+        /// <summary>
+        /// Flattens a pointer-based BVH. The tree itself is not needed anymore afterwards.
+        /// </summary>
+        /// <param name="root">= The root node of the BVH.</param>
+        explicit FlatBVH(const bvh_node& root)
+        {
+            std::vector<shared_ptr<Primitive>> list;
+            flatten(root, list);
+            bbox = root.hitBox();
+            primitives.build(std::move(list));
+        }
+
+        /// <summary>
+        /// Creates a BVH from nodes and primitives that are already in the flattened layout.
+        /// </summary>
+        FlatBVH(std::vector<FlatBVHNode> nodes, std::vector<shared_ptr<Primitive>> primitives)
+            : nodes(std::move(nodes)), primitives(std::move(primitives))
+        {
+            if (!this->nodes.empty())
+                bbox = this->nodes[0].box();
+        }
+
+        aabb hitBox() const override { return bbox; }
+
+        bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
+        {
+            if (nodes.empty())
+                return false;
+
+            const double origin[3] = { r.origin().x(), r.origin().y(), r.origin().z() };
+            const double inv_dir[3] = { 1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z() };
+            const bool dir_is_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+            const LeafPrimitives::RayData ray = LeafPrimitives::ray_data(r);
+
+            uint32_t stack[max_depth];
+            int stack_size = 0;
+            uint32_t current = 0;
+
+            TraceStats& stats = trace_stats();
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            while (true)
+            {
+                stats.traversal_steps++;
+                const FlatBVHNode& node = nodes[current];
+
+                if (node_hit(node, origin, inv_dir, ray_t.min, closest))
+                {
+                    if (node.is_leaf())
+                        hit_anything |= primitives.hit_range(node.offset, node.count, ray, r, ray_t.min, closest, rec);
+                    else
+                    {
+                        // Visit the child on the near side of the split first; the far child waits on the stack
+                        if (dir_is_neg[node.axis])
+                        {
+                            stack[stack_size++] = current + 1;
+                            current = node.offset;
+                        }
+                        else
+                        {
+                            stack[stack_size++] = node.offset;
+                            current = current + 1;
+                        }
+                        continue;
+                    }
+                }
+
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+
+            return hit_anything;
+        }
+
+        /// <summary>
+        /// Gets the number of levels below a node of count primitives when it is split in halves until no leaf has more than max_leaf_size.
+        /// A builder that has no more than this many levels left before max_depth has to split the node that way.
+        /// </summary>
+        static int balanced_depth(size_t count, size_t max_leaf_size)
+        {
+            int depth = 0;
+            for (size_t capacity = max_leaf_size; capacity < count; capacity *= 2)
+                depth++;
+            return depth;
+        }
+
+        /// <summary>
+        /// Gets the memory used by the nodes, in bytes.
+        /// </summary>
+        size_t node_bytes() const { return nodes.size() * sizeof(FlatBVHNode); }
+
+        /// <summary>
+        /// Updates the bounds of every node (and the packed triangles) after the primitives moved, without changing the structure of the tree.
+        /// Children are always stored after their parent, so one pass from the back of the array visits every node after its children.
+        /// </summary>
+        void refit()
+        {
+            for (size_t i = nodes.size(); i-- > 0;)
+            {
+                FlatBVHNode& node = nodes[i];
+                aabb box;
+                if (node.is_leaf())
+                {
+                    box = primitives[node.offset]->hitBox();
+                    for (uint32_t p = node.offset + 1; p < node.offset + node.count; p++)
+                        box = aabb(box, primitives[p]->hitBox());
+                }
+                else
+                    box = aabb(nodes[i + 1].box(), nodes[node.offset].box());
+
+                node.set_bounds(box);
+            }
+
+            if (!nodes.empty())
+                bbox = nodes[0].box();
+            primitives.repack();
+        }
+
+        /// <summary>
+        /// Computes the SAH cost of the tree (see stats) in one pass over the nodes.
+        /// </summary>
+        double sah_cost(double traversal_cost, double intersection_cost) const
+        {
+            if (nodes.empty())
+                return 0;
+
+            double root_area = nodes[0].surface_area();
+            double cost = 0;
+            for (const FlatBVHNode& node : nodes)
+            {
+                double relative_area = root_area > 0 ? node.surface_area() / root_area : 1;
+                cost += (node.is_leaf() ? intersection_cost * node.count : traversal_cost) * relative_area;
+            }
+            return cost;
+        }
+
+        /// <summary>
+        /// Computes the quality statistics of the tree. The SAH cost is the expected cost of tracing a ray that hits the root,
+        /// with every node and primitive weighted by the chance (surface area relative to the root) that the ray reaches it.
+        /// </summary>
+        /// <param name="traversal_cost">= The cost of visiting an interior node.</param>
+        /// <param name="intersection_cost">= The cost of intersecting a primitive.</param>
+        BVHStats stats(double traversal_cost, double intersection_cost) const
+        {
+            BVHStats s;
+            if (nodes.empty())
+                return s;
+
+            double root_area = nodes[0].surface_area();
+            s.node_count = nodes.size();
+
+            std::vector<std::pair<uint32_t, int>> stack = { { 0, 0 } };
+            while (!stack.empty())
+            {
+                auto [index, depth] = stack.back();
+                stack.pop_back();
+
+                const FlatBVHNode& node = nodes[index];
+                double relative_area = root_area > 0 ? node.surface_area() / root_area : 1;
+                s.max_depth = std::max(s.max_depth, depth);
+
+                if (node.is_leaf())
+                {
+                    s.sah_cost += intersection_cost * node.count * relative_area;
+                    s.leaf_count++;
+                    if (s.leaf_sizes.size() <= node.count)
+                        s.leaf_sizes.resize(node.count + 1, 0);
+                    s.leaf_sizes[node.count]++;
+                }
+                else
+                {
+                    s.sah_cost += traversal_cost * relative_area;
+                    stack.push_back({ index + 1, depth + 1 });
+                    stack.push_back({ node.offset, depth + 1 });
+                }
+            }
+
+            return s;
+        }
+
+    private:
+        aabb bbox;
+
+        static bool node_hit(const FlatBVHNode& node, const double origin[3], const double inv_dir[3], double t_min, double t_max)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                double t0 = (node.bounds_min[a] - origin[a]) * inv_dir[a];
+                double t1 = (node.bounds_max[a] - origin[a]) * inv_dir[a];
+                if (inv_dir[a] < 0)
+                    std::swap(t0, t1);
+
+                // Written so a NaN (0 * infinity for a ray in the plane of the box) leaves the interval as it is
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+            }
+
+            return t_min <= t_max;
+        }
+
+        /// <summary>
+        /// Appends a node (and its subtree) to the array in depth-first order.
+        /// </summary>
+        /// <returns>The index of the node.</returns>
+        uint32_t flatten(const bvh_node& bvh, std::vector<shared_ptr<Primitive>>& list)
+        {
+            uint32_t index = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[index].set_bounds(bvh.hitBox());
+
+            const auto& left = bvh.left_child();
+            const auto& right = bvh.right_child();
+            bool left_is_node = dynamic_cast<const bvh_node*>(left.get()) != nullptr;
+            bool right_is_node = dynamic_cast<const bvh_node*>(right.get()) != nullptr;
+
+            // Nodes whose children are both primitives become one leaf
+            if (!left_is_node && !right_is_node)
+            {
+                nodes[index].offset = uint32_t(list.size());
+                list.push_back(left);
+                if (right != left)
+                    list.push_back(right);
+                nodes[index].count = uint16_t(list.size() - nodes[index].offset);
+                return index;
+            }
+
+            nodes[index].axis = uint8_t(bvh.hitBox().longest_axis());
+            flatten_child(left, list);
+            uint32_t second = flatten_child(right, list);
+            nodes[index].offset = second;
+            return index;
+        }
+
+        uint32_t flatten_child(const shared_ptr<Primitive>& child, std::vector<shared_ptr<Primitive>>& list)
+        {
+            if (auto node = dynamic_cast<const bvh_node*>(child.get()))
+                return flatten(*node, list);
+
+            uint32_t index = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[index].set_bounds(child->hitBox());
+            nodes[index].count = 1;
+            nodes[index].offset = uint32_t(list.size());
+            list.push_back(child);
+            return index;
+        }
+};
+
+#endif
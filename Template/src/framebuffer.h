@@ -0,0 +1,236 @@
+#pragma once
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// A linear float RGB image. The renderer writes the averaged (linear) color of every pixel into it;
+// gamma correction and quantization only happen when the image is written or displayed.
+class Framebuffer
+{
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<float> pixels; // width * height * 3 floats, row by row from the top
+
+        Framebuffer() {}
+
+        Framebuffer(int width, int height) : width(width), height(height), pixels(size_t(width) * height * 3, 0.0f) {}
+
+        void set(int x, int y, const Vec3& color)
+        {
+            float* p = &pixels[(size_t(y) * width + x) * 3];
+            p[0] = float(color.x());
+            p[1] = float(color.y());
+            p[2] = float(color.z());
+        }
+
+        Vec3 get(int x, int y) const
+        {
+            const float* p = &pixels[(size_t(y) * width + x) * 3];
+            return Vec3(p[0], p[1], p[2]);
+        }
+
+        /// <summary>
+        /// Gets the gamma-corrected 8-bit color of a pixel.
+        /// </summary>
+        /// <returns>The red, green and blue values of the pixel.</returns>
+        std::array<uint8_t, 3> rgb8(int x, int y) const
+        {
+            static const Interval intensity(0.000, 0.999);
+            Vec3 c = get(x, y);
+            return {
+                uint8_t(256 * intensity.clamp(to_gamma(c.x()))),
+                uint8_t(256 * intensity.clamp(to_gamma(c.y()))),
+                uint8_t(256 * intensity.clamp(to_gamma(c.z())))
+            };
+        }
+
+        /// <summary>
+        /// Writes the image to a file. The format is chosen based on the extension: .ppm, .pfm or .png.
+        /// </summary>
+        /// <param name="path">= The path of the file.</param>
+        /// <returns>false if the extension is unknown or the file could not be written.</returns>
+        bool write(const std::string& path) const
+        {
+            auto ends_with = [&](const std::string& ext)
+            {
+                return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+            };
+
+            if (ends_with(".ppm")) return write_ppm(path);
+            if (ends_with(".pfm")) return write_pfm(path);
+            if (ends_with(".png")) return write_png(path);
+            return false;
+        }
+
+        /// <summary>
+        /// Writes the gamma-corrected image as a binary 8-bit PPM (P6) file.
+        /// </summary>
+        bool write_ppm(const std::string& path) const
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << "P6\n" << width << " " << height << "\n255\n";
+
+            std::vector<uint8_t> row(size_t(width) * 3);
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    auto c = rgb8(x, y);
+                    std::copy(c.begin(), c.end(), &row[size_t(x) * 3]);
+                }
+                out.write(reinterpret_cast<const char*>(row.data()), row.size());
+            }
+
+            return bool(out);
+        }
+
+        /// <summary>
+        /// Writes the linear image as a PFM file (32-bit float RGB, little endian, rows from the bottom).
+        /// </summary>
+        bool write_pfm(const std::string& path) const
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << "PF\n" << width << " " << height << "\n-1.0\n";
+
+            for (int y = height - 1; y >= 0; y--)
+            {
+                for (size_t i = 0; i < size_t(width) * 3; i++)
+                {
+                    uint32_t bits;
+                    std::memcpy(&bits, &pixels[size_t(y) * width * 3 + i], 4);
+                    put_le32(out, bits);
+                }
+            }
+
+            return bool(out);
+        }
+
+        /// <summary>
+        /// Writes the gamma-corrected image as an 8-bit PNG file.
+        /// The image data is stored without compression, so no zlib is needed.
+        /// </summary>
+        bool write_png(const std::string& path) const
+        {
+            // Raw image data: every row starts with filter type 0 (none)
+            std::vector<uint8_t> raw;
+            raw.reserve(size_t(height) * (size_t(width) * 3 + 1));
+            for (int y = 0; y < height; y++)
+            {
+                raw.push_back(0);
+                for (int x = 0; x < width; x++)
+                {
+                    auto c = rgb8(x, y);
+                    raw.insert(raw.end(), c.begin(), c.end());
+                }
+            }
+
+            // zlib stream with stored (uncompressed) deflate blocks of at most 65535 bytes
+            std::vector<uint8_t> zlib = { 0x78, 0x01 };
+            size_t pos = 0;
+            do
+            {
+                size_t len = std::min<size_t>(65535, raw.size() - pos);
+                bool last = pos + len == raw.size();
+                zlib.push_back(last ? 1 : 0);
+                zlib.push_back(uint8_t(len));
+                zlib.push_back(uint8_t(len >> 8));
+                zlib.push_back(uint8_t(~len));
+                zlib.push_back(uint8_t(~len >> 8));
+                zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+                pos += len;
+            } while (pos < raw.size());
+
+            uint32_t adler = adler32(raw);
+            for (int shift = 24; shift >= 0; shift -= 8)
+                zlib.push_back(uint8_t(adler >> shift));
+
+            std::vector<uint8_t> header;
+            append_be32(header, width);
+            append_be32(header, height);
+            header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bits per channel, RGB, deflate, no filter, no interlace
+
+            std::ofstream out(path, std::ios::binary);
+            const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+            out.write(reinterpret_cast<const char*>(signature), 8);
+            write_png_chunk(out, "IHDR", header);
+            write_png_chunk(out, "IDAT", zlib);
+            write_png_chunk(out, "IEND", {});
+
+            return bool(out);
+        }
+
+    private:
+        static double to_gamma(double linear)
+        {
+            return linear > 0 ? std::sqrt(linear) : 0;
+        }
+
+        static void put_le32(std::ofstream& out, uint32_t v)
+        {
+            const char bytes[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+            out.write(bytes, 4);
+        }
+
+        static void append_be32(std::vector<uint8_t>& out, uint32_t v)
+        {
+            for (int shift = 24; shift >= 0; shift -= 8)
+                out.push_back(uint8_t(v >> shift));
+        }
+
+        static uint32_t adler32(const std::vector<uint8_t>& data)
+        {
+            uint32_t a = 1, b = 0;
+            for (uint8_t byte : data)
+            {
+                a = (a + byte) % 65521;
+                b = (b + a) % 65521;
+            }
+            return (b << 16) | a;
+        }
+
+        static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+        {
+            static const std::array<uint32_t, 256> table = []()
+            {
+                std::array<uint32_t, 256> t{};
+                for (uint32_t n = 0; n < 256; n++)
+                {
+                    uint32_t c = n;
+                    for (int k = 0; k < 8; k++)
+                        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    t[n] = c;
+                }
+                return t;
+            }();
+
+            crc = ~crc;
+            for (size_t i = 0; i < size; i++)
+                crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            return ~crc;
+        }
+
+        static void write_png_chunk(std::ofstream& out, const char* type, const std::vector<uint8_t>& data)
+        {
+            std::vector<uint8_t> chunk;
+            append_be32(chunk, uint32_t(data.size()));
+            chunk.insert(chunk.end(), type, type + 4);
+            chunk.insert(chunk.end(), data.begin(), data.end());
+
+            // The CRC covers the chunk type and data, not the length
+            append_be32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+            out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+        }
+};
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "aabb.h"
+#include "primitive.h"
+#include "transform.h"
+
+/// <summary>
+/// A placed copy of an object (usually a BVH over a mesh, the bottom level of a two-level acceleration structure).
+/// Any number of instances can share one object, so memory grows with the unique geometry instead of with the number of copies.
+/// Rays are transformed into the space of the object, and the hit is transformed back. An acceleration structure built
+/// over the instances (the top level) only sees their world space boxes.
+/// </summary>
+class Instance : public Primitive
+{
+    public:
+        /// <summary>
+        /// Places an object in the world.
+        /// </summary>
+        /// <param name="object">= The object, in its own (object) space.</param>
+        /// <param name="object_to_world">= The transformation from object space to world space.</param>
+        /// <param name="material">= Material used for every hit on this instance, or nullptr to keep the materials of the object.</param>
+        Instance(shared_ptr<Primitive> object, const Transform& object_to_world, shared_ptr<Material> material = nullptr)
+            : object(object), object_to_world(object_to_world), world_to_object(object_to_world.inverse()),
+              material(material ? MaterialTable::add(material) : no_material)
+        {
+            box = object_to_world.box(object->hitBox());
+        }
+
+        aabb hitBox() const override { return box; }
+
+        bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
+        {
+            // The direction is not normalized, so distances along the ray are the same in both spaces
+            Ray local(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+            if (!object->hit(local, ray_t, rec))
+                return false;
+
+            // The surface is reconstructed through the instance, which transforms it back (one level of instancing)
+            rec.instance = this;
+            if (material != no_material)
+                rec.material = material;
+
+            return true;
+        }
+
+        void surface(const Ray& r, const Hit_record& rec, Surface& s) const override
+        {
+            Ray local(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+            rec.primitive->surface(local, rec, s);
+
+            // The side of the surface does not change under the transformation, so only the normal itself has to be transformed
+            s.p = r.at(rec.t);
+            s.normal = unit_vector(world_to_object.transposed_vector(s.normal));
+        }
+
+        const shared_ptr<Primitive>& instanced_object() const { return object; }
+
+    private:
+        shared_ptr<Primitive> object;
+        Transform object_to_world;
+        Transform world_to_object;
+        uint32_t material;      // Index in the MaterialTable, or no_material to keep the materials of the object
+        aabb box;
+
+        static constexpr uint32_t no_material = ~0u;
+};
+
+#endif
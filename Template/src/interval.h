@@ -3,6 +3,8 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
+#include <cmath>
+
 class Interval {
 public:
     double min, max;
@@ -3,64 +3,162 @@
 
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <string>
 #include <limits>
 #include "primitive.h"
 #include "aabb.h"
-#include "world.h"
+#include "sahbvh.h"
+#include "leafprimitives.h"
+#include "trianglemesh.h"
 
-class KdNode
+// A node of a kd-tree in 8 bytes. The left child of an interior node is the next node in the array, so only the right child is stored.
+struct KdNode
 {
-	public:
-		std::vector<shared_ptr<Primitive>> primitives;
-		aabb boundingbox;
-		KdNode* parent;
-		KdNode* left;
-		KdNode* right;
-		bool isLeaf = false;
-
-		KdNode() {}
+	union
+	{
+		float split;		// Interior node: position of the split plane
+		uint32_t offset;	// Leaf: position of its first primitive in the leaf index array
+	};
+	uint32_t bits;			// Lowest 2 bits: the split axis, or 3 for a leaf. Other bits: the index of the right child, or the number of primitives in a leaf
+
+	static KdNode interior(int axis, float split)
+	{
+		KdNode node;
+		node.split = split;
+		node.bits = uint32_t(axis);
+		return node;
+	}
+
+	static KdNode leaf(uint32_t offset, uint32_t count)
+	{
+		KdNode node;
+		node.offset = offset;
+		node.bits = (count << 2) | 3;
+		return node;
+	}
+
+	void setRightChild(uint32_t index) { bits = (bits & 3) | (index << 2); }
+
+	bool isLeaf() const { return (bits & 3) == 3; }
+	int axis() const { return bits & 3; }
+	uint32_t rightChild() const { return bits >> 2; }
+	uint32_t count() const { return bits >> 2; }
+};
 
-		KdNode(std::vector<shared_ptr<Primitive>> p, aabb box, KdNode* parent) { primitives = p; boundingbox = box; this->parent = parent; }
+// Statistics of a kd-tree, to judge the quality of a build
+struct KdTreeStats
+{
+	size_t node_count = 0;
+	size_t leaf_count = 0;
+	size_t empty_leaf_count = 0;
+	size_t primitive_refs = 0;	// Sum of the primitive counts of all leaves
+	size_t num_primitives = 0;	// Number of distinct primitives in the scene
+	int max_depth = 0;
+	double sah_cost = 0;
+	size_t bytes = 0;			// Memory used by the nodes and the leaf index array
+
+	void print(const std::string& name) const
+	{
+		size_t filled = leaf_count - empty_leaf_count;
+		std::cout << name << ": SAH cost " << sah_cost << ", " << node_count << " nodes, " << leaf_count << " leaves (" << empty_leaf_count << " empty), depth " << max_depth << "\n";
+		std::cout << "  Primitives per non-empty leaf: " << (filled > 0 ? double(primitive_refs) / filled : 0)
+			<< ", duplication factor: " << (num_primitives > 0 ? double(primitive_refs) / num_primitives : 0)
+			<< ", " << bytes / 1024 << " KiB\n";
+	}
 };
 
-class KdTree
+class KdTree : public Primitive
 {
 	public:
+		// The traversal stack holds at most one entry per level
+		static constexpr int maxStackDepth = 64;
+
 		int maxDepth = 60;
-		int minLeafSize = 4;
-		std::vector<shared_ptr<Primitive>> primitives;
+		double traversalCost = 1.0;		// Cost of visiting an interior node
+		double intersectionCost = 1.5;	// Cost of intersecting a primitive
+		double emptyBonus = 0.2;		// Part of the cost that is saved when a split cuts off empty space
+		LeafPrimitives primitives;
+
+		// The whole tree lives in two arrays owned by the tree: the nodes in depth-first order, and the primitive indices of the leaves
+		std::vector<KdNode> nodes;
+		std::vector<uint32_t> leafIndices;
+		aabb bounds;
 
 		KdTree() { }
 
 		/// <summary>
-		/// Builds a kd-tree of the scene
+		/// Builds a kd-tree of the scene with the surface area heuristic (Wald and Havran, "On building fast kd-trees for ray tracing,
+		/// and on doing that in O(N log N)"). The bounds of every primitive are turned into start, end and planar events per axis and sorted once;
+		/// every node sweeps its sorted events to find the cheapest split plane and hands both children their part of the events, still sorted.
+		/// Primitives that straddle the split plane are clipped to each child, so they only cover the part of the child they really overlap.
+		/// A node becomes a leaf when no split is cheaper than intersecting all its primitives.
 		/// </summary>
 		/// <param name="objects"> = the objects in the scene</param>
-		/// <returns>A KdNode*, which is the root of the kd-tree</returns>
-		KdNode* buildTree(std::vector<shared_ptr<Primitive>> objects)
+		void buildTree(std::vector<shared_ptr<Primitive>> objects)
 		{
-			// Create root node of the entire tree
-			KdNode* root = new KdNode();
-			root->primitives = objects;
+			primitives.build(objects);
+			nodes.clear();
+			leafIndices.clear();
 
-			std::vector<double> bounds = getBounds(objects);
+			if (objects.empty())
+			{
+				bounds = aabb();
+				return;
+			}
 
-			aabb scene = aabb(
-				Interval(bounds[0], bounds[1]),
-				Interval(bounds[2], bounds[3]),
-				Interval(bounds[4], bounds[5]));
+			std::vector<double> b = getBounds(objects);
+			BuildBox voxel = toFloatBox(toBuildBox(aabb(Interval(b[0], b[1]), Interval(b[2], b[3]), Interval(b[4], b[5]))));
+			bounds = aabb(Interval(voxel.min[0], voxel.max[0]), Interval(voxel.min[1], voxel.max[1]), Interval(voxel.min[2], voxel.max[2]));
 
-			//std::cout << scene.x.min << " " << scee.x.max << "\n";
-			//std::cout << scene.y.min << " " << scee.y.max << "\n";
-			//std::cout << scene.z.min << " " << scee.z.max << "\n";
+			prepareBuild(objects);
 
-			//double num = 2;
-			//aabb scene = aabb(Interval(-num, num), Interval(-num, num), Interval(-num, num));
-			root->boundingbox = scene;
+			std::vector<KdEvent> events;
+			events.reserve(6 * objects.size());
+			for (uint32_t i = 0; i < objects.size(); i++)
+				addEvents(i, clip(i, voxel), events);
+			std::sort(events.begin(), events.end());
 
-			return buildTreeRec(root, 0);
+			// Depth limit from Wald and Havran: deep enough for any useful split, but bounded for degenerate input
+			int depth_limit = std::min({ maxDepth, maxStackDepth, int(8 + 1.3 * std::log2(double(objects.size()))) });
+			buildNode(events, objects.size(), voxel, 0, depth_limit);
+
+			nodes.shrink_to_fit();
+			leafIndices.shrink_to_fit();
+			std::vector<std::array<Point3, 3>>().swap(triangles);
+			std::vector<bool>().swap(isTriangle);
+			std::vector<uint8_t>().swap(side);
+		}
+
+		aabb hitBox() const override { return bounds; }
+
+		bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
+		{
+			return traverseTree(r, ray_t, rec);
 		}
 
+		/// <summary>
+		/// Computes the statistics of the tree.
+		/// </summary>
+		KdTreeStats stats() const
+		{
+			KdTreeStats s;
+			s.num_primitives = primitives.size();
+			s.bytes = nodeBytes();
+			if (!nodes.empty())
+			{
+				BuildBox voxel = toBuildBox(bounds);
+				collectStats(0, voxel, 0, voxel.surface_area(), s);
+			}
+			return s;
+		}
+
+		/// <summary>
+		/// Gets the memory used by the nodes, the leaf index array and the leaf primitives, in bytes.
+		/// </summary>
+		size_t nodeBytes() const { return nodes.size() * sizeof(KdNode) + leafIndices.size() * sizeof(uint32_t) + primitives.memory_bytes(); }
+
 		/// <summary>
 		/// Gets max bounds of the scene, based on all objects in the scene
 		/// </summary>
@@ -145,220 +243,444 @@ class KdTree
 		}
 
 		/// <summary>
-		/// Recursively builds the kd-tree based on some root node and a current depth
+		/// Finds the closest hit of a ray with the primitives in a kd-tree. The ray is clipped to the bounds of the tree, and every
+		/// interior node splits the current [tmin, tmax] range of the ray at the split plane: the near child is visited first and the far
+		/// child waits on a fixed-size stack. Leaves are visited front to back, so the traversal stops at the first leaf that contains a hit
+		/// in its part of the ray; a hit further along the ray (the primitive sticks out of the leaf) is kept until its own leaf is reached.
 		/// </summary>
-		/// <param name="root"> = the root node of the tree</param>
-		/// <param name="depth"> = the current depth of the tree</param>
-		/// <returns></returns>
-		KdNode* buildTreeRec(KdNode* root, int depth)
+		/// <param name="ray"> = The ray that is being traced</param>
+		/// <param name="ray_t"> = The interval of distances where a hit is valid</param>
+		/// <param name="rec"> = The hit record of the ray, which also counts the visited nodes and intersection tests</param>
+		/// <returns>true if the ray hits a primitive</returns>
+		bool traverseTree(const Ray& ray, Interval ray_t, Hit_record& rec) const
 		{
-			aabb currentspace = root->boundingbox;
+			if (nodes.empty())
+				return false;
 
-			// Make root node a leaf if we reach max depth of the tree
-			// It can also be a leaf if the box contains no primitives
-			// It can also be a leaf if the box contains a minimum number of primitives
-			if ((depth >= maxDepth || root->primitives.size() <= minLeafSize) || root->primitives.size() == 0)
+			const double origin[3] = { ray.origin().x(), ray.origin().y(), ray.origin().z() };
+			const double direction[3] = { ray.direction().x(), ray.direction().y(), ray.direction().z() };
+			const double inv_dir[3] = { 1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2] };
+
+			// Clip the ray to the bounds of the tree
+			double tmin = ray_t.min, tmax = ray_t.max;
+			for (int a = 0; a < 3; a++)
 			{
-				root->isLeaf = true;
-				return root;
+				const Interval& slab = bounds.axis_interval(a);
+				double t0 = (slab.min - origin[a]) * inv_dir[a];
+				double t1 = (slab.max - origin[a]) * inv_dir[a];
+				if (inv_dir[a] < 0)
+					std::swap(t0, t1);
+				tmin = std::max(tmin, t0);
+				tmax = std::min(tmax, t1);
 			}
+			if (!(tmin <= tmax))
+				return false;
 
-			// Divide space --> not done with SAH currently, just midway point
-			// This can also be done with SAH, which could improve performance even more
+			struct StackEntry
+			{
+				uint32_t node;
+				double tmin;
+				double tmax;
+			};
+			StackEntry stack[maxStackDepth];
+			int stack_size = 0;
+
+			uint32_t current = 0;
+			TraceStats& stats = trace_stats();
+			bool hit_anything = false;
+			double closest = ray_t.max;
+			const LeafPrimitives::RayData packedRay = LeafPrimitives::ray_data(ray);
+
+			while (true)
+			{
+				stats.traversal_steps++;
+				const KdNode& node = nodes[current];
 
-			// 1. Get axis along which we should split
-			// Currently, we just switch between the three different axes, starting with the x-axis
-			int axis = depth % 3;
-			//int axis = getLongestAxis(currentspace);
+				if (!node.isLeaf())
+				{
+					int axis = node.axis();
+					double split = node.split;
+					double t_split = (split - origin[axis]) * inv_dir[axis];
+
+					// The near child contains the origin side of the split plane; a ray on the plane goes by its direction
+					bool left_first = origin[axis] < split || (origin[axis] == split && direction[axis] <= 0);
+					uint32_t near_child = left_first ? current + 1 : node.rightChild();
+					uint32_t far_child = left_first ? node.rightChild() : current + 1;
+
+					// A ray parallel to the plane gets an infinite (or, on the plane, NaN) distance and only visits the near child
+					if (!(t_split <= tmax) || t_split <= 0)
+						current = near_child;
+					else if (t_split < tmin)
+						current = far_child;
+					else
+					{
+						stack[stack_size++] = { far_child, t_split, tmax };
+						current = near_child;
+						tmax = t_split;
+					}
+					continue;
+				}
 
-			// 2. Then, create two new (child) bounding boxes
-			// We also get the primitives that overlap into these new bounding boxes, and give them to our children
-			auto [leftnode, rightnode] = currentspace.split(axis);
-			//auto [leftnode, rightnode] = split_median(currentspace, root->primitives, axis);
-			KdNode* left = new KdNode(splitPrimitives(root->primitives, leftnode), leftnode, root);
-			KdNode* right = new KdNode(splitPrimitives(root->primitives, rightnode), rightnode, root);
+				hit_anything |= primitives.hit_indices(leafIndices.data() + node.offset, node.count(), packedRay, ray, ray_t.min, closest, rec);
 
-			// 3. Call buildTreeRec on both child nodes and increase depth
-			// We assign the results of the recursion to the left and right nodes of the root
-			root->left = buildTreeRec(left, depth + 1);
-			root->right = buildTreeRec(right, depth + 1);
+				// Every leaf after this one starts after the closest hit
+				if (hit_anything && closest <= tmax)
+					break;
 
-			root->primitives.clear();
-			root->primitives.shrink_to_fit();
+				if (stack_size == 0)
+					break;
+
+				stack_size--;
+				current = stack[stack_size].node;
+				tmin = stack[stack_size].tmin;
+				tmax = stack[stack_size].tmax;
+			}
 
-			// 4. Return values is the original root, now assigned with children
-			// This one node contains the entire tree, which can be traversed through recursively
-			return root;
+			return hit_anything;
 		}
 
-		int getLongestAxis(aabb box)
+	private:
+		enum KdEventType : uint8_t { EVENT_END = 0, EVENT_PLANAR = 1, EVENT_START = 2 };
+		enum KdSide : uint8_t { SIDE_BOTH = 0, SIDE_LEFT = 1, SIDE_RIGHT = 2 };
+
+		// A candidate split plane: where the (clipped) bounds of a primitive start or end along an axis, or where a flat primitive lies
+		struct KdEvent
 		{
-			auto x = box.x.size();
-			auto y = box.y.size();
-			auto z = box.z.size();
+			double pos;
+			uint32_t prim;
+			uint8_t axis;
+			uint8_t type;
 
-			int min = std::max({x, y, z});
+			// Sorted by position; at the same position, ends come before planar events, which come before starts
+			bool operator<(const KdEvent& e) const
+			{
+				if (pos != e.pos) return pos < e.pos;
+				if (axis != e.axis) return axis < e.axis;
+				return type < e.type;
+			}
+		};
 
-			if (min == x) return 0;
-			if (min == y) return 1;
-			return 2;
-		}
+		// Build state: the corners of the triangles (for clipping) and the side of the split plane each primitive goes to
+		std::vector<std::array<Point3, 3>> triangles;
+		std::vector<bool> isTriangle;
+		std::vector<uint8_t> side;
 
-		/// <summary>
-		/// Assigns primitives of the parent node to the child node if the primitive is within the AABB of the child
-		/// </summary>
-		/// <param name="objs"> = the primitives that (partly) reside within the AABB of the parent node</param>
-		/// <param name="box"> = the AABB of the child node</param>
-		/// <returns>A list of primitives that (partly) reside within the AABB of the child node</returns>
-		std::vector<shared_ptr<Primitive>> splitPrimitives(const std::vector<shared_ptr<Primitive>>& objs, aabb box)
+		static BuildBox toBuildBox(const aabb& box)
 		{
-			std::vector<shared_ptr<Primitive>> res;
-			for (auto obj : objs)
+			BuildBox b;
+			for (int a = 0; a < 3; a++)
 			{
-				auto p = obj.get();
-				if (p->hitBox().boxes_overlap(box))
-					res.push_back(obj);
+				b.min[a] = box.axis_interval(a).min;
+				b.max[a] = box.axis_interval(a).max;
 			}
+			return b;
+		}
 
-			return res;
+		static bool isEmpty(const BuildBox& b)
+		{
+			return b.min[0] > b.max[0] || b.min[1] > b.max[1] || b.min[2] > b.max[2];
 		}
 
-		/// <summary>
-		/// Traverses the ray through a kd-tree
-		/// </summary>
-		/// <param name="ray"> = The ray that is traversing through the tree</param>
-		/// <param name="tree"> = The tree that is being traversed through; the root node of the tree should be given here</param>
-		/// <returns>A World, containing all primitives that the ray might intersect with</returns>
-		World traverseTree(Ray& ray, KdNode* tree, Hit_record& rec)
+		void prepareBuild(const std::vector<shared_ptr<Primitive>>& objects)
 		{
-			// Check if we hit the bounding box of the current node of the tree
-			auto [hit, entry, exit] = tree->boundingbox.boxRayIntersection(ray, Interval(0.001, INFINITY));
-			//auto hit = tree->boundingbox.hit(ray, Interval(0.001, infinity));
+			triangles.assign(objects.size(), {});
+			isTriangle.assign(objects.size(), false);
+			side.assign(objects.size(), SIDE_BOTH);
 
-			// No hit with the bounding box, so no primitives to check within the box / subtree
-			if (!hit)
-				return World();
+			for (size_t i = 0; i < objects.size(); i++)
+				isTriangle[i] = triangle_corners(*objects[i], triangles[i]);
+		}
 
-			KdNode* leaf = findLeaf(entry, tree);
+		/// <summary>
+		/// Gets the bounds of the part of a primitive inside a voxel. Triangles are clipped against the six planes of the voxel
+		/// (Sutherland-Hodgman), other primitives use the overlap of their bounding box with the voxel.
+		/// </summary>
+		/// <returns>The bounds, or an empty box if the primitive does not overlap the voxel.</returns>
+		BuildBox clip(uint32_t prim, const BuildBox& voxel) const
+		{
+			BuildBox result;
+			if (isTriangle[prim])
+			{
+				// Clipping against 6 planes adds at most one vertex per plane
+				double polygon[9][3], clipped[9][3];
+				int count = 3;
+				for (int v = 0; v < 3; v++)
+					for (int a = 0; a < 3; a++)
+						polygon[v][a] = triangles[prim][v][a];
+
+				for (int plane = 0; plane < 6 && count > 0; plane++)
+				{
+					int axis = plane % 3;
+					bool is_max = plane >= 3;
+					double bound = is_max ? voxel.max[axis] : voxel.min[axis];
 
-			// We do not find the leaf, so we return an empty list
-			if (leaf == nullptr)
-				return World();
+					// Distance inside the plane; points on the plane are kept
+					auto inside = [&](const double* p) { return is_max ? bound - p[axis] : p[axis] - bound; };
 
-			rec.traversal_steps += 1;
+					int clipped_count = 0;
+					for (int v = 0; v < count; v++)
+					{
+						const double* current = polygon[v];
+						const double* next = polygon[(v + 1) % count];
+						double d0 = inside(current), d1 = inside(next);
+
+						if (d0 >= 0)
+						{
+							for (int a = 0; a < 3; a++) clipped[clipped_count][a] = current[a];
+							clipped_count++;
+						}
+						if ((d0 >= 0) != (d1 >= 0))
+						{
+							double t = d0 / (d0 - d1);
+							for (int a = 0; a < 3; a++) clipped[clipped_count][a] = current[a] + t * (next[a] - current[a]);
+							clipped[clipped_count][axis] = bound;
+							clipped_count++;
+						}
+					}
 
-			auto primitives = leaf->primitives;
-			World world = World();
+					count = clipped_count;
+					for (int v = 0; v < count; v++)
+						for (int a = 0; a < 3; a++)
+							polygon[v][a] = clipped[v][a];
+				}
 
-			int closest_distance = 9999999;
-			std::shared_ptr<Primitive> closest_primitive;
-			Point3 intersection;
+				for (int v = 0; v < count; v++)
+					result.grow(polygon[v]);
+			}
+			else
+				result = toBuildBox(primitives[prim]->hitBox());
 
-			// For each primitive in the leaf, check if there is an intersection with the ray
-			for (const std::shared_ptr<Primitive> p : primitives)
+			// Also guards the clipped polygon against rounding just outside the voxel
+			for (int a = 0; a < 3; a++)
 			{
-				rec.intersection_tests += 1;
-				Hit_record h;
-				if (p.get()->hit(ray, Interval(0.001, infinity), h))
-				{
-					world.objects.push_back(p);
+				result.min[a] = std::max(result.min[a], voxel.min[a]);
+				result.max[a] = std::min(result.max[a], voxel.max[a]);
+			}
+			return result;
+		}
 
-					auto intersection_point = h.p;
-					Vec3 v = intersection_point - ray.origin();
-					float t = dot(v, ray.direction());
-					t = max(t, 0.0f);
-					Point3 e = ray.origin() + ray.direction() * t;
+		/// <summary>
+		/// Rounds a box outwards to float precision. The nodes store their split planes as floats, so every event, and with that every
+		/// candidate plane, is made a float; a split is then stored exactly and the children are built for the plane that is traversed.
+		/// </summary>
+		static BuildBox toFloatBox(const BuildBox& box)
+		{
+			BuildBox result;
+			for (int a = 0; a < 3; a++)
+			{
+				float lo = float(box.min[a]), hi = float(box.max[a]);
+				if (lo > box.min[a]) lo = std::nextafter(lo, -INFINITY);
+				if (hi < box.max[a]) hi = std::nextafter(hi, INFINITY);
+				result.min[a] = lo;
+				result.max[a] = hi;
+			}
+			return result;
+		}
 
-					float side1 = std::pow(e[0] - intersection_point[0], 2);
-					float side2 = std::pow(e[1] - intersection_point[1], 2);
-					float side3 = std::pow(e[2] - intersection_point[2], 2);
+		static void addEvents(uint32_t prim, const BuildBox& clipped, std::vector<KdEvent>& events)
+		{
+			if (isEmpty(clipped))
+				return;
 
-					float dist = std::sqrt(side1 + side2 + side3);
+			BuildBox box = toFloatBox(clipped);
 
-					if (dist < closest_distance)
-					{
-						closest_distance = dist;
-						closest_primitive = p;
-						intersection = intersection_point;
-					}
+			for (uint8_t a = 0; a < 3; a++)
+			{
+				if (box.min[a] == box.max[a])
+					events.push_back({ box.min[a], prim, a, EVENT_PLANAR });
+				else
+				{
+					events.push_back({ box.min[a], prim, a, EVENT_START });
+					events.push_back({ box.max[a], prim, a, EVENT_END });
 				}
 			}
+		}
 
-			// Intersections within the leaf have been found, we can stop traversing
-			if (world.objects.size() > 0)
+		// Every primitive has exactly one start or planar event on the x-axis, which makes it easy to visit each primitive once
+		static bool isFirstEvent(const KdEvent& e) { return e.axis == 0 && e.type != EVENT_END; }
+
+		/// <summary>
+		/// Gets the cost of a split, with the planar primitives on the cheapest side.
+		/// </summary>
+		/// <returns>The cost and whether the planar primitives go to the left.</returns>
+		std::pair<double, bool> splitCost(const BuildBox& voxel, int axis, double pos, size_t nl, size_t nr, size_t np) const
+		{
+			BuildBox left = voxel, right = voxel;
+			left.max[axis] = pos;
+			right.min[axis] = pos;
+
+			double area = voxel.surface_area();
+			double pl = left.surface_area() / area;
+			double pr = right.surface_area() / area;
+
+			auto cost = [&](size_t l, size_t r)
 			{
-				if (leaf->boundingbox.contains(intersection))
-					return World({ closest_primitive });
-			}
+				double c = traversalCost + intersectionCost * (pl * l + pr * r);
+				return (l == 0 || r == 0) ? (1 - emptyBonus) * c : c;
+			};
 
-			// Otherwise, if no intersections are found, we traverse the ray through the tree until we hit the next box
-			Ray ray_new = Ray(exit + ray.direction() * 0.001, ray.direction());
-			return traverseTree(ray_new, tree, rec);
+			double cost_left = cost(nl + np, nr);
+			double cost_right = cost(nl, nr + np);
+			return cost_left <= cost_right ? std::make_pair(cost_left, true) : std::make_pair(cost_right, false);
 		}
 
 		/// <summary>
-		/// Finds the leaf in the kd-tree that contains a certain point
+		/// Builds a node from its sorted events: finds the cheapest split plane with one sweep over the events, and either splits or makes a leaf.
 		/// </summary>
-		/// <param name="point"> = the point that is located somewhere in the kd-tree</param>
-		/// <param name="tree"> = the root node of the kd-tree</param>
-		/// <returns>The leaf node that contains the point. Returns a nullptr if none of the leaves contain the point</returns>
-		KdNode* findLeaf(Point3 point, KdNode* tree)
+		void buildNode(std::vector<KdEvent>& events, size_t count, const BuildBox& voxel, int depth, int depth_limit)
 		{
-			// Tree does not exist or the entire (sub)tree does not contain the point, so we can stop searching
-			if (!tree || !tree->boundingbox.contains(point))
-				return nullptr;
+			double best_cost = INFINITY;
+			int best_axis = -1;
+			double best_pos = 0;
+			bool best_planar_left = true;
+
+			if (depth < depth_limit && count > 0 && voxel.surface_area() > 0)
+			{
+				// Number of primitives left of, on and right of the current plane, per axis
+				size_t nl[3] = { 0, 0, 0 }, np[3] = { 0, 0, 0 }, nr[3] = { count, count, count };
+
+				for (size_t i = 0; i < events.size();)
+				{
+					double pos = events[i].pos;
+					int axis = events[i].axis;
+
+					size_t ending = 0, planar = 0, starting = 0;
+					while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == EVENT_END) { ending++; i++; }
+					while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == EVENT_PLANAR) { planar++; i++; }
+					while (i < events.size() && events[i].axis == axis && events[i].pos == pos && events[i].type == EVENT_START) { starting++; i++; }
 
-			// If we are a leaf, then the point is in the leaf, so we return it
-			if (tree->isLeaf && tree->boundingbox.contains(point))
-				return tree;
+					np[axis] = planar;
+					nr[axis] -= planar + ending;
 
-			// If the left child node of the current node contains the point, we check this subtree
-			if (tree->left->boundingbox.contains(point))
+					// Planes on the border of the voxel do not split anything
+					if (pos > voxel.min[axis] && pos < voxel.max[axis])
+					{
+						auto [cost, planar_left] = splitCost(voxel, axis, pos, nl[axis], nr[axis], np[axis]);
+						if (cost < best_cost)
+						{
+							best_cost = cost;
+							best_axis = axis;
+							best_pos = pos;
+							best_planar_left = planar_left;
+						}
+					}
+
+					nl[axis] += starting + planar;
+					np[axis] = 0;
+				}
+			}
+
+			// Automatic termination: make a leaf when splitting is not cheaper than intersecting everything
+			if (best_axis < 0 || best_cost > intersectionCost * count)
 			{
-				KdNode* res = findLeaf(point, tree->left);
-				if (res) return res;
+				nodes.push_back(KdNode::leaf(uint32_t(leafIndices.size()), uint32_t(count)));
+				for (const KdEvent& e : events)
+					if (isFirstEvent(e))
+						leafIndices.push_back(e.prim);
+				return;
 			}
 
-			// If the right child node of the current node contains the point, we check this subtree
-			if (tree->right->boundingbox.contains(point))
+			// Classify the primitives: left only, right only, or both sides
+			for (const KdEvent& e : events)
+				side[e.prim] = SIDE_BOTH;
+
+			for (const KdEvent& e : events)
 			{
-				KdNode* res = findLeaf(point, tree->right);
-				if (res) return res;
+				if (e.axis != best_axis)
+					continue;
+
+				if (e.type == EVENT_END && e.pos <= best_pos)
+					side[e.prim] = SIDE_LEFT;
+				else if (e.type == EVENT_START && e.pos >= best_pos)
+					side[e.prim] = SIDE_RIGHT;
+				else if (e.type == EVENT_PLANAR)
+				{
+					if (e.pos < best_pos || (e.pos == best_pos && best_planar_left))
+						side[e.prim] = SIDE_LEFT;
+					else
+						side[e.prim] = SIDE_RIGHT;
+				}
 			}
 
-			return nullptr;
-		}
+			BuildBox left_voxel = voxel, right_voxel = voxel;
+			left_voxel.max[best_axis] = best_pos;
+			right_voxel.min[best_axis] = best_pos;
 
-		/// <summary>
-		/// Gets the number of leaves in the tree.
-		/// </summary>
-		/// <param name="node"></param>
-		/// <returns></returns>
-		int numLeaves(KdNode* node)
-		{
-			if (node->isLeaf)
+			// The events of primitives on one side stay sorted; straddling primitives are clipped to each side, and only their new events are sorted
+			std::vector<KdEvent> left_only, right_only, left_clipped, right_clipped;
+			size_t left_count = 0, right_count = 0;
+			for (const KdEvent& e : events)
 			{
-				if (node->primitives.size() > 0)
-					std::cout << "Node is a leaf - number of primitives: " << node->primitives.size() << "\n";
-				return 1;
+				if (side[e.prim] == SIDE_LEFT)
+				{
+					left_only.push_back(e);
+					left_count += isFirstEvent(e);
+				}
+				else if (side[e.prim] == SIDE_RIGHT)
+				{
+					right_only.push_back(e);
+					right_count += isFirstEvent(e);
+				}
+				else if (isFirstEvent(e))
+				{
+					size_t before = left_clipped.size();
+					addEvents(e.prim, clip(e.prim, left_voxel), left_clipped);
+					left_count += left_clipped.size() > before;
+
+					before = right_clipped.size();
+					addEvents(e.prim, clip(e.prim, right_voxel), right_clipped);
+					right_count += right_clipped.size() > before;
+				}
 			}
 
-			//std::cout << "Node is not a leaf - number of primitives: " << node->primitives.size() << "\n";
+			std::vector<KdEvent>().swap(events);
+
+			std::sort(left_clipped.begin(), left_clipped.end());
+			std::sort(right_clipped.begin(), right_clipped.end());
+
+			std::vector<KdEvent> left_events(left_only.size() + left_clipped.size());
+			std::merge(left_only.begin(), left_only.end(), left_clipped.begin(), left_clipped.end(), left_events.begin());
+			std::vector<KdEvent>().swap(left_only);
+			std::vector<KdEvent>().swap(left_clipped);
 
-			return numLeaves(node->left) + numLeaves(node->right);
+			std::vector<KdEvent> right_events(right_only.size() + right_clipped.size());
+			std::merge(right_only.begin(), right_only.end(), right_clipped.begin(), right_clipped.end(), right_events.begin());
+			std::vector<KdEvent>().swap(right_only);
+			std::vector<KdEvent>().swap(right_clipped);
+
+			size_t index = nodes.size();
+			nodes.push_back(KdNode::interior(best_axis, float(best_pos))); // Exact: every event position is a float
+
+			buildNode(left_events, left_count, left_voxel, depth + 1, depth_limit);
+			std::vector<KdEvent>().swap(left_events);
+			nodes[index].setRightChild(uint32_t(nodes.size()));
+			buildNode(right_events, right_count, right_voxel, depth + 1, depth_limit);
 		}
 
-		/// <summary>
-		/// Gets the number of primitives in the tree
-		/// </summary>
-		/// <param name="node"></param>
-		/// <returns></returns>
-		int numPrims(KdNode* node)
+		void collectStats(uint32_t index, const BuildBox& voxel, int depth, double root_area, KdTreeStats& s) const
 		{
-			if (node->isLeaf)
-				return node->primitives.size();
+			const KdNode& node = nodes[index];
+			s.node_count++;
+			s.max_depth = std::max(s.max_depth, depth);
+
+			double relative_area = root_area > 0 ? voxel.surface_area() / root_area : 1;
+
+			if (node.isLeaf())
+			{
+				s.leaf_count++;
+				s.empty_leaf_count += node.count() == 0;
+				s.primitive_refs += node.count();
+				s.sah_cost += intersectionCost * node.count() * relative_area;
+				return;
+			}
+
+			BuildBox left = voxel, right = voxel;
+			left.max[node.axis()] = node.split;
+			right.min[node.axis()] = node.split;
 
-			return numPrims(node->left) + numPrims(node->right);
+			s.sah_cost += traversalCost * relative_area;
+			collectStats(index + 1, left, depth + 1, root_area, s);
+			collectStats(node.rightChild(), right, depth + 1, root_area, s);
 		}
 };
 
@@ -0,0 +1,492 @@
+#pragma once
+
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "flatbvh.h"
+#include "primitive.h"
+#include "sahbvh.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Parameters of the linear BVH builder
+struct LBVHSettings
+{
+    int max_leaf_size = 4;   // Subtrees with at most this many primitives become one leaf
+    int rotation_passes = 1; // Number of tree rotation passes after the build; 0 keeps the plain Morton tree
+};
+
+/// <summary>
+/// Counts the leading zero bits of a number that is not 0.
+/// </summary>
+inline int count_leading_zeros(uint64_t v)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return 63 - int(index);
+#else
+    return __builtin_clzll(v);
+#endif
+}
+
+/// <summary>
+/// Spreads the lowest 21 bits of a number out so there are two zero bits between every bit.
+/// </summary>
+inline uint64_t expand_bits_21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffull;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+/// <summary>
+/// Gets the 63-bit Morton code (bits of x, y and z interleaved) of a point with 21-bit integer coordinates.
+/// </summary>
+inline uint64_t morton_code_63(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (expand_bits_21(x) << 2) | (expand_bits_21(y) << 1) | expand_bits_21(z);
+}
+
+/// <summary>
+/// Builds a BVH in linear time from the Morton codes of the primitive centroids (Lauterbach et al., "Fast BVH construction on GPUs").
+/// Sorted along the Morton curve, the primitives of every subtree of the radix tree over the codes form a contiguous range, and the tree
+/// itself is the Cartesian tree of the common prefix lengths of neighbouring codes, which a single stack pass builds.
+/// Much faster to build than the SAH builder, but the tree is worse; a few passes of tree rotations (Kensler, "Tree rotations
+/// for improving bounding volume hierarchies") win part of the quality back.
+/// </summary>
+class LBVHBuilder
+{
+    public:
+        LBVHSettings settings;
+
+        LBVHBuilder(LBVHSettings settings = LBVHSettings()) : settings(settings) {}
+
+        /// <summary>
+        /// Builds the BVH over a list of primitives.
+        /// </summary>
+        /// <param name="objects">= The primitives; the list itself is not modified.</param>
+        /// <returns>The BVH, with its own reordered copy of the primitive list.</returns>
+        FlatBVH build(const std::vector<shared_ptr<Primitive>>& objects)
+        {
+            settings.max_leaf_size = std::clamp(settings.max_leaf_size, 1, 65535);
+
+            size_t n = objects.size();
+            if (n == 0)
+                return FlatBVH();
+
+            compute_codes(objects);
+            radix_sort();
+
+            std::vector<shared_ptr<Primitive>> sorted(n);
+            for (size_t i = 0; i < n; i++)
+                sorted[i] = objects[keys[i].index];
+
+            std::vector<FlatBVHNode> flat;
+            std::vector<shared_ptr<Primitive>> ordered;
+            flat.reserve(2 * n);
+            ordered.reserve(n);
+
+            if (n == 1)
+            {
+                flat.emplace_back();
+                flat[0].set_bounds(boxes[keys[0].index].min, boxes[keys[0].index].max);
+                flat[0].offset = 0;
+                flat[0].count = 1;
+                ordered = sorted;
+            }
+            else
+            {
+                build_hierarchy();
+                compute_bounds(root);
+                for (int pass = 0; pass < settings.rotation_passes; pass++)
+                    rotate(root);
+                emit(root, 0, flat, sorted, ordered);
+            }
+
+            keys.clear();
+            boxes.clear();
+            nodes.clear();
+
+            return FlatBVH(std::move(flat), std::move(ordered));
+        }
+
+    private:
+        // Marks a child reference as a primitive (index into the sorted keys) instead of an internal node
+        static constexpr uint32_t LEAF = 0x80000000u;
+
+        struct MortonKey
+        {
+            uint64_t code;
+            uint32_t index;
+        };
+
+        // Internal node of the radix tree; internal node i splits the sorted primitives between i and i + 1
+        struct Node
+        {
+            uint32_t child[2];
+            BuildBox box;
+            uint32_t count;
+        };
+
+        std::vector<MortonKey> keys;
+        std::vector<BuildBox> boxes;
+        std::vector<Node> nodes;
+        uint32_t root = 0;
+
+        void compute_codes(const std::vector<shared_ptr<Primitive>>& objects)
+        {
+            size_t n = objects.size();
+            boxes.resize(n);
+            keys.resize(n);
+
+            BuildBox centroid_bounds;
+            std::vector<double> centroids(3 * n);
+            for (size_t i = 0; i < n; i++)
+            {
+                aabb box = objects[i]->hitBox();
+                for (int a = 0; a < 3; a++)
+                {
+                    boxes[i].min[a] = box.axis_interval(a).min;
+                    boxes[i].max[a] = box.axis_interval(a).max;
+                    centroids[3 * i + a] = 0.5 * (boxes[i].min[a] + boxes[i].max[a]);
+                }
+                centroid_bounds.grow(&centroids[3 * i]);
+            }
+
+            // Quantize the centroids to a 2^21 grid over the centroid bounds
+            const double grid_max = double((1 << 21) - 1);
+            double scale[3];
+            for (int a = 0; a < 3; a++)
+            {
+                double extent = centroid_bounds.max[a] - centroid_bounds.min[a];
+                scale[a] = extent > 0 ? grid_max / extent : 0;
+            }
+
+            for (size_t i = 0; i < n; i++)
+            {
+                uint32_t q[3];
+                for (int a = 0; a < 3; a++)
+                    q[a] = uint32_t(std::clamp((centroids[3 * i + a] - centroid_bounds.min[a]) * scale[a], 0.0, grid_max));
+
+                keys[i] = { morton_code_63(q[0], q[1], q[2]), uint32_t(i) };
+            }
+        }
+
+        /// <summary>
+        /// Sorts the keys by Morton code with a least significant digit radix sort, 8 bits per pass.
+        /// The sort is stable, so equal codes stay in the order of the input.
+        /// </summary>
+        void radix_sort()
+        {
+            std::vector<MortonKey> temp(keys.size());
+
+            for (int shift = 0; shift < 64; shift += 8)
+            {
+                size_t histogram[256] = {};
+                for (const MortonKey& key : keys)
+                    histogram[(key.code >> shift) & 0xff]++;
+
+                // Skip the pass when all keys have the same digit
+                if (histogram[(keys[0].code >> shift) & 0xff] == keys.size())
+                    continue;
+
+                size_t offset = 0;
+                for (size_t& bucket : histogram)
+                {
+                    size_t size = bucket;
+                    bucket = offset;
+                    offset += size;
+                }
+
+                for (const MortonKey& key : keys)
+                    temp[histogram[(key.code >> shift) & 0xff]++] = key;
+                keys.swap(temp);
+            }
+        }
+
+        /// <summary>
+        /// Gets the length of the common prefix of the sorted keys i and i + 1. Equal codes are made unique by their position.
+        /// </summary>
+        int common_prefix(size_t i) const
+        {
+            uint64_t diff = keys[i].code ^ keys[i + 1].code;
+            if (diff != 0)
+                return count_leading_zeros(diff);
+
+            return 64 + count_leading_zeros(uint64_t(i) ^ uint64_t(i + 1));
+        }
+
+        /// <summary>
+        /// Builds the radix tree over the sorted keys. The root of every range is the position with the shortest common prefix,
+        /// which is unique, so the tree is the (minimum) Cartesian tree of the common prefix lengths.
+        /// </summary>
+        void build_hierarchy()
+        {
+            size_t num_internal = keys.size() - 1;
+            nodes.assign(num_internal, Node());
+
+            std::vector<int> prefix(num_internal);
+            for (size_t i = 0; i < num_internal; i++)
+                prefix[i] = common_prefix(i);
+
+            // Without an internal child, node i has the primitive i on its left and i + 1 on its right
+            for (size_t i = 0; i < num_internal; i++)
+            {
+                nodes[i].child[0] = uint32_t(i) | LEAF;
+                nodes[i].child[1] = uint32_t(i + 1) | LEAF;
+            }
+
+            std::vector<uint32_t> stack;
+            stack.reserve(128);
+            for (size_t i = 0; i < num_internal; i++)
+            {
+                uint32_t last = UINT32_MAX;
+                while (!stack.empty() && prefix[stack.back()] > prefix[i])
+                {
+                    last = stack.back();
+                    stack.pop_back();
+                }
+
+                if (last != UINT32_MAX)
+                    nodes[i].child[0] = last;
+                if (!stack.empty())
+                    nodes[stack.back()].child[1] = uint32_t(i);
+
+                stack.push_back(uint32_t(i));
+            }
+
+            root = stack.front();
+        }
+
+        const BuildBox& box_of(uint32_t child) const
+        {
+            return child & LEAF ? boxes[keys[child & ~LEAF].index] : nodes[child].box;
+        }
+
+        uint32_t count_of(uint32_t child) const
+        {
+            return child & LEAF ? 1 : nodes[child].count;
+        }
+
+        void update(uint32_t index)
+        {
+            Node& node = nodes[index];
+            node.box = box_of(node.child[0]);
+            node.box.grow(box_of(node.child[1]));
+            node.count = count_of(node.child[0]) + count_of(node.child[1]);
+        }
+
+        /// <summary>
+        /// Computes the bounds and primitive counts of the subtree of an internal node.
+        /// </summary>
+        void compute_bounds(uint32_t index)
+        {
+            for (uint32_t child : nodes[index].child)
+                if (!(child & LEAF))
+                    compute_bounds(child);
+
+            update(index);
+        }
+
+        static double union_area(const BuildBox& a, const BuildBox& b)
+        {
+            BuildBox u = a;
+            u.grow(b);
+            return u.surface_area();
+        }
+
+        /// <summary>
+        /// Does one bottom-up pass of tree rotations: a child of every node may swap places with a grandchild on the other side,
+        /// when that makes the box of the changed child smaller. The box of the node itself stays the same.
+        /// </summary>
+        void rotate(uint32_t index)
+        {
+            for (uint32_t child : nodes[index].child)
+                if (!(child & LEAF))
+                    rotate(child);
+
+            Node& node = nodes[index];
+            double best_area = INFINITY;
+            int best_side = -1, best_grandchild = -1;
+
+            for (int side = 0; side < 2; side++)
+            {
+                uint32_t inner = node.child[side];
+                if (inner & LEAF)
+                    continue;
+
+                // Swap the child on the other side with one of the children of the inner node
+                const Node& in = nodes[inner];
+                double area = in.box.surface_area();
+                for (int g = 0; g < 2; g++)
+                {
+                    double new_area = union_area(box_of(node.child[1 - side]), box_of(in.child[1 - g]));
+                    if (new_area < area && new_area - area < best_area)
+                    {
+                        best_area = new_area - area;
+                        best_side = side;
+                        best_grandchild = g;
+                    }
+                }
+            }
+
+            if (best_side < 0)
+                return;
+
+            uint32_t inner = node.child[best_side];
+            std::swap(node.child[1 - best_side], nodes[inner].child[best_grandchild]);
+            update(inner);
+        }
+
+        /// <summary>
+        /// Appends the subtree of a child reference to the flat node array in depth-first order.
+        /// </summary>
+        /// <param name="depth">= The level of the child in the flat tree, 0 for the root.</param>
+        void emit(uint32_t child, int depth, std::vector<FlatBVHNode>& flat, const std::vector<shared_ptr<Primitive>>& sorted, std::vector<shared_ptr<Primitive>>& ordered)
+        {
+            // The radix tree has no depth limit (equal or clustered codes make long chains); a subtree that would not fit in the
+            // traversal stack of the flat tree is rebuilt by splitting its primitives in halves, in Morton order
+            if (!(child & LEAF) && depth + FlatBVH::balanced_depth(count_of(child), size_t(settings.max_leaf_size)) >= FlatBVH::max_depth)
+            {
+                std::vector<uint32_t> leaves;
+                collect_leaves(child, leaves);
+                emit_balanced(leaves.data(), uint32_t(leaves.size()), flat, sorted, ordered);
+                return;
+            }
+
+            uint32_t index = uint32_t(flat.size());
+            flat.emplace_back();
+            const BuildBox& box = box_of(child);
+            flat[index].set_bounds(box.min, box.max);
+
+            if (count_of(child) <= uint32_t(settings.max_leaf_size))
+            {
+                flat[index].offset = uint32_t(ordered.size());
+                collect(child, sorted, ordered);
+                flat[index].count = uint16_t(ordered.size() - flat[index].offset);
+                return;
+            }
+
+            // The traversal expects the first child to be the one on the low side of the split axis
+            uint32_t first = nodes[child].child[0];
+            uint32_t second = nodes[child].child[1];
+            int axis = split_axis(box_of(first), box_of(second));
+            if (center(box_of(second), axis) < center(box_of(first), axis))
+                std::swap(first, second);
+            flat[index].axis = uint8_t(axis);
+
+            emit(first, depth + 1, flat, sorted, ordered);
+            flat[index].offset = uint32_t(flat.size());
+            emit(second, depth + 1, flat, sorted, ordered);
+        }
+
+        /// <summary>
+        /// Appends a subtree over a list of primitive references that is split in halves down to leaves of at most max_leaf_size.
+        /// </summary>
+        void emit_balanced(const uint32_t* leaves, uint32_t count, std::vector<FlatBVHNode>& flat, const std::vector<shared_ptr<Primitive>>& sorted,
+                           std::vector<shared_ptr<Primitive>>& ordered)
+        {
+            uint32_t index = uint32_t(flat.size());
+            flat.emplace_back();
+
+            uint32_t half = count <= uint32_t(settings.max_leaf_size) ? count : count / 2;
+            BuildBox low, high;
+            for (uint32_t i = 0; i < count; i++)
+                (i < half ? low : high).grow(box_of(leaves[i]));
+            BuildBox box = low;
+            box.grow(high);
+            flat[index].set_bounds(box.min, box.max);
+
+            if (half == count)
+            {
+                flat[index].offset = uint32_t(ordered.size());
+                for (uint32_t i = 0; i < count; i++)
+                    ordered.push_back(sorted[leaves[i] & ~LEAF]);
+                flat[index].count = uint16_t(count);
+                return;
+            }
+
+            int axis = split_axis(low, high);
+            flat[index].axis = uint8_t(axis);
+            if (center(high, axis) < center(low, axis))
+            {
+                emit_balanced(leaves + half, count - half, flat, sorted, ordered);
+                flat[index].offset = uint32_t(flat.size());
+                emit_balanced(leaves, half, flat, sorted, ordered);
+            }
+            else
+            {
+                emit_balanced(leaves, half, flat, sorted, ordered);
+                flat[index].offset = uint32_t(flat.size());
+                emit_balanced(leaves + half, count - half, flat, sorted, ordered);
+            }
+        }
+
+        // Twice the center of a box along an axis; only used for comparisons
+        static double center(const BuildBox& box, int axis)
+        {
+            return box.min[axis] + box.max[axis];
+        }
+
+        /// <summary>
+        /// Appends the primitives of a subtree to a list.
+        /// </summary>
+        void collect(uint32_t child, const std::vector<shared_ptr<Primitive>>& sorted, std::vector<shared_ptr<Primitive>>& ordered) const
+        {
+            if (child & LEAF)
+            {
+                ordered.push_back(sorted[child & ~LEAF]);
+                return;
+            }
+
+            collect(nodes[child].child[0], sorted, ordered);
+            collect(nodes[child].child[1], sorted, ordered);
+        }
+
+        /// <summary>
+        /// Appends the references to the primitives of a subtree to a list.
+        /// </summary>
+        void collect_leaves(uint32_t child, std::vector<uint32_t>& leaves) const
+        {
+            if (child & LEAF)
+            {
+                leaves.push_back(child);
+                return;
+            }
+
+            collect_leaves(nodes[child].child[0], leaves);
+            collect_leaves(nodes[child].child[1], leaves);
+        }
+
+        /// <summary>
+        /// Gets the axis along which the centers of two boxes are furthest apart, used to visit the nearer child first.
+        /// </summary>
+        static int split_axis(const BuildBox& a, const BuildBox& b)
+        {
+            int axis = 0;
+            double best = -1;
+            for (int i = 0; i < 3; i++)
+            {
+                double d = std::abs(center(a, i) - center(b, i));
+                if (d > best)
+                {
+                    best = d;
+                    axis = i;
+                }
+            }
+            return axis;
+        }
+};
+
+#endif
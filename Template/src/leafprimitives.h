@@ -0,0 +1,109 @@
+#pragma once
+
+#ifndef LEAFPRIMITIVES_H
+#define LEAFPRIMITIVES_H
+
+#include <cstdint>
+#include <vector>
+
+#include "packedtriangles.h"
+#include "primitive.h"
+#include "primitivetable.h"
+
+/// <summary>
+/// The primitive list of an acceleration structure, together with what its leaves need to intersect it quickly: a PrimitiveTable,
+/// so every primitive is tested through a switch on its type instead of a virtual call, and the PackedTriangles, so the
+/// triangles of a leaf are first filtered in SIMD batches. Both follow the order of the list and are rebuilt with it.
+/// </summary>
+class LeafPrimitives
+{
+    public:
+        using RayData = PackedTriangles::RayData;
+
+        // Primitives per SIMD batch; hit_indices is fastest with lists of about this length
+        static constexpr int batch_width = PackedTriangles::width;
+
+        LeafPrimitives() = default;
+
+        explicit LeafPrimitives(std::vector<shared_ptr<Primitive>> objects) { build(std::move(objects)); }
+
+        /// <summary>
+        /// Takes a new primitive list, in the order the structure refers to it by index.
+        /// </summary>
+        void build(std::vector<shared_ptr<Primitive>> objects)
+        {
+            list = std::move(objects);
+            table.build(list);
+            packed.pack(list);
+        }
+
+        /// <summary>
+        /// Copies the triangles again after they moved (see FlatBVH::refit).
+        /// </summary>
+        void repack() { packed.pack(list); }
+
+        const std::vector<shared_ptr<Primitive>>& objects() const { return list; }
+
+        const shared_ptr<Primitive>& operator[](size_t i) const { return list[i]; }
+
+        size_t size() const { return list.size(); }
+
+        bool empty() const { return list.empty(); }
+
+        /// <summary>
+        /// Gets the memory of the table and the packed triangles, in bytes (the primitives themselves not included).
+        /// </summary>
+        size_t memory_bytes() const { return table.memory_bytes() + packed.memory_bytes(); }
+
+        static RayData ray_data(const Ray& r) { return PackedTriangles::ray_data(r); }
+
+        bool hit(uint32_t i, const Ray& r, Interval ray_t, Hit_record& rec) const { return table.hit(i, r, ray_t, rec); }
+
+        /// <summary>
+        /// Intersects a ray with the primitives first .. first + count - 1.
+        /// </summary>
+        /// <param name="ray">= The ray from ray_data().</param>
+        /// <param name="closest">= The end of the valid interval; lowered to the distance of every closer hit.</param>
+        /// <param name="rec">= The hit record, written for every closer hit.</param>
+        /// <returns>Whether any primitive was hit.</returns>
+        bool hit_range(uint32_t first, uint32_t count, const RayData& ray, const Ray& r, double t_min, double& closest, Hit_record& rec) const
+        {
+            if (!packed.empty())
+                return packed.hit_range(table, first, count, ray, r, t_min, closest, rec);
+
+            bool hit_anything = false;
+            for (uint32_t i = first; i < first + count; i++)
+                hit_anything |= hit_closer(i, r, t_min, closest, rec);
+            return hit_anything;
+        }
+
+        /// <summary>
+        /// Intersects a ray with the primitives of a list of indices, like hit_range.
+        /// </summary>
+        bool hit_indices(const uint32_t* ids, uint32_t count, const RayData& ray, const Ray& r, double t_min, double& closest, Hit_record& rec) const
+        {
+            if (!packed.empty())
+                return packed.hit_indices(table, ids, count, ray, r, t_min, closest, rec);
+
+            bool hit_anything = false;
+            for (uint32_t i = 0; i < count; i++)
+                hit_anything |= hit_closer(ids[i], r, t_min, closest, rec);
+            return hit_anything;
+        }
+
+    private:
+        std::vector<shared_ptr<Primitive>> list;
+        PrimitiveTable table;
+        PackedTriangles packed;
+
+        bool hit_closer(uint32_t i, const Ray& r, double t_min, double& closest, Hit_record& rec) const
+        {
+            if (!table.hit(i, r, Interval(t_min, closest), rec))
+                return false;
+
+            closest = rec.t;
+            return true;
+        }
+};
+
+#endif
@@ -10,10 +10,34 @@
 #include "parseobj.h"
 #include "primitive.h"
 #include "material.h"
+#include "scenes.h"
 #include "sphere.h"
 #include "triangle.h"
 #include "world.h"
 
+/// <summary>
+/// Converts the rendered image to an array of points that SFML can draw, applying gamma correction.
+/// </summary>
+/// <param name="image">= The rendered image.</param>
+/// <returns>One point per pixel.</returns>
+sf::VertexArray to_vertex_array(const Framebuffer& image)
+{
+	auto arr = sf::VertexArray(sf::PrimitiveType::Points, image.width * image.height);
+
+	for (int y = 0; y < image.height; y++)
+	{
+		for (int x = 0; x < image.width; x++)
+		{
+			auto c = image.rgb8(x, y);
+			auto& vertex = arr[y * image.width + x];
+			vertex.position = sf::Vector2f(x, y);
+			vertex.color = sf::Color(c[0], c[1], c[2]);
+		}
+	}
+
+	return arr;
+}
+
 int main()
 {
     bool rendered = false;
@@ -26,6 +50,7 @@ int main()
 		<< "\n 4: Stack"
 		<< "\n 5: Colored stack"
 		<< "\n 6: UU"
+		<< "\n 7: Bunny field (1024 instances)"
 		<< endl;
 	cin >> test;
 
@@ -35,6 +60,12 @@ int main()
 		<< "\n 2: BVH"
 		<< "\n 3: KdTree"
 		<< "\n 4: Grid"
+		<< "\n 5: Flattened BVH"
+		<< "\n 6: Binned SAH BVH"
+		<< "\n 7: Linear BVH (Morton codes)"
+		<< "\n 8: 4-wide SIMD BVH"
+		<< "\n 9: 8-wide SIMD BVH"
+		<< "\n 10: Two-level grid"
 		<< endl;
 	cin >> accelstruct;
 
@@ -47,7 +78,7 @@ int main()
 
 		std::cout << "Starting render..\n";
 
-		auto window = sf::RenderWindow{ { conf::window_size.x, conf::window_size.y}, "RayTracer" };
+		auto window = sf::RenderWindow{ { conf::width, conf::height }, "RayTracer" };
 
 		// Camera
 		Camera cam;
@@ -70,48 +101,7 @@ int main()
     //world.add(make_shared<Sphere>(Point3(-1.0, 0.0, -1.0), 0.4, material_bubble));
     //world.add(make_shared<Sphere>(Point3(1.0, 0.0, -1.0), 0.5, material_right));
 
-    Parser parser;
-		tuple<vector<Point3>, vector<Vec3>, vector<Point3>, vector<shared_ptr<Lambertian>>> parsed;
-
-		switch (test)
-		{
-			case 1:
-				parsed = parser.parse("bunny.obj", Point3(0.4, -0.75, -2.75));
-				cam.cam_pos = Point3(0, 0, 0);
-				cam.cam_dir = Point3(0, 0, -1);
-				break;
-
-			case 2:
-				parsed = parser.parse("bunny.obj", Point3(0.4, -0.75, -2.75));
-				cam.cam_pos = Point3(0, 0, 0);
-				cam.cam_dir = Point3(-1, 0, 0);
-				break;
-
-			case 3:
-				parsed = parser.parse("bunny.obj", Point3(2.75, -0.75, 0));
-				cam.cam_pos = Point3(0, 0, 0);
-				cam.cam_dir = Point3(0, 0, 0);
-				break;
-
-			case 4:
-				parsed = parser.parse("stack.obj", Point3(0, 0, 0));
-				cam.cam_pos = Point3(0, 3, 10);
-				cam.cam_dir = Point3(-1, 0, -1);
-				break;
-
-			case 5:
-				parsed = parser.parse("stackcolor.obj", Point3(0, 0, 0));
-				cam.cam_pos = Point3(0, 4, 20);
-				cam.cam_dir = Point3(-1, 0, -1);
-				break;
-
-			case 6:
-				parsed = parser.parse("UU.obj", Point3(0, 0, 0));
-				cam.cam_pos = Point3(40, 0, 0);
-				cam.cam_dir = Point3(-1, 0, 0);
-			default: break;
-		}
-
+    load_scene(test, cam, world);
 
 		Camera::AccelStruct struc;
 		switch (accelstruct)
@@ -120,6 +110,12 @@ int main()
 			case 2: struc = Camera::BVH; break;
 			case 3: struc = Camera::KDtree; break;
 			case 4: struc = Camera::GRID; break;
+			case 5: struc = Camera::BVH_FLAT; break;
+			case 6: struc = Camera::BVH_SAH; break;
+			case 7: struc = Camera::LBVH; break;
+			case 8: struc = Camera::BVH4; break;
+			case 9: struc = Camera::BVH8; break;
+			case 10: struc = Camera::GRID2; break;
 			default: struc = Camera::NONE; break;
 		}
 
@@ -131,30 +127,6 @@ int main()
 			default: aa_method = Camera::FIXED; break;
 		}
 
-		auto [vertices, _, faces, materials] = parsed;
-
-
-    // Load all triangles in the mesh
-    for (int face_index = 0; face_index < faces.size(); face_index++)
-    {
-        Point3 face = faces[face_index];
-        double p_index_a = face.x() - 1;
-        double p_index_b = face.y() - 1;
-        double p_index_c = face.z() - 1;
-
-        Point3 a = vertices[p_index_a];
-        Point3 b = vertices[p_index_b];
-        Point3 c = vertices[p_index_c];
-
-        // To calculate the normal of the face, we take two edges of the triangle A and B
-        // The normal of the face is then the cross product between the two edges A and B
-        Vec3 A = b - a;
-        Vec3 B = c - a;
-        Vec3 normal = cross(A, B);
-
-        world.add(make_shared<Triangle>(a, A, B, materials[face_index]));
-    }
-
 	std::cout << "Number of primitives: " << world.objects.size() << std::endl;
     // Nice render but takes a while
     /*auto ground_material = make_shared<Lambertian>(Vec3(0.5, 0.5, 0.5));
@@ -213,7 +185,7 @@ int main()
         // Render screen
 		if (!rendered)
 		{
-			res = cam.render(world, rendered, struc, aa_method, traversal_steps, intersection_tests);
+			res = to_vertex_array(cam.render(world, rendered, struc, aa_method, traversal_steps, intersection_tests));
 			rendered = true;
 			std::cout << "Render finished. \n";
 
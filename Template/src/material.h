@@ -11,7 +11,7 @@ class Material
 	public:
 		virtual ~Material() = default;
 
-		virtual bool scatter(const Ray& r_in, const Hit_record& rec, Vec3& attenuation, Ray& scat) const
+		virtual bool scatter(const Ray& r_in, const Surface& rec, Vec3& attenuation, Ray& scat) const
 		{
 			return false;
 		}
@@ -23,7 +23,7 @@ class Lambertian : public Material
 	public:
 		Lambertian(const Vec3& albedo) : albedo(albedo) {}
 
-		bool scatter(const Ray& r_in, const Hit_record& rec, Vec3& attentuation, Ray& scat) const override
+		bool scatter(const Ray& r_in, const Surface& rec, Vec3& attentuation, Ray& scat) const override
 		{
 			auto scat_dir = rec.normal + random_unit_vector();
 
@@ -45,7 +45,7 @@ class Metal : public Material
 	public:
 		Metal(const Vec3& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
-		bool scatter(const Ray& r_in, const Hit_record& rec, Vec3& attenuation, Ray& scat) const override
+		bool scatter(const Ray& r_in, const Surface& rec, Vec3& attenuation, Ray& scat) const override
 		{
 			Vec3 reflected = reflect(r_in.direction(), rec.normal);
 			reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
@@ -65,7 +65,7 @@ class Dielectric : public Material
 	public:
 		Dielectric(double index) : index(index) {}
 
-		bool scatter(const Ray& r, const Hit_record& rec, Vec3& attenuation, Ray& scat) const override
+		bool scatter(const Ray& r, const Surface& rec, Vec3& attenuation, Ray& scat) const override
 		{
 			attenuation = Vec3(1.0, 1.0, 1.0);
 			double ri = rec.front_face ? (1.0 / index) : index;
@@ -0,0 +1,446 @@
+#pragma once
+
+#ifndef PACKEDTRIANGLES_H
+#define PACKEDTRIANGLES_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PACKEDTRIANGLES_SSE
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define PACKEDTRIANGLES_AVX2
+#endif
+
+#include "configuration.hpp"
+#include "primitive.h"
+#include "primitivetable.h"
+#include "trianglemesh.h"
+
+/// <summary>
+/// The triangles of an acceleration structure in float structure-of-arrays form, in the order of its primitive list, for a batched
+/// Moeller-Trumbore test of one ray against 8 (AVX2) or 4 (SSE) triangles at once.
+/// The batched test is a conservative filter: it never rejects a triangle that the double precision hit() of the primitive would hit,
+/// because every comparison is widened by an upper bound on its float rounding error. Only the triangles that pass it (usually none
+/// or one per batch) are intersected with hit(), so the result is exactly the same as testing every primitive with hit().
+/// Primitives that are not triangles always pass the filter.
+/// </summary>
+class PackedTriangles
+{
+    public:
+#if defined(PACKEDTRIANGLES_AVX2)
+        static constexpr int width = 8;
+#else
+        static constexpr int width = 4;
+#endif
+
+        // The ray in float, with the absolute values that bound the rounding errors
+        struct RayData
+        {
+            float origin[3];
+            float direction[3];
+            float abs_origin[3];
+            float abs_direction[3];
+        };
+
+        PackedTriangles() = default;
+
+        explicit PackedTriangles(const std::vector<shared_ptr<Primitive>>& primitives) { pack(primitives); }
+
+        /// <summary>
+        /// Copies the corners of the triangles in a primitive list. Without any triangle (or with conf::packed_triangles off),
+        /// nothing is stored and empty() is true.
+        /// </summary>
+        void pack(const std::vector<shared_ptr<Primitive>>& primitives)
+        {
+            for (auto* a : arrays())
+                a->clear();
+
+            bool any = false;
+            std::vector<std::array<Point3, 3>> corners(primitives.size());
+            std::vector<bool> is_triangle(primitives.size());
+            for (size_t i = 0; i < primitives.size(); i++)
+            {
+                is_triangle[i] = triangle_corners(*primitives[i], corners[i]);
+                any |= is_triangle[i];
+            }
+            if (!any || !conf::packed_triangles)
+                return;
+
+            // Padding, so a batch at the end of the list can be loaded whole
+            for (auto* a : arrays())
+                a->assign(primitives.size() + width, 0.0f);
+
+            for (size_t i = 0; i < primitives.size(); i++)
+            {
+                // Non-triangles keep zero edges, which makes their lanes degenerate, and degenerate lanes always pass
+                if (!is_triangle[i])
+                    continue;
+
+                const auto& c = corners[i];
+                for (int a = 0; a < 3; a++)
+                {
+                    v0[a][i] = float(c[0][a]);
+                    e1[a][i] = float(c[1][a] - c[0][a]);
+                    e2[a][i] = float(c[2][a] - c[0][a]);
+                }
+            }
+        }
+
+        bool empty() const { return v0[0].empty(); }
+
+        size_t memory_bytes() const { return 9 * v0[0].size() * sizeof(float); }
+
+        static RayData ray_data(const Ray& r)
+        {
+            RayData ray;
+            for (int a = 0; a < 3; a++)
+            {
+                ray.origin[a] = float(r.origin()[a]);
+                ray.direction[a] = float(r.direction()[a]);
+                ray.abs_origin[a] = std::abs(ray.origin[a]);
+                ray.abs_direction[a] = std::abs(ray.direction[a]);
+            }
+            return ray;
+        }
+
+        /// <summary>
+        /// Intersects a ray with the primitives first .. first + count - 1: the batched filter, then hit() for the triangles that pass it.
+        /// Every primitive counts as one intersection test.
+        /// </summary>
+        /// <param name="primitives">= The table of the primitive list that was packed.</param>
+        /// <param name="closest">= The end of the valid interval; lowered to the distance of every closer hit.</param>
+        /// <param name="rec">= The hit record, written for every closer hit.</param>
+        /// <returns>Whether any primitive was hit.</returns>
+        bool hit_range(const PrimitiveTable& primitives, uint32_t first, uint32_t count, const RayData& ray,
+                       const Ray& r, double t_min, double& closest, Hit_record& rec) const
+        {
+            bool hit_anything = false;
+            for (uint32_t begin = first; begin < first + count; begin += width)
+            {
+                uint32_t n = std::min<uint32_t>(width, first + count - begin);
+                uint32_t mask = n < min_batch ? lane_mask(n) : candidates(ray, begin, n, float(t_min), float(closest));
+                hit_anything |= hit_candidates(primitives, begin, nullptr, n, mask, r, t_min, closest, rec);
+            }
+            return hit_anything;
+        }
+
+        /// <summary>
+        /// Intersects a ray with the primitives of a list of indices, like hit_range.
+        /// </summary>
+        bool hit_indices(const PrimitiveTable& primitives, const uint32_t* ids, uint32_t count, const RayData& ray,
+                         const Ray& r, double t_min, double& closest, Hit_record& rec) const
+        {
+            bool hit_anything = false;
+            for (uint32_t begin = 0; begin < count; begin += width)
+            {
+                uint32_t n = std::min<uint32_t>(width, count - begin);
+                uint32_t mask = n < min_batch ? lane_mask(n) : candidates(ray, ids + begin, n, float(t_min), float(closest));
+                hit_anything |= hit_candidates(primitives, 0, ids + begin, n, mask, r, t_min, closest, rec);
+            }
+            return hit_anything;
+        }
+
+        /// <summary>
+        /// Runs the batched filter on the primitives first .. first + count - 1 (count at most width).
+        /// </summary>
+        /// <returns>A bit mask of the primitives that may be hit within t_min .. t_max.</returns>
+        uint32_t candidates(const RayData& ray, uint32_t first, uint32_t count, float t_min, float t_max) const
+        {
+#if defined(PACKEDTRIANGLES_AVX2)
+            return test(load<Lane8>(first), ray, t_min, t_max) & lane_mask(count);
+#elif defined(PACKEDTRIANGLES_SSE)
+            return test(load<Lane4>(first), ray, t_min, t_max) & lane_mask(count);
+#else
+            return candidates_scalar(ray, first, count, t_min, t_max);
+#endif
+        }
+
+        /// <summary>
+        /// Runs the batched filter on the primitives of a list of indices (count at most width).
+        /// </summary>
+        uint32_t candidates(const RayData& ray, const uint32_t* ids, uint32_t count, float t_min, float t_max) const
+        {
+            // Unused lanes repeat the first primitive, and are masked off
+            uint32_t lane_ids[width];
+            for (int lane = 0; lane < width; lane++)
+                lane_ids[lane] = ids[lane < int(count) ? lane : 0];
+
+#if defined(PACKEDTRIANGLES_AVX2)
+            return test(gather<Lane8>(lane_ids), ray, t_min, t_max) & lane_mask(count);
+#elif defined(PACKEDTRIANGLES_SSE)
+            return test(gather<Lane4>(lane_ids), ray, t_min, t_max) & lane_mask(count);
+#else
+            uint32_t mask = 0;
+            for (uint32_t lane = 0; lane < count; lane++)
+                mask |= candidates_scalar(ray, lane_ids[lane], 1, t_min, t_max) << lane;
+            return mask;
+#endif
+        }
+
+        /// <summary>
+        /// The scalar reference of the batched filter, one primitive at a time, for validation and for CPUs without SSE.
+        /// </summary>
+        uint32_t candidates_scalar(const RayData& ray, uint32_t first, uint32_t count, float t_min, float t_max) const
+        {
+            uint32_t mask = 0;
+            for (uint32_t lane = 0; lane < count; lane++)
+            {
+                uint32_t i = first + lane;
+                float e1v[3] = { e1[0][i], e1[1][i], e1[2][i] };
+                float e2v[3] = { e2[0][i], e2[1][i], e2[2][i] };
+                float s[3], m[3], ae1[3], ae2[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    s[a] = ray.origin[a] - v0[a][i];
+                    m[a] = ray.abs_origin[a] + std::abs(v0[a][i]);
+                    ae1[a] = std::abs(e1v[a]);
+                    ae2[a] = std::abs(e2v[a]);
+                }
+
+                float p[3], q[3], ap[3], aq[3];
+                cross3(ray.direction, e2v, p);
+                cross3(s, e1v, q);
+                abs_cross3(ray.abs_direction, ae2, ap);
+                abs_cross3(m, ae1, aq);
+
+                float det = dot3(e1v, p);
+                float sign = det < 0 ? -1.0f : 1.0f;
+                float d = std::abs(det);
+                float u = sign * dot3(s, p);
+                float v = sign * dot3(ray.direction, q);
+                float w = sign * dot3(e2v, q);
+
+                float err_d = error_scale * dot3(ae1, ap);
+                float err_u = error_scale * dot3(m, ap);
+                float err_v = error_scale * dot3(ray.abs_direction, aq);
+                float err_w = error_scale * dot3(ae2, aq);
+
+                bool degenerate = d <= err_d;
+                bool inside = u >= -err_u && v >= -err_v && u + v <= d + err_d + err_u + err_v
+                           && w + err_w >= t_min * (d - err_d) && w - err_w <= t_max * (d + err_d);
+                if (degenerate || inside)
+                    mask |= 1u << lane;
+            }
+            return mask;
+        }
+
+        /// <summary>
+        /// Gets the name of the instruction set used for the batched test.
+        /// </summary>
+        static const char* simd_name()
+        {
+#if defined(PACKEDTRIANGLES_AVX2)
+            return "AVX2";
+#elif defined(PACKEDTRIANGLES_SSE)
+            return "SSE";
+#else
+            return "scalar";
+#endif
+        }
+
+    private:
+        // The first corner and both edges of every triangle, per axis
+        std::vector<float> v0[3], e1[3], e2[3];
+
+        // Fewer primitives than this are tested one by one: filling a batch costs more than the test it saves
+        static constexpr uint32_t min_batch = 3;
+
+        // Bound on the relative rounding error of the float computations, from the rounding of the ray and corners to the final dot products
+        static constexpr float error_scale = 32 * std::numeric_limits<float>::epsilon();
+
+        std::array<std::vector<float>*, 9> arrays()
+        {
+            return { &v0[0], &v0[1], &v0[2], &e1[0], &e1[1], &e1[2], &e2[0], &e2[1], &e2[2] };
+        }
+
+        static uint32_t lane_mask(uint32_t count) { return count >= 32 ? ~0u : (1u << count) - 1; }
+
+        bool hit_candidates(const PrimitiveTable& primitives, uint32_t first, const uint32_t* ids, uint32_t count,
+                            uint32_t mask, const Ray& r, double t_min, double& closest, Hit_record& rec) const
+        {
+            bool hit_anything = false;
+            for (uint32_t lane = 0; lane < count; lane++)
+            {
+                // hit() counts the candidates itself
+                if (!(mask >> lane & 1))
+                {
+                    trace_stats().intersection_tests++;
+                    continue;
+                }
+
+                uint32_t i = ids ? ids[lane] : first + lane;
+                if (primitives.hit(i, r, Interval(t_min, closest), rec))
+                {
+                    hit_anything = true;
+                    closest = rec.t;
+                }
+            }
+            return hit_anything;
+        }
+
+        static float dot3(const float a[3], const float b[3]) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+
+        static void cross3(const float a[3], const float b[3], float c[3])
+        {
+            c[0] = a[1] * b[2] - a[2] * b[1];
+            c[1] = a[2] * b[0] - a[0] * b[2];
+            c[2] = a[0] * b[1] - a[1] * b[0];
+        }
+
+        // Bounds the absolute value of every component of a cross product, from the absolute values of its inputs
+        static void abs_cross3(const float a[3], const float b[3], float c[3])
+        {
+            c[0] = a[1] * b[2] + a[2] * b[1];
+            c[1] = a[2] * b[0] + a[0] * b[2];
+            c[2] = a[0] * b[1] + a[1] * b[0];
+        }
+
+#if defined(PACKEDTRIANGLES_SSE)
+        // SIMD lanes with just the operations of the test, so the same code serves SSE and AVX2
+        struct Lane4
+        {
+            __m128 v;
+
+            static Lane4 set(float f) { return { _mm_set1_ps(f) }; }
+            static Lane4 load(const float* p) { return { _mm_loadu_ps(p) }; }
+            static Lane4 gather(const float* base, const uint32_t ids[4]) { return { _mm_setr_ps(base[ids[0]], base[ids[1]], base[ids[2]], base[ids[3]]) }; }
+            friend Lane4 operator+(Lane4 a, Lane4 b) { return { _mm_add_ps(a.v, b.v) }; }
+            friend Lane4 operator-(Lane4 a, Lane4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+            friend Lane4 operator*(Lane4 a, Lane4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+            friend Lane4 operator&(Lane4 a, Lane4 b) { return { _mm_and_ps(a.v, b.v) }; }
+            friend Lane4 operator|(Lane4 a, Lane4 b) { return { _mm_or_ps(a.v, b.v) }; }
+            friend Lane4 operator^(Lane4 a, Lane4 b) { return { _mm_xor_ps(a.v, b.v) }; }
+            friend Lane4 operator<=(Lane4 a, Lane4 b) { return { _mm_cmple_ps(a.v, b.v) }; }
+            friend Lane4 operator>=(Lane4 a, Lane4 b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+            static Lane4 sign_bits(Lane4 a) { return { _mm_and_ps(a.v, _mm_set1_ps(-0.0f)) }; }
+            static Lane4 abs(Lane4 a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+            static uint32_t bits(Lane4 a) { return uint32_t(_mm_movemask_ps(a.v)); }
+        };
+#endif
+
+#if defined(PACKEDTRIANGLES_AVX2)
+        struct Lane8
+        {
+            __m256 v;
+
+            static Lane8 set(float f) { return { _mm256_set1_ps(f) }; }
+            static Lane8 load(const float* p) { return { _mm256_loadu_ps(p) }; }
+            static Lane8 gather(const float* base, const uint32_t ids[8])
+            {
+                return { _mm256_i32gather_ps(base, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ids)), 4) };
+            }
+            friend Lane8 operator+(Lane8 a, Lane8 b) { return { _mm256_add_ps(a.v, b.v) }; }
+            friend Lane8 operator-(Lane8 a, Lane8 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+            friend Lane8 operator*(Lane8 a, Lane8 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+            friend Lane8 operator&(Lane8 a, Lane8 b) { return { _mm256_and_ps(a.v, b.v) }; }
+            friend Lane8 operator|(Lane8 a, Lane8 b) { return { _mm256_or_ps(a.v, b.v) }; }
+            friend Lane8 operator^(Lane8 a, Lane8 b) { return { _mm256_xor_ps(a.v, b.v) }; }
+            friend Lane8 operator<=(Lane8 a, Lane8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+            friend Lane8 operator>=(Lane8 a, Lane8 b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+            static Lane8 sign_bits(Lane8 a) { return { _mm256_and_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+            static Lane8 abs(Lane8 a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+            static uint32_t bits(Lane8 a) { return uint32_t(_mm256_movemask_ps(a.v)); }
+        };
+#endif
+
+        // The corners of a batch: v0, e1 and e2 per axis
+        template <typename L>
+        struct Batch
+        {
+            L v0[3], e1[3], e2[3];
+        };
+
+        template <typename L>
+        Batch<L> load(uint32_t first) const
+        {
+            Batch<L> b;
+            for (int a = 0; a < 3; a++)
+            {
+                b.v0[a] = L::load(&v0[a][first]);
+                b.e1[a] = L::load(&e1[a][first]);
+                b.e2[a] = L::load(&e2[a][first]);
+            }
+            return b;
+        }
+
+        template <typename L>
+        Batch<L> gather(const uint32_t* ids) const
+        {
+            Batch<L> b;
+            for (int a = 0; a < 3; a++)
+            {
+                b.v0[a] = L::gather(v0[a].data(), ids);
+                b.e1[a] = L::gather(e1[a].data(), ids);
+                b.e2[a] = L::gather(e2[a].data(), ids);
+            }
+            return b;
+        }
+
+        /// <summary>
+        /// The batched filter, the same computation as candidates_scalar in every lane.
+        /// </summary>
+        template <typename L>
+        static uint32_t test(const Batch<L>& b, const RayData& ray, float t_min, float t_max)
+        {
+            L dir[3], abs_dir[3], s[3], m[3], ae1[3], ae2[3];
+            for (int a = 0; a < 3; a++)
+            {
+                dir[a] = L::set(ray.direction[a]);
+                abs_dir[a] = L::set(ray.abs_direction[a]);
+                s[a] = L::set(ray.origin[a]) - b.v0[a];
+                m[a] = L::set(ray.abs_origin[a]) + L::abs(b.v0[a]);
+                ae1[a] = L::abs(b.e1[a]);
+                ae2[a] = L::abs(b.e2[a]);
+            }
+
+            auto dot = [](const L x[3], const L y[3]) { return x[0] * y[0] + x[1] * y[1] + x[2] * y[2]; };
+            auto cross = [](const L x[3], const L y[3], L z[3])
+            {
+                z[0] = x[1] * y[2] - x[2] * y[1];
+                z[1] = x[2] * y[0] - x[0] * y[2];
+                z[2] = x[0] * y[1] - x[1] * y[0];
+            };
+            auto abs_cross = [](const L x[3], const L y[3], L z[3])
+            {
+                z[0] = x[1] * y[2] + x[2] * y[1];
+                z[1] = x[2] * y[0] + x[0] * y[2];
+                z[2] = x[0] * y[1] + x[1] * y[0];
+            };
+
+            L p[3], q[3], ap[3], aq[3];
+            cross(dir, b.e2, p);
+            cross(s, b.e1, q);
+            abs_cross(abs_dir, ae2, ap);
+            abs_cross(m, ae1, aq);
+
+            // Flipping the signs by the sign of the determinant turns the divisions by it into comparisons
+            L det = dot(b.e1, p);
+            L sign = L::sign_bits(det);
+            L d = L::abs(det);
+            L u = dot(s, p) ^ sign;
+            L v = dot(dir, q) ^ sign;
+            L w = dot(b.e2, q) ^ sign;
+
+            L scale = L::set(error_scale);
+            L err_d = scale * dot(ae1, ap);
+            L err_u = scale * dot(m, ap);
+            L err_v = scale * dot(abs_dir, aq);
+            L err_w = scale * dot(ae2, aq);
+
+            L zero = L::set(0.0f);
+            L degenerate = d <= err_d;
+            L inside = (u >= zero - err_u) & (v >= zero - err_v) & (u + v <= d + err_d + err_u + err_v)
+                     & (w + err_w >= L::set(t_min) * (d - err_d)) & (w - err_w <= L::set(t_max) * (d + err_d));
+            return L::bits(degenerate | inside);
+        }
+};
+
+#endif
@@ -39,9 +39,14 @@ class Parser
 		std::tuple<std::vector<Point3>, std::vector<Vec3>, std::vector<Point3>, std::vector<shared_ptr<Lambertian>>>
 		parse(string filename, Point3 pos)
 		{
-			string dir = lookUpDir();
+			// Paths that exist (relative to the working directory, or absolute) are opened directly,
+			// other names are looked up in the "src/obj files" folder
+			string dir = std::filesystem::exists(filename) ? "" : lookUpDir();
 			ifstream obj(dir + filename);
 
+			if (!obj.is_open())
+				std::cout << "Could not open " << dir + filename << std::endl;
+
 
 			std::vector<Point3> vertices; // List of points of the vertices
 			std::vector<Vec3> vertex_normals; // Vertex normals --> probably not needed for basic triangulation
@@ -195,6 +200,10 @@ class Parser
 
 			while (true)
 			{
+				// Not started from within the project, so fall back to the working directory
+				if (splits.empty())
+					return "obj files/";
+
 				int index = splits.size() - 1;
 				//print(splits[index]);
 				if (splits[index] == "Template") break;
@@ -3,19 +3,75 @@
 #ifndef PRIMITIVE_H
 #define PRIMITIVE_H
 
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
 class Material;
+class Primitive;
 
-// Keep track of the hits of a ray
-class Hit_record
+/// <summary>
+/// The materials of the scene. Primitives and hit records refer to a material by its index in this table, so a hit record
+/// is plain data and copying it touches no reference count. Materials are added while the scene is built (on one thread)
+/// and stay in the table for the rest of the program.
+/// </summary>
+class MaterialTable
+{
+	public:
+		/// <summary>
+		/// Adds a material to the table, or finds it if it is already there.
+		/// </summary>
+		/// <returns>The index of the material.</returns>
+		static uint32_t add(const shared_ptr<Material>& material)
+		{
+			Table& table = instance();
+			auto found = table.index.find(material.get());
+			if (found != table.index.end())
+				return found->second;
+
+			uint32_t id = uint32_t(table.materials.size());
+			table.materials.push_back(material);
+			table.index.emplace(material.get(), id);
+			return id;
+		}
+
+		static const Material* get(uint32_t id) { return instance().materials[id].get(); }
+
+	private:
+		struct Table
+		{
+			std::vector<shared_ptr<Material>> materials;
+			std::unordered_map<const Material*, uint32_t> index;
+		};
+
+		static Table& instance()
+		{
+			static Table table;
+			return table;
+		}
+};
+
+// Debug counters of the rays traced on one thread. The acceleration structures count into the counters of the thread
+// that traces the ray; the camera reads the difference around every ray.
+struct TraceStats
+{
+	uint64_t traversal_steps = 0;
+	uint64_t intersection_tests = 0;
+};
+
+inline TraceStats& trace_stats()
+{
+	thread_local TraceStats stats;
+	return stats;
+}
+
+// The surface at the closest hit of a ray, reconstructed from its hit record
+class Surface
 {
 	public:
 		Point3 p;
 		Vec3 normal;
-		shared_ptr<Material> mat;
-		double t;
 		bool front_face;
-		uint64_t intersection_tests = 0;
-		uint64_t traversal_steps = 0;
 
 		/// <summary>
 		/// Sets the normal inward or outward.
@@ -29,6 +85,24 @@ class Hit_record
 		}
 };
 
+// Keep track of the hits of a ray. Only what the traversal needs is stored; the position and normal are reconstructed
+// with surface() for the closest hit alone.
+class Hit_record
+{
+	public:
+		double t;
+		double u = 0, v = 0;                    // Barycentric coordinates of a hit on a triangle (weights of the second and third corner)
+		const Primitive* primitive = nullptr;   // The primitive that was hit
+		const Primitive* instance = nullptr;    // The instance the primitive was hit through, if any
+		uint32_t material = 0;                  // Index in the MaterialTable
+
+		/// <summary>
+		/// Reconstructs the position and normal of the hit.
+		/// </summary>
+		/// <param name="r">= The ray that was traced.</param>
+		inline Surface surface(const Ray& r) const;
+};
+
 class Primitive
 {
 	public:
@@ -37,6 +111,19 @@ class Primitive
 		virtual bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const = 0;
 
 		virtual aabb hitBox() const = 0;
+
+		/// <summary>
+		/// Reconstructs the surface at a hit on this primitive. Only primitives that put themselves in a hit record
+		/// (as its primitive or its instance) implement this; acceleration structures do not.
+		/// </summary>
+		virtual void surface(const Ray& /*r*/, const Hit_record& /*rec*/, Surface& /*s*/) const {}
 };
 
+inline Surface Hit_record::surface(const Ray& r) const
+{
+	Surface s;
+	(instance ? instance : primitive)->surface(r, *this, s);
+	return s;
+}
+
 #endif
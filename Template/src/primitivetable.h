@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef PRIMITIVETABLE_H
+#define PRIMITIVETABLE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "primitive.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "trianglemesh.h"
+
+/// <summary>
+/// The primitives of an acceleration structure as tagged references: every entry holds the type of the primitive and a plain
+/// pointer to it, so the leaves intersect triangles, mesh faces and spheres with a switch and a direct call instead of a virtual
+/// call through the shared_ptr. A mesh face points straight at its mesh, which skips the MeshTriangle in between.
+/// Other primitives (instances, nested structures) keep the virtual call. The entries do not own the primitives; the
+/// structure that builds the table keeps its shared_ptr list alive next to it, in the same order.
+/// </summary>
+class PrimitiveTable
+{
+    public:
+        enum class Kind : uint8_t { MeshFace, Triangle, Sphere, Other };
+
+        struct Entry
+        {
+            const void* object;  // The TriangleMesh of a face, or the primitive itself
+            uint32_t face;       // The face in the mesh
+            Kind kind;
+        };
+
+        PrimitiveTable() = default;
+
+        explicit PrimitiveTable(const std::vector<shared_ptr<Primitive>>& primitives) { build(primitives); }
+
+        void build(const std::vector<shared_ptr<Primitive>>& primitives)
+        {
+            entries.resize(primitives.size());
+            for (size_t i = 0; i < primitives.size(); i++)
+                entries[i] = reference(*primitives[i]);
+        }
+
+        /// <summary>
+        /// Gets the tagged reference to one primitive.
+        /// </summary>
+        static Entry reference(const Primitive& primitive)
+        {
+            if (auto face = dynamic_cast<const MeshTriangle*>(&primitive))
+                return { &face->triangle_mesh(), face->face_index(), Kind::MeshFace };
+            if (auto triangle = dynamic_cast<const Triangle*>(&primitive))
+                return { triangle, 0, Kind::Triangle };
+            if (auto sphere = dynamic_cast<const Sphere*>(&primitive))
+                return { sphere, 0, Kind::Sphere };
+            return { &primitive, 0, Kind::Other };
+        }
+
+        size_t size() const { return entries.size(); }
+
+        size_t memory_bytes() const { return entries.size() * sizeof(Entry); }
+
+        /// <summary>
+        /// Intersects a ray with one primitive of the table.
+        /// </summary>
+        /// <param name="i">= The index of the primitive, the same as in the list the table was built from.</param>
+        bool hit(uint32_t i, const Ray& r, Interval ray_t, Hit_record& rec) const
+        {
+            return hit(entries[i], r, ray_t, rec);
+        }
+
+        static bool hit(const Entry& e, const Ray& r, Interval ray_t, Hit_record& rec)
+        {
+            switch (e.kind)
+            {
+                case Kind::MeshFace:
+                    return static_cast<const TriangleMesh*>(e.object)->hit(e.face, r, ray_t, rec);
+                case Kind::Triangle:
+                    return static_cast<const Triangle*>(e.object)->hit(r, ray_t, rec);
+                case Kind::Sphere:
+                    return static_cast<const Sphere*>(e.object)->hit(r, ray_t, rec);
+                default:
+                    return static_cast<const Primitive*>(e.object)->hit(r, ray_t, rec);
+            }
+        }
+
+    private:
+        std::vector<Entry> entries;
+};
+
+#endif
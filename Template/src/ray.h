@@ -3,14 +3,19 @@
 #ifndef RAY_H
 #define RAY_H
 
-#include "Vec3.h"
+#include <cmath>
+
+#include "vec3.h"
 
 class Ray
 {
 	public:
 		Ray() {}
 
-		Ray(const Point3& origin, const Vec3& direction) : orig(origin), dir(direction) {}
+		Ray(const Point3& origin, const Vec3& direction) : orig(origin), dir(direction)
+		{
+			set_shear();
+		}
 
 		const Point3& origin() const { return orig; }
 		const Vec3& direction() const { return dir; }
@@ -25,9 +30,29 @@ class Ray
 			return orig + t * dir;
 		}
 
+		// Per-ray constants of the watertight triangle test (Woop, Benthin and Wald, "Watertight ray/triangle intersection"):
+		// the axis along which the direction is largest becomes z, and the shear sx, sy, sz maps the direction onto (0, 0, 1)
+		int kx = 0, ky = 1, kz = 2;
+		double sx = 0, sy = 0, sz = 1;
+
 	private:
 		Point3 orig;
 		Vec3 dir;
+
+		void set_shear()
+		{
+			kz = std::abs(dir.x()) > std::abs(dir.y()) ? (std::abs(dir.x()) > std::abs(dir.z()) ? 0 : 2) : (std::abs(dir.y()) > std::abs(dir.z()) ? 1 : 2);
+			kx = (kz + 1) % 3;
+			ky = (kx + 1) % 3;
+
+			// Swapping x and y keeps the winding of the triangles, so the sign of the determinant still tells the side
+			if (dir[kz] < 0)
+				std::swap(kx, ky);
+
+			sx = dir[kx] / dir[kz];
+			sy = dir[ky] / dir[kz];
+			sz = 1.0 / dir[kz];
+		}
 };
 
 #endif
@@ -0,0 +1,151 @@
+#pragma once
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+/// <summary>
+/// SplitMix64 step. Used to turn (structured) keys and seeds into well-mixed 64-bit values.
+/// </summary>
+/// <param name="x">= The value to mix.</param>
+/// <returns></returns>
+inline uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// xoshiro256++ by Blackman and Vigna: 256 bits of state, period 2^256 - 1, a handful of instructions per number.
+class Xoshiro256pp
+{
+    public:
+        Xoshiro256pp(uint64_t seed = 0) { this->seed(seed); }
+
+        void seed(uint64_t seed)
+        {
+            // The state must not be all zeros; filling it with SplitMix64 output guarantees that
+            for (int i = 0; i < 4; i++)
+            {
+                seed += 0x9E3779B97F4A7C15ull;
+                s[i] = splitmix64(seed);
+            }
+        }
+
+        uint64_t next()
+        {
+            const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+            const uint64_t t = s[1] << 17;
+
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = rotl(s[3], 45);
+
+            return result;
+        }
+
+    private:
+        uint64_t s[4];
+
+        static uint64_t rotl(uint64_t x, int k)
+        {
+            return (x << k) | (x >> (64 - k));
+        }
+};
+
+// PCG-XSH-RR 64/32 by O'Neill: 64 bits of state, 32-bit output. Two outputs are combined per 64-bit number.
+class Pcg32
+{
+    public:
+        Pcg32(uint64_t seed = 0) { this->seed(seed); }
+
+        void seed(uint64_t seed)
+        {
+            state = 0;
+            inc = (splitmix64(seed) << 1) | 1;
+            next32();
+            state += splitmix64(seed + 1);
+            next32();
+        }
+
+        uint32_t next32()
+        {
+            uint64_t old = state;
+            state = old * 6364136223846793005ull + inc;
+            uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+            uint32_t rot = uint32_t(old >> 59);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+        uint64_t next()
+        {
+            uint64_t hi = next32();
+            return (hi << 32) | next32();
+        }
+
+    private:
+        uint64_t state;
+        uint64_t inc;
+};
+
+// The generator used by the renderer. Select PCG with the RAYTRACER_RNG_PCG32 define (CMake: -DRAYTRACER_RNG=PCG32).
+#ifdef RAYTRACER_RNG_PCG32
+using Rng = Pcg32;
+#else
+using Rng = Xoshiro256pp;
+#endif
+
+// Per-thread random state: the generator and the (seed, pixel, sample) key it was last seeded with
+struct RandomState
+{
+    Rng rng;
+    uint64_t sample_key = 0;
+};
+
+inline RandomState& random_state()
+{
+    thread_local RandomState state;
+    return state;
+}
+
+/// <summary>
+/// Seeds the generator of the calling thread for a new camera sample.
+/// The random numbers of a sample only depend on this key, never on the thread or the order in which pixels are rendered.
+/// </summary>
+/// <param name="seed">= The global seed of the render.</param>
+/// <param name="pixel">= Index of the pixel.</param>
+/// <param name="sample">= Index of the sample within the pixel.</param>
+inline void random_begin_sample(uint64_t seed, uint64_t pixel, uint64_t sample)
+{
+    RandomState& state = random_state();
+    state.sample_key = splitmix64(splitmix64(splitmix64(seed) ^ pixel) ^ sample);
+    state.rng.seed(state.sample_key);
+}
+
+/// <summary>
+/// Reseeds the generator of the calling thread for a bounce of the current sample.
+/// Keying every bounce separately keeps paths decorrelated, and the numbers used at one bounce independent of how many were drawn before.
+/// </summary>
+/// <param name="bounce">= Index of the bounce; 0 is the camera ray.</param>
+inline void random_begin_bounce(uint64_t bounce)
+{
+    RandomState& state = random_state();
+    state.rng.seed(splitmix64(state.sample_key ^ (bounce * 0xD1B54A32D192ED03ull)));
+}
+
+/// <summary>
+/// Gets a uniform random number in [0, 1) from the generator of the calling thread.
+/// </summary>
+/// <returns></returns>
+inline double random_canonical()
+{
+    // Top 53 bits of the generator output fill the mantissa of the double
+    return (random_state().rng.next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,485 @@
+#pragma once
+
+#ifndef SAHBVH_H
+#define SAHBVH_H
+
+#include <algorithm>
+#include <vector>
+
+#include "flatbvh.h"
+#include "primitive.h"
+#include "threadpool.h"
+
+// Parameters of the binned SAH builder
+struct SAHSettings
+{
+    int bins = 16;                  // Number of candidate split bins per axis
+    int max_leaf_size = 4;          // Nodes with more primitives than this are always split
+    double traversal_cost = 1.0;    // Cost of visiting an interior node
+    double intersection_cost = 1.0; // Cost of intersecting a primitive
+
+    // Parallel build (only used when a thread pool is passed to the builder)
+    size_t parallel_subtree_size = 4096;  // Subtrees with at least this many primitives are built as separate tasks
+    size_t parallel_binning_size = 65536; // Nodes with at least this many primitives compute their bounds and bins in parallel
+    size_t binning_chunk_size = 16384;    // Number of primitives per parallel binning task
+};
+
+// An axis-aligned box with plain arrays, cheaper to grow and measure than an aabb of Intervals
+struct BuildBox
+{
+    double min[3] = { INFINITY, INFINITY, INFINITY };
+    double max[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    void grow(const BuildBox& b)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            min[a] = std::min(min[a], b.min[a]);
+            max[a] = std::max(max[a], b.max[a]);
+        }
+    }
+
+    void grow(const double p[3])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            min[a] = std::min(min[a], p[a]);
+            max[a] = std::max(max[a], p[a]);
+        }
+    }
+
+    double surface_area() const
+    {
+        if (min[0] > max[0])
+            return 0;
+
+        double dx = max[0] - min[0];
+        double dy = max[1] - min[1];
+        double dz = max[2] - min[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+/// <summary>
+/// Builds a BVH with the surface area heuristic. Instead of sorting, the primitive centroids are put into a fixed number of bins per axis,
+/// and only the bin boundaries are evaluated as split candidates. Nodes become (multi-primitive) leaves when splitting does not pay off.
+/// The result is written directly in the flattened layout.
+/// With a thread pool, large subtrees are built as tasks and the largest nodes compute their bounds, bins and partition in parallel chunks.
+/// Every parallel result is merged in a fixed order and box unions are exact, so the tree is identical to the serial one.
+/// </summary>
+class SAHBuilder
+{
+    public:
+        SAHSettings settings;
+
+        SAHBuilder(SAHSettings settings = SAHSettings()) : settings(settings) {}
+
+        /// <summary>
+        /// Builds the BVH over a list of primitives.
+        /// </summary>
+        /// <param name="objects">= The primitives; the list itself is not modified.</param>
+        /// <param name="pool">= Thread pool for a parallel build, or nullptr for a serial build.</param>
+        /// <returns>The BVH, with its own reordered copy of the primitive list.</returns>
+        FlatBVH build(const std::vector<shared_ptr<Primitive>>& objects, ThreadPool* pool = nullptr)
+        {
+            settings.bins = std::max(2, settings.bins);
+            settings.max_leaf_size = std::clamp(settings.max_leaf_size, 1, 65535);
+            settings.parallel_subtree_size = std::max<size_t>(2, settings.parallel_subtree_size);
+            settings.binning_chunk_size = std::max<size_t>(1, settings.binning_chunk_size);
+            this->pool = pool != nullptr && pool->size() > 1 ? pool : nullptr;
+
+            refs.resize(objects.size());
+            scratch.resize(objects.size());
+            for_each_chunk(0, refs.size(), [&](size_t, size_t chunk_begin, size_t chunk_end)
+            {
+                for (size_t i = chunk_begin; i < chunk_end; i++)
+                {
+                    aabb box = objects[i]->hitBox();
+                    PrimRef& ref = refs[i];
+                    for (int a = 0; a < 3; a++)
+                    {
+                        ref.box.min[a] = box.axis_interval(a).min;
+                        ref.box.max[a] = box.axis_interval(a).max;
+                        ref.centroid[a] = 0.5 * (ref.box.min[a] + ref.box.max[a]);
+                    }
+                    ref.index = uint32_t(i);
+                }
+            });
+
+            std::vector<FlatBVHNode> nodes;
+            nodes.reserve(2 * objects.size());
+            if (!refs.empty())
+                build_node(nodes, 0, refs.size(), 0);
+
+            std::vector<shared_ptr<Primitive>> ordered(objects.size());
+            for (size_t i = 0; i < refs.size(); i++)
+                ordered[i] = objects[refs[i].index];
+
+            refs.clear();
+            refs.shrink_to_fit();
+            scratch.clear();
+            scratch.shrink_to_fit();
+            this->pool = nullptr;
+
+            return FlatBVH(std::move(nodes), std::move(ordered));
+        }
+
+    private:
+        struct PrimRef
+        {
+            BuildBox box;
+            double centroid[3];
+            uint32_t index;
+        };
+
+        struct Bin
+        {
+            BuildBox box;
+            size_t count = 0;
+        };
+
+        std::vector<PrimRef> refs;
+        std::vector<PrimRef> scratch;   // Target of the partition; subtrees built in parallel use disjoint ranges of it
+        ThreadPool* pool = nullptr;
+
+        /// <summary>
+        /// Checks whether the work over the references begin .. end - 1 is large enough to split into parallel chunks.
+        /// </summary>
+        bool parallel(size_t begin, size_t end) const
+        {
+            return pool != nullptr && end - begin >= settings.parallel_binning_size;
+        }
+
+        size_t num_chunks(size_t begin, size_t end) const
+        {
+            return parallel(begin, end) ? (end - begin + settings.binning_chunk_size - 1) / settings.binning_chunk_size : 1;
+        }
+
+        /// <summary>
+        /// Calls f(chunk, chunk_begin, chunk_end) for consecutive chunks of the range begin .. end - 1.
+        /// Large ranges are split into several chunks that run in parallel; otherwise the whole range is one chunk.
+        /// </summary>
+        template <typename F>
+        void for_each_chunk(size_t begin, size_t end, F f)
+        {
+            if (!parallel(begin, end))
+            {
+                f(0, begin, end);
+                return;
+            }
+
+            TaskGroup group(*pool);
+            for (size_t chunk = 0; chunk < num_chunks(begin, end); chunk++)
+            {
+                size_t chunk_begin = begin + chunk * settings.binning_chunk_size;
+                size_t chunk_end = std::min(end, chunk_begin + settings.binning_chunk_size);
+                group.run([=, &f]() { f(chunk, chunk_begin, chunk_end); });
+            }
+            group.wait();
+        }
+
+        /// <summary>
+        /// Computes the bounds of the primitives and of their centroids over the references begin .. end - 1.
+        /// </summary>
+        void compute_bounds(size_t begin, size_t end, BuildBox& bounds, BuildBox& centroid_bounds)
+        {
+            auto grow_range = [&](size_t range_begin, size_t range_end, BuildBox& b, BuildBox& c)
+            {
+                for (size_t i = range_begin; i < range_end; i++)
+                {
+                    b.grow(refs[i].box);
+                    c.grow(refs[i].centroid);
+                }
+            };
+
+            if (!parallel(begin, end))
+            {
+                grow_range(begin, end, bounds, centroid_bounds);
+                return;
+            }
+
+            std::vector<BuildBox> chunk_bounds(num_chunks(begin, end)), chunk_centroids(num_chunks(begin, end));
+            for_each_chunk(begin, end, [&](size_t chunk, size_t chunk_begin, size_t chunk_end)
+            {
+                grow_range(chunk_begin, chunk_end, chunk_bounds[chunk], chunk_centroids[chunk]);
+            });
+
+            for (size_t chunk = 0; chunk < chunk_bounds.size(); chunk++)
+            {
+                bounds.grow(chunk_bounds[chunk]);
+                centroid_bounds.grow(chunk_centroids[chunk]);
+            }
+        }
+
+        /// <summary>
+        /// Bins the references begin .. end - 1 along all three axes at once. bins[axis * settings.bins + b] is bin b of an axis.
+        /// </summary>
+        void compute_bins(size_t begin, size_t end, const BuildBox& centroid_bounds, std::vector<Bin>& bins)
+        {
+            double scale[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                double extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+                scale[axis] = extent > 0 ? settings.bins / extent : 0;
+            }
+
+            auto bin_range = [&](size_t range_begin, size_t range_end, Bin* local)
+            {
+                for (size_t i = range_begin; i < range_end; i++)
+                {
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        Bin& bin = local[axis * settings.bins + bin_index(refs[i].centroid[axis], centroid_bounds.min[axis], scale[axis])];
+                        bin.box.grow(refs[i].box);
+                        bin.count++;
+                    }
+                }
+            };
+
+            bins.assign(3 * settings.bins, Bin());
+            if (!parallel(begin, end))
+            {
+                bin_range(begin, end, bins.data());
+                return;
+            }
+
+            std::vector<std::vector<Bin>> chunk_bins(num_chunks(begin, end), std::vector<Bin>(bins.size()));
+            for_each_chunk(begin, end, [&](size_t chunk, size_t chunk_begin, size_t chunk_end)
+            {
+                bin_range(chunk_begin, chunk_end, chunk_bins[chunk].data());
+            });
+
+            // Merge the chunks in order; box unions and counts do not depend on it, but this keeps the result obviously deterministic
+            for (const std::vector<Bin>& local : chunk_bins)
+            {
+                for (size_t b = 0; b < bins.size(); b++)
+                {
+                    bins[b].box.grow(local[b].box);
+                    bins[b].count += local[b].count;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Moves the references begin .. end - 1 that go left in front of the others, keeping their order on both sides.
+        /// Every chunk counts its references per side, a prefix sum over the counts gives each chunk its place on both sides,
+        /// and the chunks scatter into the scratch array and copy back in parallel. A serial build runs the same steps as
+        /// one chunk; the partition is stable, so both give the same order.
+        /// </summary>
+        /// <returns>The index of the first reference that goes right.</returns>
+        template <typename Predicate>
+        size_t partition(size_t begin, size_t end, Predicate goes_left)
+        {
+            std::vector<size_t> left_start(num_chunks(begin, end)), right_start(left_start.size());
+            for_each_chunk(begin, end, [&](size_t chunk, size_t chunk_begin, size_t chunk_end)
+            {
+                size_t n = 0;
+                for (size_t i = chunk_begin; i < chunk_end; i++)
+                    n += goes_left(refs[i]);
+                left_start[chunk] = n;
+                right_start[chunk] = chunk_end - chunk_begin - n;
+            });
+
+            // Turn the counts into start positions: the left references of all chunks first, then the right ones
+            size_t mid = begin;
+            for (size_t& start : left_start)
+            {
+                size_t n = start;
+                start = mid;
+                mid += n;
+            }
+            size_t right = mid;
+            for (size_t& start : right_start)
+            {
+                size_t n = start;
+                start = right;
+                right += n;
+            }
+
+            for_each_chunk(begin, end, [&](size_t chunk, size_t chunk_begin, size_t chunk_end)
+            {
+                size_t l = left_start[chunk], r = right_start[chunk];
+                for (size_t i = chunk_begin; i < chunk_end; i++)
+                    scratch[goes_left(refs[i]) ? l++ : r++] = refs[i];
+            });
+            for_each_chunk(begin, end, [&](size_t, size_t chunk_begin, size_t chunk_end)
+            {
+                std::copy(scratch.begin() + chunk_begin, scratch.begin() + chunk_end, refs.begin() + chunk_begin);
+            });
+            return mid;
+        }
+
+        /// <summary>
+        /// Builds the subtree over the primitive references begin .. end - 1 and appends it to a node array in depth-first order.
+        /// Offsets of interior nodes are relative to the start of the array, so subtrees built into separate arrays can be appended later.
+        /// </summary>
+        /// <param name="depth">= The level of the node in the tree, 0 for the root.</param>
+        void build_node(std::vector<FlatBVHNode>& out, size_t begin, size_t end, int depth)
+        {
+            uint32_t index = uint32_t(out.size());
+            out.emplace_back();
+
+            BuildBox bounds, centroid_bounds;
+            compute_bounds(begin, end, bounds, centroid_bounds);
+            out[index].set_bounds(bounds.min, bounds.max);
+
+            size_t count = end - begin;
+            if (count == 1)
+            {
+                make_leaf(out[index], begin, end);
+                return;
+            }
+
+            // Splits that peel off a few primitives at a time can make the tree deeper than the traversal stack of FlatBVH;
+            // a node that has only just enough levels left is split at its median centroid, which halves it every level
+            if (depth + FlatBVH::balanced_depth(count, size_t(settings.max_leaf_size)) >= FlatBVH::max_depth)
+            {
+                if (count <= size_t(settings.max_leaf_size))
+                {
+                    make_leaf(out[index], begin, end);
+                    return;
+                }
+
+                int axis = 0;
+                for (int a = 1; a < 3; a++)
+                    if (centroid_bounds.max[a] - centroid_bounds.min[a] > centroid_bounds.max[axis] - centroid_bounds.min[axis])
+                        axis = a;
+
+                size_t mid = begin + count / 2;
+                std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end, [axis](const PrimRef& a, const PrimRef& b)
+                {
+                    return a.centroid[axis] < b.centroid[axis];
+                });
+                out[index].axis = uint8_t(axis);
+                build_children(out, index, begin, mid, end, depth);
+                return;
+            }
+
+            std::vector<Bin> bins;
+            compute_bins(begin, end, centroid_bounds, bins);
+
+            // Find the cheapest split over all axes and bin boundaries
+            int best_axis = -1;
+            int best_split = 0;
+            double best_cost = INFINITY;
+            std::vector<double> right_area(settings.bins);
+            std::vector<size_t> right_count(settings.bins);
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (centroid_bounds.max[axis] - centroid_bounds.min[axis] <= 0)
+                    continue;
+
+                const Bin* axis_bins = &bins[axis * settings.bins];
+
+                // Sweep from the right to get the area and count of everything right of each boundary
+                BuildBox right;
+                size_t right_n = 0;
+                for (int b = settings.bins - 1; b > 0; b--)
+                {
+                    right.grow(axis_bins[b].box);
+                    right_n += axis_bins[b].count;
+                    right_area[b] = right.surface_area();
+                    right_count[b] = right_n;
+                }
+
+                // Sweep from the left and evaluate the cost of splitting between bin b - 1 and b
+                BuildBox left;
+                size_t left_n = 0;
+                for (int b = 1; b < settings.bins; b++)
+                {
+                    left.grow(axis_bins[b - 1].box);
+                    left_n += axis_bins[b - 1].count;
+                    if (left_n == 0 || right_count[b] == 0)
+                        continue;
+
+                    double cost = left.surface_area() * left_n + right_area[b] * right_count[b];
+                    if (cost < best_cost)
+                    {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
+
+            double area = bounds.surface_area();
+            double leaf_cost = settings.intersection_cost * count;
+            double split_cost = settings.traversal_cost + (area > 0 ? settings.intersection_cost * best_cost / area : leaf_cost);
+
+            // Make a leaf when splitting is not cheaper, as long as the leaf is small enough
+            if (count <= size_t(settings.max_leaf_size) && (best_axis < 0 || leaf_cost <= split_cost))
+            {
+                make_leaf(out[index], begin, end);
+                return;
+            }
+
+            size_t mid;
+            if (best_axis >= 0)
+            {
+                double cmin = centroid_bounds.min[best_axis];
+                double scale = settings.bins / (centroid_bounds.max[best_axis] - cmin);
+                mid = partition(begin, end, [&](const PrimRef& ref)
+                {
+                    return bin_index(ref.centroid[best_axis], cmin, scale) < best_split;
+                });
+            }
+            else
+            {
+                // All centroids are in the same spot, so any split is as good as another: cut the range in half
+                best_axis = 0;
+                mid = begin + count / 2;
+            }
+
+            out[index].axis = uint8_t(best_axis);
+            build_children(out, index, begin, mid, end, depth);
+        }
+
+        /// <summary>
+        /// Builds the two subtrees of an interior node, begin .. mid - 1 and mid .. end - 1, on separate threads if they are large enough.
+        /// </summary>
+        void build_children(std::vector<FlatBVHNode>& out, uint32_t index, size_t begin, size_t mid, size_t end, int depth)
+        {
+            if (pool != nullptr && end - begin >= settings.parallel_subtree_size)
+            {
+                // The left subtree goes straight into this array on another thread, while this thread builds the right
+                // subtree into its own array. The right array is appended afterwards, which gives the serial layout.
+                std::vector<FlatBVHNode> right_nodes;
+                right_nodes.reserve(2 * (end - mid));
+
+                TaskGroup group(*pool);
+                group.run([&]() { build_node(out, begin, mid, depth + 1); });
+                build_node(right_nodes, mid, end, depth + 1);
+                group.wait();
+
+                uint32_t right_index = uint32_t(out.size());
+                out[index].offset = right_index;
+                for (FlatBVHNode node : right_nodes)
+                {
+                    if (!node.is_leaf())
+                        node.offset += right_index;
+                    out.push_back(node);
+                }
+            }
+            else
+            {
+                build_node(out, begin, mid, depth + 1);
+                out[index].offset = uint32_t(out.size());
+                build_node(out, mid, end, depth + 1);
+            }
+        }
+
+        static void make_leaf(FlatBVHNode& node, size_t begin, size_t end)
+        {
+            node.offset = uint32_t(begin);
+            node.count = uint16_t(end - begin);
+        }
+
+        int bin_index(double centroid, double cmin, double scale) const
+        {
+            int b = int((centroid - cmin) * scale);
+            return std::clamp(b, 0, settings.bins - 1);
+        }
+};
+
+#endif
@@ -0,0 +1,182 @@
+#pragma once
+
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "camera.h"
+#include "instance.h"
+#include "material.h"
+#include "parseobj.h"
+#include "rng.h"
+#include "sahbvh.h"
+#include "sphere.h"
+#include "transform.h"
+#include "triangle.h"
+#include "trianglemesh.h"
+#include "world.h"
+
+using ParsedMesh = std::tuple<std::vector<Point3>, std::vector<Vec3>, std::vector<Point3>, std::vector<shared_ptr<Lambertian>>>;
+
+/// <summary>
+/// Adds all triangles of a parsed mesh to the world, as the faces of one TriangleMesh.
+/// </summary>
+/// <param name="parsed">= The result of Parser::parse.</param>
+/// <param name="world">= The world the triangles are added to.</param>
+inline void add_mesh(const ParsedMesh& parsed, World& world)
+{
+    const auto& [vertices, _, faces, materials] = parsed;
+
+    auto mesh = make_shared<TriangleMesh>();
+    for (const Point3& vertex : vertices)
+        mesh->add_vertex(vertex);
+
+    // The indices in the file start at 1
+    for (int face_index = 0; face_index < faces.size(); face_index++)
+    {
+        Point3 face = faces[face_index];
+        mesh->add_face(uint32_t(face.x() - 1), uint32_t(face.y() - 1), uint32_t(face.z() - 1), mesh->add_material(materials[face_index]));
+    }
+
+    TriangleMesh::add_faces(mesh, world);
+}
+
+/// <summary>
+/// Adds all triangles of a parsed mesh to the world as separate Triangle objects, in double precision.
+/// </summary>
+/// <param name="parsed">= The result of Parser::parse.</param>
+/// <param name="world">= The world the triangles are added to.</param>
+inline void add_triangles(const ParsedMesh& parsed, World& world)
+{
+    const auto& [vertices, _, faces, materials] = parsed;
+
+    // Load all triangles in the mesh
+    for (int face_index = 0; face_index < faces.size(); face_index++)
+    {
+        Point3 face = faces[face_index];
+        double p_index_a = face.x() - 1;
+        double p_index_b = face.y() - 1;
+        double p_index_c = face.z() - 1;
+
+        Point3 a = vertices[p_index_a];
+        Point3 b = vertices[p_index_b];
+        Point3 c = vertices[p_index_c];
+
+        world.add(Triangle::from_corners(a, b, c, materials[face_index]));
+    }
+}
+
+/// <summary>
+/// Places a grid of randomly rotated, scaled and colored copies of a mesh on a ground sphere. The mesh is stored once, in a
+/// bottom-level BVH; every copy is an Instance of it, so the acceleration structure the camera builds over the world is the top level.
+/// </summary>
+/// <param name="parsed">= The mesh.</param>
+/// <param name="rows">= The number of copies along each side of the grid.</param>
+/// <param name="cam">= The camera that is positioned to look at the grid.</param>
+/// <param name="world">= The world the instances are added to.</param>
+inline void add_instance_grid(const ParsedMesh& parsed, int rows, Camera& cam, World& world)
+{
+    World mesh;
+    add_mesh(parsed, mesh);
+    if (mesh.objects.empty())
+        return;
+
+    auto blas = make_shared<FlatBVH>(SAHBuilder(Camera::sah_settings()).build(mesh.objects));
+
+    // Put the mesh with the middle of its bottom at the origin, scaled to a height of 1
+    aabb box = mesh.hitBox();
+    Transform to_origin = Transform::scale(1.0 / box.y.size()) * Transform::translate(Vec3(-0.5 * (box.x.min + box.x.max), -box.y.min, -0.5 * (box.z.min + box.z.max)));
+    double spacing = 1.5 * std::max(box.x.size(), box.z.size()) / box.y.size();
+
+    std::vector<shared_ptr<Material>> overrides = {
+        nullptr,
+        make_shared<Lambertian>(Vec3(0.8, 0.3, 0.3)),
+        make_shared<Lambertian>(Vec3(0.3, 0.8, 0.3)),
+        make_shared<Lambertian>(Vec3(0.3, 0.3, 0.8)),
+        make_shared<Metal>(Vec3(0.8, 0.8, 0.8), 0.1),
+    };
+
+    // A fixed seed, so the scene is the same every time
+    Xoshiro256pp rng(42);
+    auto uniform = [&]() { return (rng.next() >> 11) * (1.0 / 9007199254740992.0); };
+
+    double half = 0.5 * (rows - 1) * spacing;
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < rows; j++)
+        {
+            Vec3 position(i * spacing - half, 0, j * spacing - half);
+            Transform placement = Transform::translate(position) * Transform::rotate(Vec3(0, 1, 0), 360 * uniform()) * Transform::scale(0.7 + 0.5 * uniform());
+            world.add(make_shared<Instance>(blas, placement * to_origin, overrides[rng.next() % overrides.size()]));
+        }
+    }
+
+    world.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, make_shared<Lambertian>(Vec3(0.5, 0.5, 0.5))));
+
+    cam.cam_pos = Point3(0, 0.35 * half + 2, half + 4);
+    cam.cam_dir = Point3(0, 0, 0.2 * half);
+
+    std::cout << "Placed " << rows * rows << " instances of " << mesh.objects.size() << " triangles (" << rows * rows * mesh.objects.size()
+              << " triangles in total, " << blas->nodes.size() << " BLAS nodes stored once)\n";
+}
+
+/// <summary>
+/// Loads one of the test scenes into the world and positions the camera for it.
+/// </summary>
+/// <param name="test">= The number of the scene (1: Bunny1, 2: Bunny2, 3: Bunny3, 4: Stack, 5: Colored stack, 6: UU, 7: Bunny field).</param>
+/// <param name="cam">= The camera that is positioned for the scene.</param>
+/// <param name="world">= The world the primitives of the scene are added to.</param>
+inline void load_scene(int test, Camera& cam, World& world)
+{
+    Parser parser;
+    ParsedMesh parsed;
+
+    switch (test)
+    {
+        case 1:
+            parsed = parser.parse("bunny.obj", Point3(0.4, -0.75, -2.75));
+            cam.cam_pos = Point3(0, 0, 0);
+            cam.cam_dir = Point3(0, 0, -1);
+            break;
+
+        case 2:
+            parsed = parser.parse("bunny.obj", Point3(0.4, -0.75, -2.75));
+            cam.cam_pos = Point3(0, 0, 0);
+            cam.cam_dir = Point3(-1, 0, 0);
+            break;
+
+        case 3:
+            parsed = parser.parse("bunny.obj", Point3(2.75, -0.75, 0));
+            cam.cam_pos = Point3(0, 0, 0);
+            cam.cam_dir = Point3(0, 0, 0);
+            break;
+
+        case 4:
+            parsed = parser.parse("stack.obj", Point3(0, 0, 0));
+            cam.cam_pos = Point3(0, 3, 10);
+            cam.cam_dir = Point3(-1, 0, -1);
+            break;
+
+        case 5:
+            parsed = parser.parse("stackcolor.obj", Point3(0, 0, 0));
+            cam.cam_pos = Point3(0, 4, 20);
+            cam.cam_dir = Point3(-1, 0, -1);
+            break;
+
+        case 6:
+            parsed = parser.parse("UU.obj", Point3(0, 0, 0));
+            cam.cam_pos = Point3(40, 0, 0);
+            cam.cam_dir = Point3(-1, 0, 0);
+            break;
+
+        case 7:
+            // 32 x 32 instances of the bunny
+            add_instance_grid(parser.parse("bunny.obj", Point3(0, 0, 0)), 32, cam, world);
+            return;
+
+        default: break;
+    }
+
+    add_mesh(parsed, world);
+}
+
+#endif
@@ -5,10 +5,10 @@
 
 #include "primitive.h"
 
-class Sphere : public Primitive
+class Sphere final : public Primitive
 {
 	public:
-		Sphere(const Point3& center, double radius, shared_ptr<Material> mat) : center(center), radius(std::fmax(0, radius)),mat(mat)
+		Sphere(const Point3& center, double radius, shared_ptr<Material> mat) : center(center), radius(std::fmax(0, radius)),mat(MaterialTable::add(mat))
 		{
 			auto rvec = Vec3(radius, radius, radius);
 			//auto len = center - rvec;
@@ -48,22 +48,27 @@ class Sphere : public Primitive
 			}
 
 			// At this point, there is a valid intersection between the ray and the primitive
-			// Set face normal and return true
 			rec.t = root;
-			rec.p = r.at(rec.t);
-			Vec3 outward_normal = (rec.p - center) / radius;
-			rec.set_face_normal(r, outward_normal);
-			rec.mat = mat;
+			rec.primitive = this;
+			rec.instance = nullptr;
+			rec.material = mat;
 
 			return true;
 		}
 
+		void surface(const Ray& r, const Hit_record& rec, Surface& s) const override
+		{
+			s.p = r.at(rec.t);
+			Vec3 outward_normal = (s.p - center) / radius;
+			s.set_face_normal(r, outward_normal);
+		}
+
 		aabb hitBox() const override { return boundingbox; }
 
 	private:
 		Point3 center;
 		double radius;
-		shared_ptr<Material> mat;
+		uint32_t mat;
 		aabb boundingbox;
 };
 
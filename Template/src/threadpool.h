@@ -0,0 +1,272 @@
+#pragma once
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// A fixed-size pool of worker threads that runs tasks.
+/// Every worker owns a queue of tasks. A worker first drains its own queue from the front,
+/// and when it runs dry it steals tasks from the back of the other queues, so expensive tasks
+/// (for example tiles with a lot of glass) do not leave the other threads idle.
+/// The thread that created the pool counts as worker 0 and helps out while it waits.
+/// </summary>
+class ThreadPool
+{
+    public:
+        /// <summary>
+        /// Creates a pool with a certain number of threads.
+        /// </summary>
+        /// <param name="num_threads">= The number of worker threads (including the calling thread); 0 means one thread per hardware thread.</param>
+        explicit ThreadPool(unsigned int num_threads = 0)
+        {
+            if (num_threads == 0)
+                num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+            this->num_threads = num_threads;
+            queues = std::vector<WorkQueue>(num_threads);
+
+            for (unsigned int worker = 1; worker < num_threads; worker++)
+                threads.emplace_back([this, worker]() { worker_loop(worker); });
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                stop = true;
+            }
+            wake.notify_all();
+
+            for (auto& thread : threads)
+                thread.join();
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /// <summary>
+        /// Gets the number of worker threads of the pool.
+        /// </summary>
+        /// <returns></returns>
+        unsigned int size() const { return num_threads; }
+
+        /// <summary>
+        /// Gets the index of the worker that runs the calling code: 1 .. size() - 1 for pool threads, 0 for any other thread.
+        /// </summary>
+        unsigned int worker_index() const
+        {
+            return current_pool() == this ? current_worker() : 0;
+        }
+
+        /// <summary>
+        /// Queues a task on the queue of the calling worker.
+        /// </summary>
+        void submit(std::function<void()> task)
+        {
+            submit_to(worker_index(), std::move(task));
+        }
+
+        /// <summary>
+        /// Runs one queued task (preferably from the queue of the calling worker) if there is any.
+        /// </summary>
+        /// <returns>false if there was no task to run.</returns>
+        bool run_one()
+        {
+            std::function<void()> task;
+            if (!next_task(worker_index(), task))
+                return false;
+
+            task();
+            return true;
+        }
+
+        /// <summary>
+        /// Runs the jobs 0 .. num_jobs - 1 on the worker threads and waits until all of them are finished.
+        /// </summary>
+        /// <param name="num_jobs">= The number of jobs.</param>
+        /// <param name="job">= Function that is called as job(job_index, worker_index).</param>
+        template <typename Job>
+        void run(size_t num_jobs, Job job);
+
+    private:
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        unsigned int num_threads;
+        std::vector<WorkQueue> queues;
+        std::vector<std::thread> threads;
+
+        std::atomic<size_t> queued = 0;
+        bool stop = false;
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+
+        static const ThreadPool*& current_pool()
+        {
+            thread_local const ThreadPool* pool = nullptr;
+            return pool;
+        }
+
+        static unsigned int& current_worker()
+        {
+            thread_local unsigned int worker = 0;
+            return worker;
+        }
+
+        void submit_to(unsigned int worker, std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(queues[worker].mutex);
+                queues[worker].tasks.push_back(std::move(task));
+            }
+            queued++;
+
+            // Taking the sleep lock makes sure a worker that is about to sleep sees the new task
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+            }
+            wake.notify_one();
+        }
+
+        /// <summary>
+        /// Gets the next task for a worker: first from its own queue, otherwise stolen from another queue.
+        /// </summary>
+        /// <returns>false if there are no tasks left anywhere.</returns>
+        bool next_task(unsigned int worker, std::function<void()>& task)
+        {
+            if (queued == 0)
+                return false;
+
+            {
+                WorkQueue& own = queues[worker];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.tasks.empty())
+                {
+                    task = std::move(own.tasks.front());
+                    own.tasks.pop_front();
+                    queued--;
+                    return true;
+                }
+            }
+
+            for (unsigned int i = 1; i < num_threads; i++)
+            {
+                WorkQueue& victim = queues[(worker + i) % num_threads];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tasks.empty())
+                {
+                    task = std::move(victim.tasks.back());
+                    victim.tasks.pop_back();
+                    queued--;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void worker_loop(unsigned int worker)
+        {
+            current_pool() = this;
+            current_worker() = worker;
+
+            while (true)
+            {
+                std::function<void()> task;
+                if (next_task(worker, task))
+                {
+                    task();
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(sleep_mutex);
+                wake.wait(lock, [this]() { return stop || queued > 0; });
+                if (stop)
+                    return;
+            }
+        }
+
+        friend class TaskGroup;
+};
+
+/// <summary>
+/// A set of tasks on a thread pool that can be waited for. While waiting, the waiting thread runs queued tasks itself,
+/// so task groups can be nested (a task may start and wait for its own subtasks) without running out of threads.
+/// </summary>
+class TaskGroup
+{
+    public:
+        explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+
+        ~TaskGroup() { wait(); }
+
+        /// <summary>
+        /// Starts a task of the group.
+        /// </summary>
+        template <typename Task>
+        void run(Task task)
+        {
+            run_on(pool.worker_index(), std::move(task));
+        }
+
+        /// <summary>
+        /// Waits until all tasks of the group are finished.
+        /// </summary>
+        void wait()
+        {
+            while (pending > 0)
+            {
+                if (!pool.run_one())
+                    std::this_thread::yield();
+            }
+        }
+
+    private:
+        ThreadPool& pool;
+        std::atomic<size_t> pending = 0;
+
+        template <typename Task>
+        void run_on(unsigned int worker, Task task)
+        {
+            pending++;
+            pool.submit_to(worker, [this, task = std::move(task)]() mutable
+            {
+                task();
+                pending--;
+            });
+        }
+
+        friend class ThreadPool;
+};
+
+template <typename Job>
+void ThreadPool::run(size_t num_jobs, Job job)
+{
+    TaskGroup group(*this);
+
+    // Hand out contiguous blocks of jobs, so neighbouring jobs start out on the same thread
+    for (unsigned int worker = 0; worker < num_threads; worker++)
+    {
+        size_t begin = num_jobs * worker / num_threads;
+        size_t end = num_jobs * (worker + 1) / num_threads;
+        for (size_t i = begin; i < end; i++)
+            group.run_on(worker, [this, &job, i]() { job(i, worker_index()); });
+    }
+
+    group.wait();
+}
+
+#endif
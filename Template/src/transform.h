@@ -0,0 +1,167 @@
+#pragma once
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "aabb.h"
+#include "common.h"
+#include "vec3.h"
+
+// An affine transformation: a 3x3 matrix (rotation, scale, shear) followed by a translation, stored as the top three rows of a 4x4 matrix
+class Transform
+{
+    public:
+        double m[3][4];
+
+        /// <summary>
+        /// Creates the identity transformation.
+        /// </summary>
+        Transform()
+        {
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 4; j++)
+                    m[i][j] = i == j ? 1 : 0;
+        }
+
+        static Transform translate(const Vec3& offset)
+        {
+            Transform t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = offset[i];
+            return t;
+        }
+
+        static Transform scale(const Vec3& factors)
+        {
+            Transform t;
+            for (int i = 0; i < 3; i++)
+                t.m[i][i] = factors[i];
+            return t;
+        }
+
+        static Transform scale(double factor) { return scale(Vec3(factor, factor, factor)); }
+
+        /// <summary>
+        /// Creates a rotation around an axis through the origin.
+        /// </summary>
+        /// <param name="axis">= The axis of rotation; does not need to be normalized.</param>
+        /// <param name="degrees">= The angle of rotation, counterclockwise when looking along the axis towards the origin.</param>
+        static Transform rotate(const Vec3& axis, double degrees)
+        {
+            Vec3 a = unit_vector(axis);
+            double s = std::sin(degrees_to_radians(degrees));
+            double c = std::cos(degrees_to_radians(degrees));
+
+            Transform t;
+            t.m[0][0] = a.x() * a.x() * (1 - c) + c;
+            t.m[0][1] = a.x() * a.y() * (1 - c) - a.z() * s;
+            t.m[0][2] = a.x() * a.z() * (1 - c) + a.y() * s;
+            t.m[1][0] = a.y() * a.x() * (1 - c) + a.z() * s;
+            t.m[1][1] = a.y() * a.y() * (1 - c) + c;
+            t.m[1][2] = a.y() * a.z() * (1 - c) - a.x() * s;
+            t.m[2][0] = a.z() * a.x() * (1 - c) - a.y() * s;
+            t.m[2][1] = a.z() * a.y() * (1 - c) + a.x() * s;
+            t.m[2][2] = a.z() * a.z() * (1 - c) + c;
+            return t;
+        }
+
+        /// <summary>
+        /// Combines two transformations: (a * b) first applies b, then a.
+        /// </summary>
+        Transform operator*(const Transform& b) const
+        {
+            Transform t;
+            for (int i = 0; i < 3; i++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    t.m[i][j] = (j == 3 ? m[i][3] : 0);
+                    for (int k = 0; k < 3; k++)
+                        t.m[i][j] += m[i][k] * b.m[k][j];
+                }
+            }
+            return t;
+        }
+
+        /// <summary>
+        /// Gets the inverse transformation. The transformation has to be invertible (no zero scale).
+        /// </summary>
+        Transform inverse() const
+        {
+            // Inverse of the 3x3 part with cofactors
+            double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+            double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+            double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+            double inv_det = 1.0 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+            Transform t;
+            t.m[0][0] = c00 * inv_det;
+            t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+            t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+            t.m[1][0] = c01 * inv_det;
+            t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+            t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+            t.m[2][0] = c02 * inv_det;
+            t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+            t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+            // The inverse translation is the original translation, transformed back and negated
+            for (int i = 0; i < 3; i++)
+                t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+            return t;
+        }
+
+        Point3 point(const Point3& p) const
+        {
+            return Point3(
+                m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+        }
+
+        Vec3 vector(const Vec3& v) const
+        {
+            return Vec3(
+                m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+        }
+
+        /// <summary>
+        /// Multiplies a vector with the transpose of the 3x3 part. Normals transform with the transpose of the inverse,
+        /// so calling this on the inverse transformation transforms a normal (the result is not normalized).
+        /// </summary>
+        Vec3 transposed_vector(const Vec3& v) const
+        {
+            return Vec3(
+                m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+        }
+
+        /// <summary>
+        /// Gets the bounding box of a transformed box (Arvo, "Transforming axis-aligned bounding boxes").
+        /// </summary>
+        aabb box(const aabb& b) const
+        {
+            Interval result[3];
+            for (int i = 0; i < 3; i++)
+            {
+                double lo = m[i][3], hi = m[i][3];
+                for (int j = 0; j < 3; j++)
+                {
+                    double e = m[i][j] * b.axis_interval(j).min;
+                    double f = m[i][j] * b.axis_interval(j).max;
+                    lo += std::min(e, f);
+                    hi += std::max(e, f);
+                }
+                result[i] = Interval(lo, hi);
+            }
+            return aabb(result[0], result[1], result[2]);
+        }
+};
+
+#endif
@@ -9,31 +9,63 @@
 #include <cmath>
 #include <memory>
 
+#include "configuration.hpp"
 #include "primitive.h"
-#include "Vec3.h"
+#include "vec3.h"
+#include "watertight.h"
 
-class Triangle : public Primitive
+class Triangle final : public Primitive
 {
     public:
         Triangle(const Point3& Q, const Vec3& u, const Vec3& v, shared_ptr<Material> mat)
-        : Q(Q), u(u), v(v), mat(mat)
+        : Q(Q), u(u), v(v), mat(MaterialTable::add(mat))
         {
-            auto n = cross(u, v);
-            normal = unit_vector(n);
-            D = dot(normal, Q);
-            w = n / dot(n, n);
+            set_corners(Q, Q + u, Q + v);
+            update_plane();
+            set_bounding_box();
+        }
+
+        /// <summary>
+        /// Creates a triangle from its corners. Unlike the constructor, the corners are kept exactly as given, so the watertight
+        /// test sees the same edge in two triangles that share it.
+        /// </summary>
+        static shared_ptr<Triangle> from_corners(const Point3& a, const Point3& b, const Point3& c, shared_ptr<Material> mat)
+        {
+            auto triangle = make_shared<Triangle>(a, b - a, c - a, mat);
+            triangle->set_vertices(a, b, c);
+            return triangle;
+        }
 
+        /// <summary>
+        /// Moves the corners of the triangle. The bounding volumes that contain it have to be refitted (or rebuilt) afterwards.
+        /// </summary>
+        void set_vertices(const Point3& a, const Point3& b, const Point3& c)
+        {
+            Q = a;
+            u = b - a;
+            v = c - a;
+
+            set_corners(a, b, c);
+            update_plane();
             set_bounding_box();
         }
 
+        /// <summary>
+        /// Gets a corner of the triangle (0, 1 or 2).
+        /// </summary>
+        Point3 vertex(int i) const
+        {
+            return Point3(corners[i][0], corners[i][1], corners[i][2]);
+        }
+
         virtual void set_bounding_box()
         {
             //auto d1 = aabb(Q, Q + u + v);
             //auto d2 = aabb(Q + u, Q + v);
             //box = aabb(d1, d2);
 
-            Vec3 p1 = Q + u;
-            Vec3 p2 = Q + v;
+            Vec3 p1 = vertex(1);
+            Vec3 p2 = vertex(2);
 
             double minx = std::min({ Q.x(), p1.x(), p2.x() });
             double miny = std::min({ Q.y(), p1.y(), p2.y() });
@@ -50,7 +82,18 @@ class Triangle : public Primitive
 
         bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
         {
-            rec.intersection_tests += 1;
+            trace_stats().intersection_tests++;
+
+            if (conf::watertight_triangles)
+            {
+                WatertightHit h;
+                if (!watertight_hit(r, corners[0], corners[1], corners[2], ray_t, h))
+                    return false;
+
+                set_hit(rec, h.t, h.b1, h.b2);
+                return true;
+            }
+
             auto denom = dot(normal, r.direction());
 
             if (std::fabs(denom) < 1e-8) return false;
@@ -66,14 +109,16 @@ class Triangle : public Primitive
             if (!is_interior(a, b, rec))
                 return false;
 
-            rec.t = t;
-            rec.p = intersection;
-            rec.mat = mat;
-            rec.set_face_normal(r, normal);
-
+            set_hit(rec, t, a, b);
             return true;
         }
 
+        void surface(const Ray& r, const Hit_record& rec, Surface& s) const override
+        {
+            s.p = r.at(rec.t);
+            s.set_face_normal(r, normal);
+        }
+
         virtual bool is_interior(double a, double b, Hit_record& rec) const
         {
             Interval unit_interval = Interval(0, 1);
@@ -85,12 +130,41 @@ class Triangle : public Primitive
         }
 
     private:
+        void set_hit(Hit_record& rec, double t, double a, double b) const
+        {
+            rec.t = t;
+            rec.u = a;
+            rec.v = b;
+            rec.primitive = this;
+            rec.instance = nullptr;
+            rec.material = mat;
+        }
+
+        void set_corners(const Point3& a, const Point3& b, const Point3& c)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                corners[0][i] = a[i];
+                corners[1][i] = b[i];
+                corners[2][i] = c[i];
+            }
+        }
+
+        void update_plane()
+        {
+            auto n = cross(u, v);
+            normal = unit_vector(n);
+            D = dot(normal, Q);
+            w = n / dot(n, n);
+        }
+
         Point3 Q;
         Vec3 u,v;
         Vec3 w;
-        shared_ptr<Material> mat;
+        uint32_t mat;
         Vec3 normal;
         double D;
+        double corners[3][3]; // The corners as given, for the watertight test
 
         aabb box;
 };
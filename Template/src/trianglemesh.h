@@ -0,0 +1,294 @@
+#pragma once
+
+#ifndef TRIANGLEMESH_H
+#define TRIANGLEMESH_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+#include "configuration.hpp"
+#include "primitive.h"
+#include "triangle.h"
+#include "watertight.h"
+#include "world.h"
+
+class TriangleMesh;
+
+/// <summary>
+/// One face of a TriangleMesh. It only holds the mesh and the index of the face, so the acceleration structures can treat the
+/// faces as primitives while the geometry stays in the arrays of the mesh. The faces are stored in the mesh, not allocated one by one.
+/// </summary>
+class MeshTriangle final : public Primitive
+{
+    public:
+        MeshTriangle(TriangleMesh* mesh, uint32_t face) : mesh(mesh), face(face) {}
+
+        bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override;
+
+        aabb hitBox() const override;
+
+        void surface(const Ray& r, const Hit_record& rec, Surface& s) const override;
+
+        TriangleMesh& triangle_mesh() const { return *mesh; }
+
+        uint32_t face_index() const { return face; }
+
+    private:
+        TriangleMesh* mesh;
+        uint32_t face;
+};
+
+/// <summary>
+/// A triangle mesh with shared vertex and index buffers, and a material index per face. Besides the vertices, every face keeps the data
+/// for the intersection test (its first corner and two edges) in structure-of-arrays float arrays, so a loop over faces reads
+/// consecutive memory. With its entry in the primitive list, a face costs about 100 bytes, against about 230 bytes for a separate Triangle object.
+/// The geometry is stored in single precision. The watertight test (the default) reads the shared vertices, so neighbouring faces
+/// see the same edges and rays cannot slip between them; the Moeller-Trumbore test reads the per-face arrays and runs in double precision.
+/// </summary>
+class TriangleMesh
+{
+    public:
+        // Shared vertex positions
+        std::vector<float> px, py, pz;
+
+        // Three vertex indices per face, and the index of the material of every face in the MaterialTable
+        std::vector<uint32_t> indices;
+        std::vector<uint32_t> face_material;
+
+        // Precomputed per face: the first corner v0, and the edges e1 = v1 - v0 and e2 = v2 - v0
+        std::vector<float> v0x, v0y, v0z;
+        std::vector<float> e1x, e1y, e1z;
+        std::vector<float> e2x, e2y, e2z;
+
+        uint32_t add_vertex(const Point3& p)
+        {
+            px.push_back(float(p.x()));
+            py.push_back(float(p.y()));
+            pz.push_back(float(p.z()));
+            return uint32_t(px.size() - 1);
+        }
+
+        /// <summary>
+        /// Adds a material to the MaterialTable, or finds it if it is already there.
+        /// </summary>
+        /// <returns>The index of the material, for add_face.</returns>
+        uint32_t add_material(const shared_ptr<Material>& material)
+        {
+            return MaterialTable::add(material);
+        }
+
+        /// <summary>
+        /// Adds a face. The intersection data is computed by update(), or by add_faces.
+        /// </summary>
+        /// <param name="a">= The index of the first vertex.</param>
+        /// <param name="b">= The index of the second vertex.</param>
+        /// <param name="c">= The index of the third vertex.</param>
+        /// <param name="material">= The index of the material, from add_material.</param>
+        void add_face(uint32_t a, uint32_t b, uint32_t c, uint32_t material)
+        {
+            indices.insert(indices.end(), { a, b, c });
+            face_material.push_back(material);
+        }
+
+        size_t num_faces() const { return face_material.size(); }
+
+        size_t num_vertices() const { return px.size(); }
+
+        Point3 position(uint32_t vertex) const { return Point3(px[vertex], py[vertex], pz[vertex]); }
+
+        /// <summary>
+        /// Moves a vertex. update() has to be called afterwards, and the bounding volumes that contain the mesh refitted (or rebuilt).
+        /// </summary>
+        void set_position(uint32_t vertex, const Point3& p)
+        {
+            px[vertex] = float(p.x());
+            py[vertex] = float(p.y());
+            pz[vertex] = float(p.z());
+        }
+
+        /// <summary>
+        /// Recomputes the intersection data of every face from the vertices.
+        /// </summary>
+        void update()
+        {
+            size_t n = num_faces();
+            for (auto* a : { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z })
+                a->resize(n);
+
+            for (size_t f = 0; f < n; f++)
+            {
+                uint32_t a = indices[3 * f], b = indices[3 * f + 1], c = indices[3 * f + 2];
+                v0x[f] = px[a];
+                v0y[f] = py[a];
+                v0z[f] = pz[a];
+                e1x[f] = px[b] - px[a];
+                e1y[f] = py[b] - py[a];
+                e1z[f] = pz[b] - pz[a];
+                e2x[f] = px[c] - px[a];
+                e2y[f] = py[c] - py[a];
+                e2z[f] = pz[c] - pz[a];
+            }
+        }
+
+        /// <summary>
+        /// Gets a corner of a face (0, 1 or 2).
+        /// </summary>
+        Point3 vertex(uint32_t face, int i) const
+        {
+            return position(indices[3 * face + i]);
+        }
+
+        aabb face_box(uint32_t face) const
+        {
+            Point3 a = vertex(face, 0), b = vertex(face, 1), c = vertex(face, 2);
+            return aabb(Interval(std::min({ a.x(), b.x(), c.x() }), std::max({ a.x(), b.x(), c.x() })),
+                        Interval(std::min({ a.y(), b.y(), c.y() }), std::max({ a.y(), b.y(), c.y() })),
+                        Interval(std::min({ a.z(), b.z(), c.z() }), std::max({ a.z(), b.z(), c.z() })));
+        }
+
+        /// <summary>
+        /// Intersects a ray with one face, with the watertight test or Moeller-Trumbore (conf::watertight_triangles).
+        /// Like Triangle::hit, the normal faces the ray.
+        /// </summary>
+        /// <param name="face">= The index of the face.</param>
+        /// <param name="r">= The ray that is being traced.</param>
+        /// <param name="ray_t">= The interval of distances where the intersection is valid.</param>
+        /// <param name="rec">= The hit record, only written when the face is hit.</param>
+        bool hit(uint32_t face, const Ray& r, Interval ray_t, Hit_record& rec) const
+        {
+            trace_stats().intersection_tests++;
+
+            if (conf::watertight_triangles)
+                return hit_watertight(face, r, ray_t, rec);
+
+            const Vec3 e1(e1x[face], e1y[face], e1z[face]);
+            const Vec3 e2(e2x[face], e2y[face], e2z[face]);
+            const Vec3 p = cross(r.direction(), e2);
+            double det = dot(e1, p);
+            if (det == 0)
+                return false;
+
+            double inv_det = 1 / det;
+            const Vec3 s = r.origin() - Point3(v0x[face], v0y[face], v0z[face]);
+            double a = dot(s, p) * inv_det;
+            if (a < 0 || a > 1)
+                return false;
+
+            const Vec3 q = cross(s, e1);
+            double b = dot(r.direction(), q) * inv_det;
+            if (b < 0 || a + b > 1)
+                return false;
+
+            double t = dot(e2, q) * inv_det;
+            if (!ray_t.contains(t))
+                return false;
+
+            set_hit(face, rec, t, a, b);
+            return true;
+        }
+
+        /// <summary>
+        /// Reconstructs the position and normal of a hit on a face.
+        /// </summary>
+        void surface(uint32_t face, const Ray& r, const Hit_record& rec, Surface& s) const
+        {
+            s.p = r.at(rec.t);
+            s.set_face_normal(r, unit_vector(cross(Vec3(e1x[face], e1y[face], e1z[face]), Vec3(e2x[face], e2y[face], e2z[face]))));
+        }
+
+        /// <summary>
+        /// Gets the memory used by the mesh, its faces included, in bytes.
+        /// </summary>
+        size_t memory_bytes() const
+        {
+            return 3 * px.size() * sizeof(float) + indices.size() * sizeof(uint32_t) + face_material.size() * sizeof(uint32_t)
+                 + 9 * v0x.size() * sizeof(float) + faces.size() * sizeof(MeshTriangle);
+        }
+
+        /// <summary>
+        /// Computes the intersection data and adds every face of the mesh to the world. The faces share the ownership of the mesh,
+        /// so the mesh lives as long as any of them; there is no allocation per face. The mesh must not get new faces afterwards.
+        /// </summary>
+        static void add_faces(const shared_ptr<TriangleMesh>& mesh, World& world)
+        {
+            mesh->update();
+            mesh->faces.clear();
+            mesh->faces.reserve(mesh->num_faces());
+            for (uint32_t f = 0; f < mesh->num_faces(); f++)
+                mesh->faces.emplace_back(mesh.get(), f);
+
+            for (auto& face : mesh->faces)
+                world.add(shared_ptr<Primitive>(mesh, &face));
+        }
+
+    private:
+        std::vector<MeshTriangle> faces;
+
+        bool hit_watertight(uint32_t face, const Ray& r, Interval ray_t, Hit_record& rec) const
+        {
+            uint32_t ia = indices[3 * face], ib = indices[3 * face + 1], ic = indices[3 * face + 2];
+            const float a[3] = { px[ia], py[ia], pz[ia] };
+            const float b[3] = { px[ib], py[ib], pz[ib] };
+            const float c[3] = { px[ic], py[ic], pz[ic] };
+
+            WatertightHit h;
+            if (!watertight_hit(r, a, b, c, ray_t, h))
+                return false;
+
+            set_hit(face, rec, h.t, h.b1, h.b2);
+            return true;
+        }
+
+        void set_hit(uint32_t face, Hit_record& rec, double t, double u, double v) const
+        {
+            rec.t = t;
+            rec.u = u;
+            rec.v = v;
+            rec.primitive = &faces[face];
+            rec.instance = nullptr;
+            rec.material = face_material[face];
+        }
+};
+
+inline bool MeshTriangle::hit(const Ray& r, Interval ray_t, Hit_record& rec) const
+{
+    return mesh->hit(face, r, ray_t, rec);
+}
+
+inline aabb MeshTriangle::hitBox() const
+{
+    return mesh->face_box(face);
+}
+
+inline void MeshTriangle::surface(const Ray& r, const Hit_record& rec, Surface& s) const
+{
+    mesh->surface(face, r, rec, s);
+}
+
+/// <summary>
+/// Gets the corners of a primitive that is a triangle, either a Triangle or a face of a TriangleMesh.
+/// </summary>
+/// <param name="primitive">= The primitive.</param>
+/// <param name="corners">= Receives the three corners.</param>
+/// <returns>Whether the primitive is a triangle.</returns>
+inline bool triangle_corners(const Primitive& primitive, std::array<Point3, 3>& corners)
+{
+    if (auto face = dynamic_cast<const MeshTriangle*>(&primitive))
+    {
+        for (int i = 0; i < 3; i++)
+            corners[i] = face->triangle_mesh().vertex(face->face_index(), i);
+        return true;
+    }
+
+    if (auto triangle = dynamic_cast<const Triangle*>(&primitive))
+    {
+        corners = { triangle->vertex(0), triangle->vertex(1), triangle->vertex(2) };
+        return true;
+    }
+
+    return false;
+}
+
+#endif
@@ -0,0 +1,376 @@
+#pragma once
+
+#ifndef TWOLEVELGRID_H
+#define TWOLEVELGRID_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "aabb.h"
+#include "configuration.hpp"
+#include "Grid.h"
+#include "leafprimitives.h"
+#include "primitive.h"
+
+/// <summary>
+/// A two-level grid for scenes with very uneven detail (a detailed model on a large ground plane). The top level is a coarse
+/// uniform grid; every top-level cell with many primitives gets its own uniform sub-grid, sized to the number of primitives in
+/// that cell, while sparse cells keep a plain list. Rays walk the top level with a 3D-DDA and walk the sub-grid of every dense cell
+/// they enter with a second 3D-DDA, limited to the part of the ray inside that cell.
+/// Like Grid, the primitive lists of all cells are stored in compressed sparse row form, shared by all sub-grids.
+/// </summary>
+class TwoLevelGrid : public Primitive
+{
+    public:
+        /// <summary>
+        /// Builds the grid.
+        /// </summary>
+        /// <param name="objects">= The primitives.</param>
+        /// <param name="top_density">= Top-level cells per primitive.</param>
+        /// <param name="cell_density">= Sub-grid cells per primitive in a dense top-level cell.</param>
+        /// <param name="subgrid_threshold">= Top-level cells with more primitives than this get a sub-grid.</param>
+        TwoLevelGrid(std::vector<shared_ptr<Primitive>> objects, double top_density = conf::grid2_top_density, double cell_density = conf::grid_density,
+                     int subgrid_threshold = conf::grid2_subgrid_threshold)
+            : primitives(std::move(objects))
+        {
+            if (primitives.empty())
+                return;
+
+            for (const auto& p : primitives.objects())
+                bounds = aabb(bounds, p->hitBox());
+
+            Vec3 dimensions(bounds.x.size(), bounds.y.size(), bounds.z.size());
+            top = make_level(Point3(bounds.x.min, bounds.y.min, bounds.z.min), dimensions,
+                             Grid::resolutionFor(dimensions, top_density * primitives.size(), conf::grid_max_voxels), 0);
+
+            // The top level is built as one sub-grid over all primitives; its dense cells are then split into sub-grids of their own
+            std::vector<uint32_t> all(primitives.size());
+            for (uint32_t i = 0; i < all.size(); i++)
+                all[i] = i;
+            fill_level(top, all);
+
+            top_cells.assign(top.num_cells(), -1);
+            for (int cell = 0; cell < top.num_cells(); cell++)
+            {
+                uint32_t count = cell_offsets[top.first_cell + cell + 1] - cell_offsets[top.first_cell + cell];
+                if (count <= uint32_t(subgrid_threshold))
+                    continue;
+
+                std::vector<uint32_t> prims(cell_primitive_begin(top, cell), cell_primitive_begin(top, cell) + count);
+                Point3 cell_min = top.cell_min(cell);
+                Vec3 cell_size(top.cell_size[0], top.cell_size[1], top.cell_size[2]);
+
+                Level sub = make_level(cell_min, cell_size, Grid::resolutionFor(cell_size, cell_density * count, conf::grid_max_voxels), uint32_t(cell_offsets.size() - 1));
+                fill_level(sub, prims);
+
+                top_cells[cell] = int(subgrids.size());
+                subgrids.push_back(sub);
+            }
+        }
+
+        aabb hitBox() const override { return bounds; }
+
+        bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
+        {
+            if (primitives.empty())
+                return false;
+
+            RayData ray(r);
+            double t0 = ray_t.min, t1 = ray_t.max;
+            if (!clip(top, ray, t0, t1))
+                return false;
+
+            TraceStats& stats = trace_stats();
+            bool hit_anything = false;
+            double closest = ray_t.max;
+            Mailbox mailbox;
+
+            walk(top, ray, t0, t1, [&](int cell, double t_enter, double t_exit)
+            {
+                stats.traversal_steps++;
+
+                int sub = top_cells[cell];
+                if (sub < 0)
+                    return test_cell(top, cell, r, ray_t.min, t_exit, closest, hit_anything, mailbox, rec);
+
+                const Level& level = subgrids[sub];
+                double s0 = t_enter, s1 = std::min(t_exit, closest);
+                if (!clip(level, ray, s0, s1))
+                    return false;
+
+                return walk(level, ray, s0, s1, [&](int sub_cell, double, double sub_exit)
+                {
+                    stats.traversal_steps++;
+                    return test_cell(level, sub_cell, r, ray_t.min, sub_exit, closest, hit_anything, mailbox, rec);
+                });
+            });
+
+            return hit_anything;
+        }
+
+        /// <summary>
+        /// Gets the memory used by the cells and primitive references, in bytes.
+        /// </summary>
+        size_t memory_bytes() const
+        {
+            return (cell_offsets.size() + cell_primitives.size()) * sizeof(uint32_t) + top_cells.size() * sizeof(int) + subgrids.size() * sizeof(Level);
+        }
+
+        /// <summary>
+        /// Prints the resolution, the memory and where the primitive references ended up.
+        /// </summary>
+        void print_stats(const std::string& name) const
+        {
+            size_t top_refs = 0, sub_refs = 0, sub_cells = 0, top_filled = 0, most = 0;
+            for (int cell = 0; cell < top.num_cells(); cell++)
+            {
+                uint32_t count = cell_count(top, cell);
+                top_filled += count > 0;
+                if (top_cells[cell] < 0)
+                {
+                    top_refs += count;
+                    most = std::max<size_t>(most, count);
+                }
+            }
+
+            for (const Level& level : subgrids)
+            {
+                sub_cells += level.num_cells();
+                for (int cell = 0; cell < level.num_cells(); cell++)
+                {
+                    sub_refs += cell_count(level, cell);
+                    most = std::max<size_t>(most, cell_count(level, cell));
+                }
+            }
+
+            std::cout << name << ": " << top.res[0] << " x " << top.res[1] << " x " << top.res[2] << " top-level cells (" << top_filled << " filled), "
+                      << subgrids.size() << " sub-grids with " << sub_cells << " cells, " << memory_bytes() / 1024 << " KiB\n";
+            std::cout << "  References: " << top_refs << " in top-level lists, " << sub_refs << " in sub-grids ("
+                      << double(top_refs + sub_refs) / primitives.size() << " per primitive), at most " << most << " in one cell\n";
+        }
+
+    private:
+        // One uniform grid: the top level, or the sub-grid of one top-level cell. Its cells are
+        // cell_offsets[first_cell + i] up to cell_offsets[first_cell + i + 1] in the shared arrays.
+        struct Level
+        {
+            double min[3];
+            double cell_size[3];
+            double inv_cell_size[3];
+            int res[3];
+            uint32_t first_cell;
+
+            int num_cells() const { return res[0] * res[1] * res[2]; }
+            int index(const int c[3]) const { return c[0] + res[0] * (c[1] + res[1] * c[2]); }
+
+            Point3 cell_min(int cell) const
+            {
+                int x = cell % res[0], y = (cell / res[0]) % res[1], z = cell / (res[0] * res[1]);
+                return Point3(min[0] + x * cell_size[0], min[1] + y * cell_size[1], min[2] + z * cell_size[2]);
+            }
+
+            int coordinate(double p, int axis) const
+            {
+                return std::clamp(int(std::floor((p - min[axis]) * inv_cell_size[axis])), 0, res[axis] - 1);
+            }
+        };
+
+        struct RayData
+        {
+            double origin[3];
+            double direction[3];
+            double inv_dir[3];
+
+            explicit RayData(const Ray& r)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    origin[a] = r.origin()[a];
+                    direction[a] = r.direction()[a];
+                    inv_dir[a] = 1.0 / direction[a];
+                }
+            }
+        };
+
+        LeafPrimitives primitives;
+        aabb bounds;
+
+        Level top;
+        std::vector<int> top_cells;         // Per top-level cell: the index of its sub-grid, or -1 for a plain list
+        std::vector<Level> subgrids;
+        std::vector<uint32_t> cell_offsets = { 0 };
+        std::vector<uint32_t> cell_primitives;
+
+        static Level make_level(const Point3& min, const Vec3& size, const std::array<int, 3>& res, uint32_t first_cell)
+        {
+            Level level;
+            for (int a = 0; a < 3; a++)
+            {
+                level.min[a] = min[a];
+                level.res[a] = res[a];
+                level.cell_size[a] = size[a] / res[a];
+
+                // An axis without extent has a single cell; any size works for it, as long as it is not zero
+                if (level.cell_size[a] <= 0)
+                    level.cell_size[a] = 1;
+                level.inv_cell_size[a] = 1.0 / level.cell_size[a];
+            }
+            level.first_cell = first_cell;
+            return level;
+        }
+
+        uint32_t cell_count(const Level& level, int cell) const
+        {
+            return cell_offsets[level.first_cell + cell + 1] - cell_offsets[level.first_cell + cell];
+        }
+
+        std::vector<uint32_t>::const_iterator cell_primitive_begin(const Level& level, int cell) const
+        {
+            return cell_primitives.begin() + cell_offsets[level.first_cell + cell];
+        }
+
+        /// <summary>
+        /// Appends the cells of a level to the shared arrays, with every primitive in the cells its bounding box overlaps.
+        /// </summary>
+        void fill_level(const Level& level, const std::vector<uint32_t>& prims)
+        {
+            auto for_each_cell = [&](uint32_t prim, auto f)
+            {
+                aabb box = primitives[prim]->hitBox();
+                int lo[3], hi[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    const Interval& slab = box.axis_interval(a);
+                    double cell_max = level.min[a] + level.res[a] * level.cell_size[a];
+
+                    // Only the part of the box inside the level counts (a sub-grid only covers its top-level cell)
+                    if (slab.max < level.min[a] || slab.min > cell_max)
+                        return;
+                    lo[a] = level.coordinate(slab.min, a);
+                    hi[a] = level.coordinate(slab.max, a);
+                }
+
+                int c[3];
+                for (c[2] = lo[2]; c[2] <= hi[2]; c[2]++)
+                    for (c[1] = lo[1]; c[1] <= hi[1]; c[1]++)
+                        for (c[0] = lo[0]; c[0] <= hi[0]; c[0]++)
+                            f(level.index(c));
+            };
+
+            // Count, prefix sum, fill: the same two passes as Grid
+            size_t base = cell_offsets.size() - 1;
+            std::vector<uint32_t> counts(level.num_cells() + 1, 0);
+            for (uint32_t prim : prims)
+                for_each_cell(prim, [&](int cell) { counts[cell + 1]++; });
+
+            uint32_t start = cell_offsets[base];
+            for (int cell = 0; cell < level.num_cells(); cell++)
+            {
+                counts[cell + 1] += counts[cell];
+                cell_offsets.push_back(start + counts[cell + 1]);
+            }
+
+            cell_primitives.resize(start + counts[level.num_cells()]);
+            for (uint32_t prim : prims)
+                for_each_cell(prim, [&](int cell) { cell_primitives[start + counts[cell]++] = prim; });
+        }
+
+        /// <summary>
+        /// Clips a ray segment to the box of a level.
+        /// </summary>
+        static bool clip(const Level& level, const RayData& ray, double& t0, double& t1)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                double lo = (level.min[a] - ray.origin[a]) * ray.inv_dir[a];
+                double hi = (level.min[a] + level.res[a] * level.cell_size[a] - ray.origin[a]) * ray.inv_dir[a];
+                if (ray.inv_dir[a] < 0)
+                    std::swap(lo, hi);
+
+                // A ray in the plane of a flat level gives NaN; it does not clip that axis
+                if (lo > t0) t0 = lo;
+                if (hi < t1) t1 = hi;
+            }
+            return t0 <= t1;
+        }
+
+        /// <summary>
+        /// Walks the cells of a level that the ray segment [t0, t1] passes, in order (Amanatides and Woo).
+        /// visit(cell, t_enter, t_exit) returns true to stop the walk.
+        /// </summary>
+        /// <returns>true if visit stopped the walk.</returns>
+        template<typename Visit>
+        static bool walk(const Level& level, const RayData& ray, double t0, double t1, Visit visit)
+        {
+            int c[3], step[3];
+            double t_next[3], t_delta[3];
+            for (int a = 0; a < 3; a++)
+            {
+                c[a] = level.coordinate(ray.origin[a] + t0 * ray.direction[a], a);
+                if (ray.direction[a] > 0)
+                {
+                    step[a] = 1;
+                    t_next[a] = (level.min[a] + (c[a] + 1) * level.cell_size[a] - ray.origin[a]) * ray.inv_dir[a];
+                    t_delta[a] = level.cell_size[a] * ray.inv_dir[a];
+                }
+                else if (ray.direction[a] < 0)
+                {
+                    step[a] = -1;
+                    t_next[a] = (level.min[a] + c[a] * level.cell_size[a] - ray.origin[a]) * ray.inv_dir[a];
+                    t_delta[a] = -level.cell_size[a] * ray.inv_dir[a];
+                }
+                else
+                {
+                    step[a] = 0;
+                    t_next[a] = INFINITY;
+                    t_delta[a] = INFINITY;
+                }
+            }
+
+            double t_enter = t0;
+            while (true)
+            {
+                int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+                double t_exit = std::min(t_next[axis], t1);
+
+                if (visit(level.index(c), t_enter, t_exit))
+                    return true;
+                if (t_next[axis] >= t1)
+                    return false;
+
+                c[axis] += step[axis];
+                if (c[axis] < 0 || c[axis] >= level.res[axis])
+                    return false;
+
+                t_enter = t_next[axis];
+                t_next[axis] += t_delta[axis];
+            }
+        }
+
+        /// <summary>
+        /// Tests the primitives of one cell, skipping the ones the ray tested in an earlier cell. Hits beyond the cell are kept
+        /// (the primitive sticks out of the cell) but only end the walk once the ray has reached their cell, so a nearer primitive
+        /// in a later cell is never missed.
+        /// </summary>
+        /// <returns>true if the closest hit is known and the walk can stop.</returns>
+        bool test_cell(const Level& level, int cell, const Ray& r, double t_min, double t_exit, double& closest, bool& hit_anything, Mailbox& mailbox, Hit_record& rec) const
+        {
+            for (uint32_t i = cell_offsets[level.first_cell + cell]; i < cell_offsets[level.first_cell + cell + 1]; i++)
+            {
+                if (mailbox.seen(cell_primitives[i]))
+                    continue;
+
+                if (primitives.hit(cell_primitives[i], r, Interval(t_min, closest), rec))
+                {
+                    hit_anything = true;
+                    closest = rec.t;
+                }
+            }
+            return hit_anything && closest <= t_exit;
+        }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#pragma once
+
+#ifndef WATERTIGHT_H
+#define WATERTIGHT_H
+
+#include <cmath>
+
+#include "interval.h"
+#include "ray.h"
+
+/// <summary>
+/// The result of the watertight triangle test: the distance along the ray, and the barycentric weights of the three corners.
+/// </summary>
+struct WatertightHit
+{
+    double t;
+    double b0, b1, b2;
+};
+
+/// <summary>
+/// Intersects a ray with a triangle without cracks (Woop, Benthin and Wald, "Watertight ray/triangle intersection", JCGT 2013).
+/// The corners are moved to the ray origin and sheared with the constants of the ray so that the ray becomes the +z axis, and
+/// the 2D edge functions are evaluated there. Two triangles that share an edge evaluate the same edge function with the sign
+/// flipped, so a ray through the edge hits at least one of them; a ray through a shared vertex hits at least one of the faces
+/// around it. This only holds if the triangles share the exact corner coordinates, as the faces of a mesh do.
+/// The test runs in precision T (float for meshes, double for separate triangles); an edge function that is exactly zero is
+/// recomputed in double precision, as the paper does for single precision.
+/// </summary>
+/// <param name="r">= The ray, with its shear constants.</param>
+/// <param name="a">= The first corner (x, y, z).</param>
+/// <param name="b">= The second corner.</param>
+/// <param name="c">= The third corner.</param>
+/// <param name="ray_t">= The interval of distances where the intersection is valid.</param>
+/// <param name="hit">= Receives the distance and the barycentric weights, only written when the triangle is hit.</param>
+template <typename T>
+inline bool watertight_hit(const Ray& r, const T a[3], const T b[3], const T c[3], Interval ray_t, WatertightHit& hit)
+{
+    const Point3& o = r.origin();
+    const int kx = r.kx, ky = r.ky, kz = r.kz;
+    const T sx = T(r.sx), sy = T(r.sy), sz = T(r.sz);
+
+    // The corners relative to the ray origin
+    const T ax = a[kx] - T(o[kx]), ay = a[ky] - T(o[ky]), az = a[kz] - T(o[kz]);
+    const T bx = b[kx] - T(o[kx]), by = b[ky] - T(o[ky]), bz = b[kz] - T(o[kz]);
+    const T cx = c[kx] - T(o[kx]), cy = c[ky] - T(o[ky]), cz = c[kz] - T(o[kz]);
+
+    // Shear them so the ray runs along z
+    const T Ax = ax - sx * az, Ay = ay - sy * az;
+    const T Bx = bx - sx * bz, By = by - sy * bz;
+    const T Cx = cx - sx * cz, Cy = cy - sy * cz;
+
+    // The scaled barycentric coordinates are the 2D edge functions
+    double U = Cx * By - Cy * Bx;
+    double V = Ax * Cy - Ay * Cx;
+    double W = Bx * Ay - By * Ax;
+
+    if (sizeof(T) < sizeof(double) && (U == 0 || V == 0 || W == 0))
+    {
+        U = double(Cx) * double(By) - double(Cy) * double(Bx);
+        V = double(Ax) * double(Cy) - double(Ay) * double(Cx);
+        W = double(Bx) * double(Ay) - double(By) * double(Ax);
+    }
+
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+        return false;
+
+    double det = U + V + W;
+    if (det == 0)
+        return false;
+
+    double t = (U * double(sz * az) + V * double(sz * bz) + W * double(sz * cz)) / det;
+    if (!ray_t.contains(t))
+        return false;
+
+    hit.t = t;
+    hit.b0 = U / det;
+    hit.b1 = V / det;
+    hit.b2 = W / det;
+    return true;
+}
+
+#endif
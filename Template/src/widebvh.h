@@ -0,0 +1,356 @@
+#pragma once
+
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDEBVH_SSE
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define WIDEBVH_AVX2
+#endif
+
+#include "flatbvh.h"
+#include "primitive.h"
+
+// A node of a wide BVH with up to N children. The child boxes are stored as structure of arrays (all min x values, then all
+// min y values, ...), so one SIMD instruction handles the same slab of every child.
+template <int N>
+struct alignas(32) WideBVHNode
+{
+    float bounds[6][N];     // min x, min y, min z, max x, max y, max z of every child
+    uint32_t child[N];      // Interior child: index of its node. Leaf child: index of its first primitive.
+    uint16_t count[N];      // Number of primitives of a leaf child; 0 for interior children and empty slots
+
+    WideBVHNode()
+    {
+        // Empty slots get an inverted box, which no ray can hit
+        for (int i = 0; i < N; i++)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                bounds[a][i] = INFINITY;
+                bounds[a + 3][i] = -INFINITY;
+            }
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+};
+
+/// <summary>
+/// A BVH with 4 or 8 children per node, made by collapsing a binary BVH. Every traversal step tests the ray against all
+/// children of a node at once: with SSE for 4 children, and with AVX2 (or two SSE halves when AVX2 is not enabled) for 8 children.
+/// Without SSE, the same test runs one child at a time. The children that are hit are visited from near to far.
+/// </summary>
+template <int N>
+class WideBVH : public Primitive
+{
+    static_assert(N == 4 || N == 8, "WideBVH supports 4 or 8 children per node");
+
+    public:
+        std::vector<WideBVHNode<N>> nodes;
+        LeafPrimitives primitives;
+
+        WideBVH() {}
+
+        /// <summary>
+        /// Collapses a binary BVH: every wide node takes the children of a binary node, and keeps replacing the child with the
+        /// largest surface area by its own two children until it has N children or only leaves are left.
+        /// </summary>
+        /// <param name="bvh">= The binary BVH; its primitive order is kept.</param>
+        explicit WideBVH(const FlatBVH& bvh) : primitives(bvh.primitives), bbox(bvh.hitBox())
+        {
+            if (bvh.nodes.empty())
+                return;
+
+            nodes.reserve(bvh.nodes.size() / 2 + 1);
+            nodes.emplace_back();
+            if (bvh.nodes[0].is_leaf())
+                set_child(0, 0, bvh.nodes[0]);
+            else
+                collapse(bvh, 0, 0);
+        }
+
+        aabb hitBox() const override { return bbox; }
+
+        bool hit(const Ray& r, Interval ray_t, Hit_record& rec) const override
+        {
+            if (nodes.empty())
+                return false;
+
+            RayData ray;
+            for (int a = 0; a < 3; a++)
+            {
+                double inv = 1.0 / r.direction()[a];
+                ray.origin[a] = float(r.origin()[a]);
+                ray.inv_dir[a] = float(inv);
+
+                // The near slab of a child is its min plane when the ray goes in the positive direction, otherwise its max plane
+                ray.near_plane[a] = inv < 0 ? a + 3 : a;
+                ray.far_plane[a] = inv < 0 ? a : a + 3;
+            }
+
+            const LeafPrimitives::RayData leaf_ray = LeafPrimitives::ray_data(r);
+
+            StackEntry stack[stack_capacity];
+            int stack_size = 0;
+            stack[stack_size++] = { 0, 0, -INFINITY };
+
+            TraceStats& stats = trace_stats();
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            while (stack_size > 0)
+            {
+                StackEntry entry = stack[--stack_size];
+                if (entry.t > closest)
+                    continue;
+
+                if (entry.count > 0)
+                {
+                    hit_anything |= primitives.hit_range(entry.index, entry.count, leaf_ray, r, ray_t.min, closest, rec);
+                    continue;
+                }
+
+                stats.traversal_steps++;
+                const WideBVHNode<N>& node = nodes[entry.index];
+
+                float t_near[N];
+                int mask = intersect_children(node, ray, round_down_float(ray_t.min), round_up_float(closest), t_near);
+                if (mask == 0)
+                    continue;
+
+                // Sort the children that are hit from far to near, so the nearest one ends up on top of the stack
+                StackEntry hits[N];
+                int num_hits = 0;
+                for (int i = 0; i < N; i++)
+                {
+                    if (!(mask & (1 << i)))
+                        continue;
+
+                    StackEntry e = { node.child[i], node.count[i], t_near[i] };
+                    int j = num_hits++;
+                    while (j > 0 && hits[j - 1].t < e.t)
+                    {
+                        hits[j] = hits[j - 1];
+                        j--;
+                    }
+                    hits[j] = e;
+                }
+
+                for (int i = 0; i < num_hits; i++)
+                    stack[stack_size++] = hits[i];
+            }
+
+            return hit_anything;
+        }
+
+        /// <summary>
+        /// Gets the memory used by the nodes, in bytes.
+        /// </summary>
+        size_t node_bytes() const { return nodes.size() * sizeof(WideBVHNode<N>); }
+
+        /// <summary>
+        /// Gets the average number of used child slots per node.
+        /// </summary>
+        double average_children() const
+        {
+            size_t used = 0;
+            for (const WideBVHNode<N>& node : nodes)
+                for (int i = 0; i < N; i++)
+                    used += node.count[i] > 0 || node.bounds[0][i] <= node.bounds[3][i];
+            return nodes.empty() ? 0 : double(used) / nodes.size();
+        }
+
+        /// <summary>
+        /// Gets the name of the instruction set used for the child tests.
+        /// </summary>
+        static const char* simd_name()
+        {
+#if defined(WIDEBVH_AVX2)
+            return N == 8 ? "AVX2" : "SSE";
+#elif defined(WIDEBVH_SSE)
+            return "SSE";
+#else
+            return "scalar";
+#endif
+        }
+
+    private:
+        // Every step pops one entry and pushes at most N. Collapsing never makes a tree deeper, so at most FlatBVH::max_depth
+        // interior nodes (the limit the builders keep the binary tree to) each leave N - 1 entries on the stack
+        static constexpr int stack_capacity = FlatBVH::max_depth * (N - 1) + 1;
+
+        struct RayData
+        {
+            float origin[3];
+            float inv_dir[3];
+            int near_plane[3];
+            int far_plane[3];
+        };
+
+        struct StackEntry
+        {
+            uint32_t index;     // Node index, or first primitive of a leaf
+            uint32_t count;     // Number of primitives of a leaf, 0 for a node
+            float t;            // Distance at which the ray enters the box
+        };
+
+        aabb bbox;
+
+        // Float slab distances can be off by a few ulps; widening the exit distance keeps boxes that are just touched from being missed
+        static constexpr float t_far_scale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+        void set_child(uint32_t index, int slot, const FlatBVHNode& source)
+        {
+            WideBVHNode<N>& node = nodes[index];
+            for (int a = 0; a < 3; a++)
+            {
+                node.bounds[a][slot] = source.bounds_min[a];
+                node.bounds[a + 3][slot] = source.bounds_max[a];
+            }
+            node.child[slot] = source.offset;
+            node.count[slot] = source.count;
+        }
+
+        /// <summary>
+        /// Fills the wide node at an index with the (grand)children of an interior node of the binary BVH.
+        /// </summary>
+        void collapse(const FlatBVH& bvh, uint32_t index, uint32_t binary_index)
+        {
+            const FlatBVHNode& source = bvh.nodes[binary_index];
+            std::vector<uint32_t> slots = { binary_index + 1, source.offset };
+
+            while (int(slots.size()) < N)
+            {
+                int largest = -1;
+                double largest_area = -1;
+                for (int i = 0; i < int(slots.size()); i++)
+                {
+                    const FlatBVHNode& candidate = bvh.nodes[slots[i]];
+                    if (!candidate.is_leaf() && candidate.surface_area() > largest_area)
+                    {
+                        largest = i;
+                        largest_area = candidate.surface_area();
+                    }
+                }
+                if (largest < 0)
+                    break;
+
+                uint32_t expanded = slots[largest];
+                slots[largest] = expanded + 1;
+                slots.push_back(bvh.nodes[expanded].offset);
+            }
+
+            for (int slot = 0; slot < int(slots.size()); slot++)
+            {
+                const FlatBVHNode& child = bvh.nodes[slots[slot]];
+                set_child(index, slot, child);
+                if (child.is_leaf())
+                    continue;
+
+                uint32_t child_index = uint32_t(nodes.size());
+                nodes.emplace_back();
+                nodes[index].child[slot] = child_index;
+                collapse(bvh, child_index, slots[slot]);
+            }
+        }
+
+        /// <summary>
+        /// Tests the ray against the boxes of all children of a node.
+        /// </summary>
+        /// <param name="t_near">= Gets the distance at which the ray enters every child box.</param>
+        /// <returns>A bit mask of the children that are hit within t_min .. t_max.</returns>
+        static int intersect_children(const WideBVHNode<N>& node, const RayData& ray, float t_min, float t_max, float t_near[N])
+        {
+#if defined(WIDEBVH_AVX2)
+            if constexpr (N == 8)
+                return intersect_avx2(node, ray, t_min, t_max, t_near);
+#endif
+#if defined(WIDEBVH_SSE)
+            int mask = 0;
+            for (int offset = 0; offset < N; offset += 4)
+                mask |= intersect_sse(node, offset, ray, t_min, t_max, t_near) << offset;
+            return mask;
+#else
+            return intersect_scalar(node, ray, t_min, t_max, t_near);
+#endif
+        }
+
+        static int intersect_scalar(const WideBVHNode<N>& node, const RayData& ray, float t_min, float t_max, float t_near[N])
+        {
+            int mask = 0;
+            for (int i = 0; i < N; i++)
+            {
+                float t0 = t_min;
+                float t1 = t_max;
+                for (int a = 0; a < 3; a++)
+                {
+                    float near_t = (node.bounds[ray.near_plane[a]][i] - ray.origin[a]) * ray.inv_dir[a];
+                    float far_t = (node.bounds[ray.far_plane[a]][i] - ray.origin[a]) * ray.inv_dir[a];
+
+                    // Written so a NaN (0 * infinity for a ray in the plane of the box) leaves the interval as it is
+                    t0 = near_t > t0 ? near_t : t0;
+                    t1 = far_t < t1 ? far_t : t1;
+                }
+
+                t_near[i] = t0;
+                if (t0 <= t1 * t_far_scale)
+                    mask |= 1 << i;
+            }
+            return mask;
+        }
+
+#if defined(WIDEBVH_SSE)
+        static int intersect_sse(const WideBVHNode<N>& node, int offset, const RayData& ray, float t_min, float t_max, float t_near[N])
+        {
+            __m128 t0 = _mm_set1_ps(t_min);
+            __m128 t1 = _mm_set1_ps(t_max);
+            for (int a = 0; a < 3; a++)
+            {
+                __m128 origin = _mm_set1_ps(ray.origin[a]);
+                __m128 inv_dir = _mm_set1_ps(ray.inv_dir[a]);
+                __m128 near_t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[ray.near_plane[a]][offset]), origin), inv_dir);
+                __m128 far_t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[ray.far_plane[a]][offset]), origin), inv_dir);
+
+                // max/min return the second operand when one of them is NaN, which keeps the interval as it is
+                t0 = _mm_max_ps(near_t, t0);
+                t1 = _mm_min_ps(far_t, t1);
+            }
+
+            _mm_storeu_ps(&t_near[offset], t0);
+            return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(t_far_scale))));
+        }
+#endif
+
+#if defined(WIDEBVH_AVX2)
+        static int intersect_avx2(const WideBVHNode<N>& node, const RayData& ray, float t_min, float t_max, float t_near[N])
+        {
+            __m256 t0 = _mm256_set1_ps(t_min);
+            __m256 t1 = _mm256_set1_ps(t_max);
+            for (int a = 0; a < 3; a++)
+            {
+                __m256 origin = _mm256_set1_ps(ray.origin[a]);
+                __m256 inv_dir = _mm256_set1_ps(ray.inv_dir[a]);
+                __m256 near_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.near_plane[a]]), origin), inv_dir);
+                __m256 far_t = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.far_plane[a]]), origin), inv_dir);
+
+                t0 = _mm256_max_ps(near_t, t0);
+                t1 = _mm256_min_ps(far_t, t1);
+            }
+
+            _mm256_storeu_ps(t_near, t0);
+            return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(t_far_scale)), _CMP_LE_OQ));
+        }
+#endif
+};
+
+#endif